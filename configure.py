@@ -29,6 +29,12 @@ Options: (options in the same section are mutually exclusive)
     [endianess]:
         -le (default)       compile for little endian arch
 	-be                 compile for big endian arch
+
+    [linux network backend]:
+        -epoll (default)    readiness based backend (linux/network.c)
+        -uring              io_uring based backend (linux/network_uring.c)
+        -memnet             in-memory backend without sockets (network_mem.c)
+                            (this is useful for benchmarking, on any platform)
 '''
 
 MakefileHeader = r'''
@@ -56,17 +62,19 @@ MakefileObject = r'''
 '''
 
 DEPS = [
-	"atomic.h", "cmdline.h", "connection.h", "log.h",
-	"message.h", "mmblock.h", "mm.h", "network.h",
-	"scheduler.h", "server.h", "system.h", "thread.h",
+	"admission.h", "atomic.h", "cmdline.h", "connection.h", "log.h",
+	"message.h", "mmblock.h", "mm.h", "network.h", "network_mem.h",
+	"scheduler.h", "server.h", "system.h", "task_graph.h", "thread.h",
+	"timeout.h",
 	"types.h", "util.h", "work.h", "work_group.h",
 ]
 
 COMMON = [
-	"adler32.o", "cmdline.o", "connection.o", "log.o",
+	"adler32.o", "admission.o", "cmdline.o", "connection.o", "log.o",
 	"main.o", "message.o", "mmblock.o", "mm.o",
 	"protocol_game.o", "protocol_login.o", "protocol_old.o",
-	"protocol_test.o", "scheduler.o", "server.o", "work.o",
+	"protocol_test.o", "scheduler.o", "server.o", "task_graph.o",
+	"timeout.o", "work.o",
 	"work_group.o",
 ]
 
@@ -80,6 +88,11 @@ LINUX = [
 	"posix/system.o", "posix/thread.o", "linux/network.o",
 ]
 
+LINUX_URING = [
+	"linux/atomic.o",
+	"posix/system.o", "posix/thread.o", "linux/network_uring.o",
+]
+
 FREEBSD = [
 	"freebsd/atomic.o",
 	"posix/system.o", "posix/thread.o", "freebsd/network.o",
@@ -94,6 +107,7 @@ if __name__ == "__main__":
 	compiler	= "CLANG"
 	build		= "RELEASE"
 	platform	= "WIN32"
+	netbackend	= "EPOLL"
 
 	#default to this platform byteorder
 	byteorder	= "LITTLE"
@@ -149,6 +163,16 @@ if __name__ == "__main__":
 		elif opt == "-be":
 			byteorder = "BIG"
 
+		#linux network backends
+		elif opt == "-epoll":
+			netbackend = "EPOLL"
+
+		elif opt == "-uring":
+			netbackend = "URING"
+
+		elif opt == "-memnet":
+			netbackend = "MEM"
+
 		# invalid option
 		else:
 			print("[warning] Invalid option used: \"%s\"" % opt)
@@ -176,7 +200,11 @@ if __name__ == "__main__":
 	if platform == "WIN32":
 		OBJECTS.extend(WIN32)
 	elif platform == "LINUX":
-		OBJECTS.extend(LINUX)
+		if netbackend == "URING":
+			OBJECTS.extend(LINUX_URING)
+		else:
+			OBJECTS.extend(LINUX)
+		CDEFS += " -D_DEFAULT_SOURCE"
 	elif platform == "FREEBSD":
 		OBJECTS.extend(FREEBSD)
 		CDEFS += " -D__BSD_VISIBLE=1"
@@ -184,6 +212,11 @@ if __name__ == "__main__":
 		print("[error] invalid platform")
 		sys.exit()
 
+	#replace the platform network backend
+	if netbackend == "MEM":
+		OBJECTS = [obj for obj in OBJECTS if "/network" not in obj]
+		OBJECTS.append("network_mem.o")
+
 	#check build
 	if build == "RELEASE":
 		LDFLAGS = "-s -O2"
@@ -1,3 +1,5 @@
+#include "util.h"
+
 #include <stddef.h>
 
 #define BASE 65521U
@@ -11,8 +13,15 @@
 
 unsigned long adler32(const unsigned char *buf, unsigned long len)
 {
-	unsigned long a = 1;
-	unsigned long b = 0;
+	return adler32_update(1, buf, len);
+}
+
+// continues the checksum of data split in pieces
+// (adler is 1 for the first one)
+unsigned long adler32_update(unsigned long adler, const unsigned char *buf, unsigned long len)
+{
+	unsigned long a = adler & 0xFFFF;
+	unsigned long b = adler >> 16;
 	int k;
 
 	while(len > 0){
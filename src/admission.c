@@ -0,0 +1,212 @@
+#include "admission.h"
+
+#include "atomic.h"
+#include "system.h"
+#include "log.h"
+
+#include <stddef.h>
+
+// open addressing table of addresses with linear probing; slots
+// are claimed with a CAS on the address and are never freed but
+// a slot without connections may be taken over by another address:
+// its connections go from 0 to SLOT_TAKEOVER while the address is
+// swapped so no connection can be counted on it meanwhile (whoever
+// was about to use it for the old address sees the change and
+// looks it up again)
+#define TABLE_SLOTS	8192
+#define TABLE_MASK	(TABLE_SLOTS - 1)
+#define MAX_PROBES	16
+#define SLOT_TAKEOVER	-1
+
+struct entry{
+	atomic_int	addr;
+	atomic_int	connections;
+
+	// connections started on the current one second window
+	atomic_int	window;
+	atomic_int	started;
+};
+
+static struct entry	table[TABLE_SLOTS];
+static int		max_connections = 0;
+static int		max_rate = 0;
+
+static atomic_int	admitted = 0;
+static atomic_int	rejected_connections = 0;
+static atomic_int	rejected_rate = 0;
+static atomic_int	untracked = 0;
+static atomic_int	unknown_releases = 0;
+
+static unsigned hash(int addr)
+{
+	return ((unsigned)addr * 2654435761U) >> 19;
+}
+
+// returns the slot of addr, claiming a new one if it's not on the
+// table yet, or NULL if every slot on its probe sequence is taken
+static struct entry *entry_get(int addr, int now)
+{
+	struct entry *e;
+	unsigned pos;
+	int old;
+
+	pos = hash(addr);
+	for(int i = 0; i < MAX_PROBES; i++){
+		e = &table[(pos + i) & TABLE_MASK];
+		old = atomic_load(&e->addr);
+		if(old == addr)
+			return e;
+
+		if(old == 0 && atomic_compare_exchange(&e->addr, 0, addr) == 0)
+			return e;
+	}
+
+	// take over a slot without connections, preferring the ones
+	// that didn't start connections recently (taking over a busy
+	// one loses its rate window but keeps the address tracked)
+	for(int pass = 0; pass < 2; pass++){
+		for(int i = 0; i < MAX_PROBES; i++){
+			e = &table[(pos + i) & TABLE_MASK];
+			old = atomic_load(&e->addr);
+			if(old == addr)
+				return e;
+
+			if((pass > 0 || now - atomic_load(&e->window) > 1)
+					&& atomic_compare_exchange(&e->connections, 0, SLOT_TAKEOVER) == 0){
+				if(atomic_compare_exchange(&e->addr, old, addr) == old){
+					atomic_store(&e->started, 0);
+					atomic_store(&e->connections, 0);
+					return e;
+				}
+				atomic_store(&e->connections, 0);
+			}
+		}
+	}
+	return NULL;
+}
+
+// counts a connection on the slot or returns -1
+// if the slot is being taken over
+static int entry_enter(struct entry *e)
+{
+	int c;
+	do{
+		c = atomic_load(&e->connections);
+		if(c == SLOT_TAKEOVER)
+			return -1;
+	} while(atomic_compare_exchange(&e->connections, c, c + 1) != c);
+	return 0;
+}
+
+// returns the slot of addr or NULL if it's not on the table
+static struct entry *entry_find(int addr)
+{
+	struct entry *e;
+	unsigned pos;
+
+	pos = hash(addr);
+	for(int i = 0; i < MAX_PROBES; i++){
+		e = &table[(pos + i) & TABLE_MASK];
+		if(atomic_load(&e->addr) == addr)
+			return e;
+	}
+	return NULL;
+}
+
+void admission_init(int max_conns, int max_conn_rate)
+{
+	for(int i = 0; i < TABLE_SLOTS; i++){
+		table[i].addr = 0;
+		table[i].connections = 0;
+		table[i].window = 0;
+		table[i].started = 0;
+	}
+	max_connections = (max_conns > 0) ? max_conns : 0;
+	max_rate = (max_conn_rate > 0) ? max_conn_rate : 0;
+	admitted = 0;
+	rejected_connections = 0;
+	rejected_rate = 0;
+	untracked = 0;
+	unknown_releases = 0;
+}
+
+int admission_acquire(unsigned long addr)
+{
+	struct entry *e;
+	int key, now, window;
+
+	if(max_connections == 0 && max_rate == 0)
+		return 1;
+
+	// addresses that aren't IPv4 aren't tracked
+	key = (int)addr;
+	if(key == 0){
+		atomic_add(&admitted, 1);
+		return 1;
+	}
+
+	now = (int)(sys_get_tick_count() / 1000);
+	while(1){
+		e = entry_get(key, now);
+		if(e == NULL){
+			// the table is crowded so let it through
+			atomic_add(&untracked, 1);
+			atomic_add(&admitted, 1);
+			return 1;
+		}
+
+		// start a new rate window (connections started on the
+		// same second by other threads may be lost on the reset)
+		window = atomic_load(&e->window);
+		if(window != now && atomic_compare_exchange(&e->window, window, now) == window)
+			atomic_store(&e->started, 0);
+
+		// a slot with connections can't be taken over so if
+		// it still has the address the connection is on it
+		if(entry_enter(e) == 0){
+			if(atomic_load(&e->addr) == key)
+				break;
+
+			// the slot was taken over by another address
+			atomic_add(&e->connections, -1);
+		}
+	}
+
+	if(max_rate > 0 && atomic_fetch_add(&e->started, 1) >= max_rate){
+		atomic_add(&e->connections, -1);
+		atomic_add(&rejected_rate, 1);
+		return -1;
+	}
+
+	if(max_connections > 0 && atomic_load(&e->connections) > max_connections){
+		atomic_add(&e->connections, -1);
+		atomic_add(&rejected_connections, 1);
+		return -1;
+	}
+
+	atomic_add(&admitted, 1);
+	return 0;
+}
+
+void admission_release(unsigned long addr)
+{
+	struct entry *e;
+
+	// slots with connections are never taken over
+	e = entry_find((int)addr);
+	if(e == NULL){
+		LOG_ERROR("admission_release: address not found");
+		atomic_add(&unknown_releases, 1);
+		return;
+	}
+	atomic_add(&e->connections, -1);
+}
+
+void admission_get_stats(struct admission_stats *stats)
+{
+	stats->admitted = atomic_load(&admitted);
+	stats->rejected_connections = atomic_load(&rejected_connections);
+	stats->rejected_rate = atomic_load(&rejected_rate);
+	stats->untracked = atomic_load(&untracked);
+	stats->unknown_releases = atomic_load(&unknown_releases);
+}
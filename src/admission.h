@@ -0,0 +1,30 @@
+#ifndef ADMISSION_H_
+#define ADMISSION_H_
+
+// per address admission control for accepted connections
+// (only IPv4 addresses are tracked)
+
+struct admission_stats{
+	long	admitted;
+	long	rejected_connections;
+	long	rejected_rate;
+	long	untracked;
+	long	unknown_releases;	// released addresses that weren't on the table
+};
+
+// max_connections is the number of concurrent connections and
+// max_rate the number of new connections per second allowed from
+// each address (0 disables the limit)
+void	admission_init(int max_connections, int max_rate);
+
+// returns 0 if a connection from addr is admitted and tracked (it
+// must be released with admission_release), 1 if it's admitted but
+// not tracked (limits disabled, not IPv4 or the table is crowded)
+// or -1 if it was rejected
+int	admission_acquire(unsigned long addr);
+void	admission_release(unsigned long addr);
+
+// counters since admission_init
+void	admission_get_stats(struct admission_stats *stats);
+
+#endif //ADMISSION_H_
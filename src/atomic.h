@@ -7,12 +7,19 @@
 // order on the optimizer stage
 typedef volatile int atomic_int;
 
+// atomic pointer type
+typedef void *volatile atomic_ptr;
+
 int	atomic_load(atomic_int *x);
 void	atomic_store(atomic_int *x, int val);
 void	atomic_add(atomic_int *x, int val);
 int	atomic_fetch_add(atomic_int *x, int val);
 int	atomic_exchange(atomic_int *x, int val);
 int	atomic_compare_exchange(atomic_int *x, int cmp, int val);
+void	*atomic_load_ptr(atomic_ptr *x);
+void	atomic_store_ptr(atomic_ptr *x, void *val);
+void	*atomic_exchange_ptr(atomic_ptr *x, void *val);
+void	*atomic_compare_exchange_ptr(atomic_ptr *x, void *cmp, void *val);
 void	atomic_lwfence();
 void	atomic_hwfence();
 
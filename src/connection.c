@@ -1,15 +1,19 @@
 #include "connection.h"
 
+#include "admission.h"
 #include "message.h"
 #include "mmblock.h"
 #include "server.h"
 #include "network.h"
+#include "system.h"
 #include "thread.h"
-#include "scheduler.h"
+#include "timeout.h"
+#include "work.h"
 #include "log.h"
 #include "util.h"
 
 #include <stddef.h>
+#include <string.h>
 
 #define CONNECTION_OPEN			0x00
 #define CONNECTION_CLOSED		0x01
@@ -17,34 +21,143 @@
 #define CONNECTION_FIRST_MSG		0x04
 #define CONNECTION_RD_TIMEOUT_CANCEL	0x08
 #define CONNECTION_WR_TIMEOUT_CANCEL	0x10
+#define CONNECTION_RD_STALLED		0x20
+#define CONNECTION_CORKED		0x40
+#define CONNECTION_HANDLE_RELEASE	0x80
+
+// the receive buffer is borrowed from the message pool: idle
+// connections read into a small one and it grows when a frame
+// doesn't fit or a read fills it (it's shrunk back once a read
+// leaves nothing behind)
+#define RDBUF_MIN 256
+#define RDBUF_MAX 16384
 
 #define RD_TIMEOUT 30000 // 30sec
 #define WR_TIMEOUT 30000 // 30sec
-#define MAX_OUTPUT 8
+
+// output messages borrowed by a connection and not yet written
+// (a single write takes at most NET_MAX_IOV of them); they're kept
+// on a ring instead of being linked so a shared message can be
+// queued on many connections at once
+#define MAX_OUTPUT 64
+
+// complete frames are copied into input messages and handed to the
+// protocol on the connection strand; the read chain stalls when the
+// handlers fall this many messages behind (input frames are kept on
+// a single buffer so they can't be bigger than the read buffer)
+#define MAX_INPUT 4
+#define MAX_INPUT_LEN RDBUF_MAX
 struct connection{
 	struct socket		*sock;
 	long			flags;
 	long			ref_count;
-	struct message		input;
-	struct message		output[MAX_OUTPUT];
-	struct message		*output_queue;
+
+	// remote address tracked by the admission
+	// control (0 if it's not tracked)
+	unsigned long		admitted_addr;
+
+	struct message		*input[MAX_INPUT];
+	long			input_first;
+	long			input_count;
+	struct message		*rdbuf;
+	long			rdstart;
+	long			rdend;
+	struct message		*output[MAX_OUTPUT];
+	long			output_first;
+	long			output_queued;
+	long			output_count;
+	long			output_inflight;
 	struct mutex		*lock;
 
+	// the protocol and its handle are only used by
+	// work running on the connection strand
+	struct strand		*strand;
 	struct protocol		*protocol;
 	void			*handle;
 
-	struct sch_entry	*rd_timeout;
-	struct sch_entry	*wr_timeout;
+	struct timeout		rd_timeout;
+	struct timeout		wr_timeout;
+
+	// registry slot and statistics
+	long			registry_index;
+	long			connected_at;
+	long			messages_in;
+	long			messages_out;
+	long			bytes_in;
+	long			bytes_out;
 };
 
 #define MAX_CONNECTIONS 2048
 static struct mmblock		*connblk;
 
+// live connections are kept on a dense array so they can be
+// iterated without walking the memory block (a removed connection
+// has its slot taken by the last one)
+// NOTE: the registry lock is always taken BEFORE a connection lock
+static struct connection	*registry[MAX_CONNECTIONS];
+static long			registry_count = 0;
+static struct mutex		*registry_lock;
+static struct condvar		*registry_empty;
+
+// time given to aborted connections to be released
+// after a drain times out
+#define DRAIN_ABORT_TIMEOUT	1000 // 1sec
+
+// output writes of at least this many bytes are sent with
+// zero-copy (0 keeps the default copying sends); it's off by
+// default since the kernel still copies on loopback and small
+// writes where zero-copy costs more than it saves
+static int			zerocopy_threshold = 0;
+
 static void internal_release(struct connection *conn);
-static void on_read_length(struct socket *sock, int error, int transfered, void *udata);
-static void on_read_body(struct socket *sock, int error, int transfered, void *udata);
+static void on_read(struct socket *sock, int error, int transfered, void *udata);
 static void on_write(struct socket *sock, int error, int transfered, void *udata);
 
+static void registry_add(struct connection *conn)
+{
+	mutex_lock(registry_lock);
+	conn->registry_index = registry_count;
+	registry[registry_count] = conn;
+	registry_count += 1;
+	mutex_unlock(registry_lock);
+}
+
+static void registry_remove(struct connection *conn)
+{
+	struct connection *last;
+
+	mutex_lock(registry_lock);
+	registry_count -= 1;
+	last = registry[registry_count];
+	registry[conn->registry_index] = last;
+	last->registry_index = conn->registry_index;
+	if(registry_count == 0)
+		condvar_broadcast(registry_empty);
+	mutex_unlock(registry_lock);
+}
+
+// takes a reference to every live connection and returns how
+// many were stored on conns (connections already being released
+// are skipped); the references must be dropped with internal_release
+static long registry_snapshot(struct connection **conns)
+{
+	struct connection *conn;
+	long count = 0;
+
+	mutex_lock(registry_lock);
+	for(long i = 0; i < registry_count; i++){
+		conn = registry[i];
+		mutex_lock(conn->lock);
+		if(conn->ref_count > 0){
+			conn->ref_count += 1;
+			conns[count++] = conn;
+		}
+		mutex_unlock(conn->lock);
+	}
+	mutex_unlock(registry_lock);
+	return count;
+}
+
 // NOTE: must be used OUTSIDE the connection lock!!
 static void internal_release(struct connection *conn)
 {
@@ -56,9 +169,29 @@ static void internal_release(struct connection *conn)
 			conn->sock = NULL;
 		}
 
-		// destroy connection lock
+		// return the read buffer and whatever was left on the
+		// output queue (input messages are released by their
+		// handlers which hold a reference)
+		if(conn->rdbuf != NULL)
+			message_free(conn->rdbuf);
+		while(conn->output_queued > 0){
+			message_free(conn->output[conn->output_first]);
+			conn->output_first = (conn->output_first + 1) % MAX_OUTPUT;
+			conn->output_queued -= 1;
+		}
+
+		// remove the connection from the registry before
+		// destroying its lock (registry iteration may be
+		// waiting on it to skip the connection)
 		mutex_unlock(conn->lock);
+		registry_remove(conn);
+
+		// destroy connection lock and strand (the strand
+		// is released after the work running on it)
 		mutex_destroy(conn->lock);
+		strand_destroy(conn->strand);
+		if(conn->admitted_addr != 0)
+			admission_release(conn->admitted_addr);
 
 		// release connection memory
 		mmblock_xfree(connblk, conn);
@@ -73,7 +206,7 @@ static void internal_release(struct connection *conn)
 static inline
 void cancel_rd_timeout(struct connection *conn)
 {
-	if(scheduler_remove(conn->rd_timeout) == -1)
+	if(timeout_remove(&conn->rd_timeout) == -1)
 		conn->flags |= CONNECTION_RD_TIMEOUT_CANCEL;
 	else
 		conn->ref_count -= 1;
@@ -83,7 +216,7 @@ void cancel_rd_timeout(struct connection *conn)
 static inline
 void cancel_wr_timeout(struct connection *conn)
 {
-	if(scheduler_remove(conn->wr_timeout) == -1)
+	if(timeout_remove(&conn->wr_timeout) == -1)
 		conn->flags |= CONNECTION_WR_TIMEOUT_CANCEL;
 	else
 		conn->ref_count -= 1;
@@ -93,7 +226,6 @@ static void read_timeout_handler(void *arg)
 {
 	struct connection *conn = arg;
 	mutex_lock(conn->lock);
-	conn->rd_timeout = NULL;
 	if((conn->flags & CONNECTION_RD_TIMEOUT_CANCEL) != 0){
 		conn->flags &= ~(CONNECTION_RD_TIMEOUT_CANCEL);
 		mutex_unlock(conn->lock);
@@ -108,7 +240,6 @@ static void write_timeout_handler(void *arg)
 {
 	struct connection *conn = arg;
 	mutex_lock(conn->lock);
-	conn->wr_timeout = NULL;
 	if((conn->flags & CONNECTION_WR_TIMEOUT_CANCEL) != 0){
 		conn->flags &= ~(CONNECTION_WR_TIMEOUT_CANCEL);
 		mutex_unlock(conn->lock);
@@ -120,122 +251,346 @@ static void write_timeout_handler(void *arg)
 	internal_release(conn);
 }
 
-static void on_read_length(struct socket *sock, int error, int transfered, void *udata)
+// NOTE: must be used on the connection strand and
+// OUTSIDE the connection lock
+static int dispatch_message(struct connection *conn, struct message *msg, int first)
 {
-	struct connection	*conn = udata;
-	struct message		*msg = &conn->input;
+	struct protocol	*proto;
+	long		proto_id;
+	uint32_t	checksum;
 
-	mutex_lock(conn->lock);
-	// the message length on a read operation
-	// will have only the length of the body
-	msg->readpos = 0;
-	msg->length = message_get_u16(msg);
-	if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING)) == 0
-			&& error == 0 && transfered > 0 && msg->length > 0
-			&& msg->length+2 <= MESSAGE_BUFFER_LEN){
+	// check if the message has a checksum
+	checksum = adler32(msg->buffer + 6, msg->length - 4);
+	if(checksum != message_get_u32(msg)){
+		msg->readpos -= 4;
+	}
+	else{
+		LOG_DEBUG("valid checksum: %lu", checksum);
+	}
 
-		// NOTE: need to reschedule read timeout only
-		// after reading the body and not here
+	// check if it's the first message
+	if(first != 0){
+		// if handle is still NULL the service has multiple
+		// protocols and we need to choose it now
+		if(conn->handle == NULL){
+			proto = conn->protocol;
+			proto_id = message_get_byte(msg);
+			while(proto != NULL && proto->identifier != proto_id)
+				proto = proto->next;
 
-		// chain body read
-		if(net_async_read(sock, msg->buffer+2, msg->length,
-				on_read_body, conn) == 0){
-			mutex_unlock(conn->lock);
-			return;
+			// if the requested protocol wasn't found, abort connection
+			if(proto == NULL)
+				return -1;
+
+			// create protocol handle
+			conn->handle = proto->handle_create(conn);
+			conn->protocol = proto;
 		}
+		conn->protocol->on_recv_first_message(conn->handle, msg);
+	}
+	else{
+		conn->protocol->on_recv_message(conn->handle, msg);
+	}
+	return 0;
+}
+
+static int resume_input(struct connection *conn);
+static void input_handler(void *arg)
+{
+	struct connection	*conn = arg;
+	struct message		*msg;
+	int			first, error, rd_close;
 
+	// the protocol handlers run without the connection lock
+	// so they don't hold the network thread (the input message
+	// isn't touched by it until it's released below)
+	mutex_lock(conn->lock);
+	msg = conn->input[conn->input_first];
+	error = 0;
+	if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING)) == 0){
+		first = ((conn->flags & CONNECTION_FIRST_MSG) == 0);
+		conn->flags |= CONNECTION_FIRST_MSG;
+		mutex_unlock(conn->lock);
+		error = dispatch_message(conn, msg, first);
+		mutex_lock(conn->lock);
 	}
 
-	cancel_rd_timeout(conn);
+	// release the input message and resume the
+	// read chain if it was stalled on it
+	message_free(msg);
+	conn->input[conn->input_first] = NULL;
+	conn->input_first = (conn->input_first + 1) % MAX_INPUT;
+	conn->input_count -= 1;
+	rd_close = (error == 0) ? resume_input(conn) : 0;
 	mutex_unlock(conn->lock);
-	connection_close(conn, 0);
+	if(error != 0 || rd_close != 0)
+		connection_close(conn, 0);
+	if(rd_close != 0)
+		internal_release(conn);
 	internal_release(conn);
 }
 
-static void on_read_body(struct socket *sock, int error, int transfered, void *udata)
+static void connect_handler(void *arg)
 {
-	struct connection	*conn = udata;
-	struct message		*msg = &conn->input;
-	struct protocol		*proto;
-	long			proto_id;
-	uint32_t		checksum;
+	struct connection	*conn = arg;
+	int			closed;
 
 	mutex_lock(conn->lock);
-	// check for errors or if the connection is closed/closing
-	if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING)) == 0
-			&& error == 0 && transfered > 0){
-		// check if the message has a checksum
-		checksum = adler32(msg->buffer + 6, msg->length - 4);
-		if(checksum != message_get_u32(msg))
-			msg->readpos -= 4;
-		else
-			LOG("valid checksum: %lu", checksum);
-
-		// check if it's the first message
-		if((conn->flags & CONNECTION_FIRST_MSG) == 0){
-			conn->flags |= CONNECTION_FIRST_MSG;
-
-			// if handle is still NULL the service has multiple
-			// protocols and we need to choose it now
-			if(conn->handle == NULL){
-				proto = conn->protocol;
-				proto_id = message_get_byte(msg);
-				while(proto != NULL && proto->identifier != proto_id)
-					proto = proto->next;
-
-				// if the requested protocol wasn't found, abort connection
-				if(proto == NULL)
-					goto close;
-
-				// create protocol handle
-				conn->handle = proto->handle_create(conn);
-				conn->protocol = proto;
-			}
-			conn->protocol->on_recv_first_message(conn->handle, msg);
+	closed = (conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING));
+	mutex_unlock(conn->lock);
+	if(closed == 0){
+		conn->handle = conn->protocol->handle_create(conn);
+		conn->protocol->on_connect(conn->handle);
+	}
+	internal_release(conn);
+}
+
+static void release_handler(void *arg)
+{
+	struct connection	*conn = arg;
+	void			*tmp;
+
+	// handle_release SHOULDN'T call connection_close
+	// but just in case...
+	if(conn->handle != NULL){
+		tmp = conn->handle;
+		conn->handle = NULL;
+		conn->protocol->handle_release(tmp);
+	}
+	internal_release(conn);
+}
+
+// NOTE: must be used INSIDE the connection lock
+// returns the number of output messages not borrowed by the
+// protocol or reserved for the input messages still waiting for it
+static long output_available(struct connection *conn)
+{
+	return MAX_OUTPUT - conn->output_count - conn->input_count;
+}
+
+// NOTE: must be used INSIDE the connection lock
+// moves the unprocessed input to a read buffer of len bytes
+static int rdbuf_resize(struct connection *conn, long len)
+{
+	struct message *buf;
+	long avail;
+
+	buf = message_alloc(len);
+	if(buf == NULL)
+		return -1;
+
+	avail = conn->rdend - conn->rdstart;
+	memcpy(buf->buffer, conn->rdbuf->buffer + conn->rdstart, avail);
+	message_free(conn->rdbuf);
+	conn->rdbuf = buf;
+	conn->rdstart = 0;
+	conn->rdend = avail;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the connection lock
+// returns -1 if the read chain is over and must be released
+static int process_input(struct connection *conn)
+{
+	struct message	*msg;
+	uint8_t		*rdbuf;
+	long		avail, frames, length, total;
+
+	// hand every complete frame in the buffer to the protocol
+	total = conn->rdend - conn->rdstart;
+	frames = 0;
+	length = 0;
+	while(1){
+		// the protocol may have closed the connection
+		if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING)) != 0)
+			return -1;
+
+		avail = conn->rdend - conn->rdstart;
+		if(avail < 2)
+			break;
+
+		// every input message is waiting for the protocol handlers
+		// so stop reading until one is released (the read reference
+		// and timeout are kept)
+		if(conn->input_count >= MAX_INPUT){
+			conn->flags |= CONNECTION_RD_STALLED;
+			return 0;
 		}
-		else{
-			conn->protocol->on_recv_message(conn->handle, msg);
+
+		// the message length on a read operation
+		// will have only the length of the body
+		rdbuf = conn->rdbuf->buffer + conn->rdstart;
+		length = (long)rdbuf[0] << 8 | rdbuf[1];
+		if(length <= 0 || length+2 > MAX_INPUT_LEN)
+			return -1;
+
+		if(avail < length+2)
+			break;
+
+		// a burst of frames may use every output message before
+		// any write completes so stop here and let on_write resume
+		// the chain (the read reference and timeout are kept)
+		if(output_available(conn) <= 0){
+			conn->flags |= CONNECTION_RD_STALLED;
+			return 0;
 		}
 
-		// chain next length read and reschedule read timeout
-		scheduler_reschedule(RD_TIMEOUT, conn->rd_timeout);
-		if(net_async_read(sock, msg->buffer, 2, on_read_length, conn) == 0){
+		msg = message_alloc(length+2);
+		if(msg == NULL)
+			return -1;
+		memcpy(msg->buffer, rdbuf, length+2);
+		msg->readpos = 2;
+		msg->length = length;
+		conn->rdstart += length+2;
+		conn->messages_in += 1;
+		frames += 1;
+
+		// queue the message on the connection strand
+		conn->input[(conn->input_first + conn->input_count) % MAX_INPUT] = msg;
+		conn->input_count += 1;
+		conn->ref_count += 1;
+		if(strand_dispatch(conn->strand, input_handler, conn) != 0){
+			conn->input_count -= 1;
+			conn->ref_count -= 1;
+			message_free(msg);
+			return -1;
+		}
+	}
+
+	// make room for the rest of a partial frame, grow the buffer
+	// if the read filled it or shrink it back if it's drained
+	if(avail >= 2 && length+2 > conn->rdbuf->capacity){
+		if(rdbuf_resize(conn, length+2) != 0)
+			return -1;
+	}
+	else if(total == conn->rdbuf->capacity && total < RDBUF_MAX){
+		if(rdbuf_resize(conn, total * 4) != 0)
+			return -1;
+	}
+	else if(avail == 0 && total < RDBUF_MIN && conn->rdbuf->capacity > RDBUF_MIN){
+		if(rdbuf_resize(conn, RDBUF_MIN) != 0)
+			return -1;
+	}
+
+	// move the partial frame to the start of the buffer
+	if(avail > 0 && conn->rdstart > 0)
+		memmove(conn->rdbuf->buffer, conn->rdbuf->buffer + conn->rdstart, avail);
+	conn->rdstart = 0;
+	conn->rdend = avail;
+
+	// reschedule read timeout only after receiving
+	// complete messages and chain next read
+	if(frames > 0)
+		timeout_touch(&conn->rd_timeout, RD_TIMEOUT);
+	return net_async_read_some(conn->sock, (char*)conn->rdbuf->buffer + conn->rdend,
+			conn->rdbuf->capacity - conn->rdend, on_read, conn);
+}
+
+// NOTE: must be used INSIDE the connection lock
+// returns -1 if the read chain must be released
+static int resume_input(struct connection *conn)
+{
+	if((conn->flags & CONNECTION_RD_STALLED) == 0)
+		return 0;
+
+	conn->flags &= ~CONNECTION_RD_STALLED;
+	if(process_input(conn) == 0)
+		return 0;
+
+	cancel_rd_timeout(conn);
+	return -1;
+}
+
+static void on_read(struct socket *sock, int error, int transfered, void *udata)
+{
+	struct connection *conn = udata;
+
+	mutex_lock(conn->lock);
+	// check for errors or if the connection is closed/closing
+	if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CLOSING)) == 0
+			&& error == 0 && transfered > 0){
+		conn->rdend += transfered;
+		conn->bytes_in += transfered;
+		if(process_input(conn) == 0){
 			mutex_unlock(conn->lock);
 			return;
 		}
 	}
 
-close:
 	cancel_rd_timeout(conn);
 	mutex_unlock(conn->lock);
 	connection_close(conn, 0);
 	internal_release(conn);
 }
 
+// NOTE: must be used INSIDE the connection lock
+static int flush_output(struct connection *conn)
+{
+	struct net_buf bufs[NET_MAX_IOV];
+	struct message *msg, *seg;
+	long remaining;
+	int count, segments, inflight;
+
+	// send as many queued messages as fit on a single write with
+	// one buffer for each of their segments (a message never has
+	// more than NET_MAX_IOV segments so the first one always fits)
+	count = 0;
+	inflight = 0;
+	while(inflight < conn->output_queued){
+		msg = conn->output[(conn->output_first + inflight) % MAX_OUTPUT];
+		segments = 0;
+		for(seg = msg; seg != NULL; seg = seg->chain)
+			segments++;
+		if(count + segments > NET_MAX_IOV)
+			break;
+
+		remaining = msg->length;
+		for(seg = msg; seg != NULL && remaining > 0; seg = seg->chain){
+			bufs[count].buf = (char*)seg->buffer;
+			bufs[count].len = (int)MIN(remaining, seg->capacity);
+			remaining -= bufs[count].len;
+			count++;
+		}
+		inflight++;
+	}
+	conn->output_inflight = inflight;
+	return net_async_writev(conn->sock, bufs, count, on_write, conn);
+}
+
 static void on_write(struct socket *sock, int error, int transfered, void *udata)
 {
 	struct connection	*conn = udata;
-	struct message		*msg, *next;
 	int			close = 1;
+	int			rd_close = 0;
 
 	mutex_lock(conn->lock);
 	// check for errors or if the connection is closed
 	if((conn->flags & CONNECTION_CLOSED) == 0
 			&& error == 0 && transfered > 0){
-		// pop message from queue and free it
-		msg = conn->output_queue;
-		next = msg->next;
-		conn->output_queue = next;
-		msg->state = MESSAGE_FREE;
+		// pop the messages that were sent and free them
+		conn->bytes_out += transfered;
+		conn->messages_out += conn->output_inflight;
+		while(conn->output_inflight > 0){
+			message_free(conn->output[conn->output_first]);
+			conn->output_first = (conn->output_first + 1) % MAX_OUTPUT;
+			conn->output_queued -= 1;
+			conn->output_count -= 1;
+			conn->output_inflight -= 1;
+		}
 
-		if(next != NULL){
+		if(conn->output_queued > 0){
 			//reschedule write timeout
-			scheduler_reschedule(WR_TIMEOUT, conn->wr_timeout);
+			timeout_touch(&conn->wr_timeout, WR_TIMEOUT);
 
-			// chain next write
-			if(net_async_write(conn->sock, next->buffer, next->length,
-					on_write, conn) == 0){
+			// chain next write with everything
+			// queued since the last one
+			if(flush_output(conn) == 0){
+				rd_close = resume_input(conn);
 				mutex_unlock(conn->lock);
+				if(rd_close != 0){
+					connection_close(conn, 0);
+					internal_release(conn);
+				}
 				return;
 			}
 		}
@@ -246,9 +601,16 @@ static void on_write(struct socket *sock, int error, int transfered, void *udata
 
 	// cancel write timeout
 	cancel_wr_timeout(conn);
+
+	// input is resumed only after the write chain is done
+	// with so new messages will start another chain
+	if(close == 0)
+		rd_close = resume_input(conn);
 	mutex_unlock(conn->lock);
-	if(close != 0)
-		connection_close(conn, 1);
+	if(close != 0 || rd_close != 0)
+		connection_close(conn, close);
+	if(rd_close != 0)
+		internal_release(conn);
 	internal_release(conn);
 }
 
@@ -257,66 +619,141 @@ void connection_init()
 {
 	connblk = mmblock_create(MAX_CONNECTIONS, sizeof(struct connection));
 	mmblock_init_lock(connblk);
+	mutex_create(&registry_lock);
+	condvar_create(&registry_empty);
+	admission_init(0, 0);
+}
+
+void connection_set_admission(int max_connections, int max_rate)
+{
+	admission_init(max_connections, max_rate);
+}
+
+void connection_set_zerocopy(int threshold)
+{
+	zerocopy_threshold = threshold;
 }
 
 void connection_shutdown()
 {
-	struct connection *conn;
-	int i;
+	struct admission_stats stats;
+	long count;
 
-	for(i = 0; i < MAX_CONNECTIONS; i++){
-		//conn = mmblock_xget(connblk, i);
-		conn = NULL;
-		if(conn != NULL)
-			connection_close(conn, 1);
+	admission_get_stats(&stats);
+	if(stats.rejected_connections > 0 || stats.rejected_rate > 0)
+		LOG("connection_shutdown: admission rejected %ld connections (%ld over the concurrent limit, %ld over the rate limit) and admitted %ld (%ld untracked)",
+			stats.rejected_connections + stats.rejected_rate, stats.rejected_connections,
+			stats.rejected_rate, stats.admitted, stats.untracked);
+
+	// connections should have been drained while the reactors
+	// were running but if any is still alive its memory can't be
+	// released from under the handlers still referencing it
+	count = connection_count();
+	if(count > 0){
+		LOG_WARNING("connection_shutdown: %ld connections still alive", count);
+		connection_close_all(1);
+		return;
 	}
 
-	// this may release the connection memory before
-	// the read/write handlers release the connection
-	// but it shouldn't be a problem since this will
-	// only be called on cleanup
 	mmblock_release(connblk);
+	condvar_destroy(registry_empty);
+	mutex_destroy(registry_lock);
 }
 
 void connection_accept(struct socket *sock, struct protocol *protocol)
 {
 	struct connection *conn;
+	unsigned long addr;
+	int admission;
+
+	// shed connections over the per address limits
+	// before anything is allocated for them
+	addr = net_remote_address(sock);
+	admission = admission_acquire(addr);
+	if(admission == -1){
+		net_close(sock);
+		return;
+	}
 
 	// initialize connection
 	conn = mmblock_xalloc(connblk);
+	if(conn == NULL){
+		LOG_ERROR("connection_accept: connection memory block is at maximum capacity (%d)", MAX_CONNECTIONS);
+		if(admission == 0)
+			admission_release(addr);
+		net_close(sock);
+		return;
+	}
 	conn->sock = sock;
+	conn->admitted_addr = (admission == 0) ? addr : 0;
 	conn->flags = CONNECTION_OPEN;
 	conn->ref_count = 0;
-	conn->output_queue = NULL;
+	conn->output_first = 0;
+	conn->output_queued = 0;
+	conn->output_count = 0;
+	conn->output_inflight = 0;
+	conn->rdstart = 0;
+	conn->rdend = 0;
 	conn->protocol = protocol;
 	conn->handle = NULL;
-	conn->rd_timeout = NULL;
-	conn->wr_timeout = NULL;
+	conn->input_first = 0;
+	conn->input_count = 0;
+	conn->connected_at = sys_get_tick_count();
+	conn->messages_in = 0;
+	conn->messages_out = 0;
+	conn->bytes_in = 0;
+	conn->bytes_out = 0;
+
+	for(int i = 0; i < MAX_INPUT; i++)
+		conn->input[i] = NULL;
 
-	// set connection message states
-	conn->input.state = MESSAGE_BUSY;
-	for(int i = 0; i < MAX_OUTPUT; i++)
-		conn->output[i].state = MESSAGE_FREE;
+	// protocol handlers run on the worker threads but one at a
+	// time for each connection and ahead of normal and background
+	// work (they're what players are waiting on)
+	conn->rdbuf = message_alloc(RDBUF_MIN);
+	if(conn->rdbuf == NULL || strand_create_priority(&conn->strand, WORK_CRITICAL) != 0){
+		LOG_ERROR("connection_accept: failed to create connection strand or read buffer");
+		if(conn->rdbuf != NULL)
+			message_free(conn->rdbuf);
+		if(admission == 0)
+			admission_release(addr);
+		net_close(sock);
+		mmblock_xfree(connblk, conn);
+		return;
+	}
 
-	// create connection lock
+	// create connection lock and make the connection
+	// visible to the registry iteration
 	mutex_create(&conn->lock);
+	registry_add(conn);
+
+	// output messages stay busy until the kernel is done
+	// with them so it's safe to send them without copying
+	if(zerocopy_threshold > 0 && net_socket_zerocopy(sock, zerocopy_threshold) != 0)
+		LOG_WARNING("connection_accept: zero-copy sends not available");
 
 	// lock here because the protocol callbacks, read timeout
 	// or read handler may use the connection before this returns
 	mutex_lock(conn->lock);
+	conn->ref_count += 1;
 
 	// if the protocol sends first, create handle now
 	if(protocol->flags & PROTOCOL_SENDS_FIRST){
-		conn->handle = protocol->handle_create(conn);
-		protocol->on_connect(conn->handle);
+		conn->ref_count += 1;
+		if(strand_dispatch(conn->strand, connect_handler, conn) != 0){
+			conn->ref_count -= 1;
+			mutex_unlock(conn->lock);
+			connection_close(conn, 1);
+			internal_release(conn);
+			return;
+		}
 	}
 
 	// schedule read timeout
-	conn->ref_count += 1;
-	conn->rd_timeout = scheduler_add(RD_TIMEOUT, read_timeout_handler, conn);
-	if(conn->rd_timeout != NULL){
+	if(timeout_add(&conn->rd_timeout, RD_TIMEOUT, read_timeout_handler, conn) == 0){
 		conn->ref_count += 1;
-		if(net_async_read(sock, conn->input.buffer, 2, on_read_length, conn) == 0){
+		if(net_async_read_some(sock, (char*)conn->rdbuf->buffer,
+				conn->rdbuf->capacity, on_read, conn) == 0){
 			mutex_unlock(conn->lock);
 			return;
 		}
@@ -325,8 +762,8 @@ void connection_accept(struct socket *sock, struct protocol *protocol)
 		cancel_rd_timeout(conn);
 	}
 
-	// if the scheduler print a warning we know we need
-	// to bump it's capacity else it was a network error
+	// adding the timeout only fails if the wheel thread
+	// isn't running so it's most likely a network error
 	mutex_unlock(conn->lock);
 	connection_close(conn, 1);
 	internal_release(conn);
@@ -334,20 +771,29 @@ void connection_accept(struct socket *sock, struct protocol *protocol)
 
 void connection_close(struct connection *conn, int abort)
 {
-	void *tmp;
-
 	mutex_lock(conn->lock);
-	// release protocol handle
-	if(conn->handle != NULL){
-		// handle_release SHOULDN'T call connection_close
-		// but just in case...
-		tmp = conn->handle;
-		conn->handle = NULL;
-		conn->protocol->handle_release(tmp);
+	// release protocol handle after the handlers
+	// still queued on the strand
+	if((conn->flags & CONNECTION_HANDLE_RELEASE) == 0){
+		conn->flags |= CONNECTION_HANDLE_RELEASE;
+		conn->ref_count += 1;
+		if(strand_dispatch(conn->strand, release_handler, conn) != 0){
+			LOG_ERROR("connection_close: failed to release protocol handle");
+			conn->ref_count -= 1;
+		}
+	}
+
+	// a read chain stalled on output messages has no pending
+	// operation to be cancelled so it's released here (callers
+	// always hold another reference)
+	if((conn->flags & CONNECTION_RD_STALLED) != 0){
+		conn->flags &= ~CONNECTION_RD_STALLED;
+		cancel_rd_timeout(conn);
+		conn->ref_count -= 1;
 	}
 
 	if((conn->flags & CONNECTION_CLOSED) == 0){
-		if(conn->output_queue == NULL || abort != 0){
+		if(conn->output_queued == 0 || abort != 0){
 			conn->flags |= CONNECTION_CLOSED;
 			net_socket_shutdown(conn->sock, NET_SHUT_RDWR);
 			net_close(conn->sock);
@@ -362,61 +808,252 @@ void connection_close(struct connection *conn, int abort)
 }
 
 struct message *connection_get_output_message(struct connection *conn)
+{
+	return connection_get_output_message_len(conn, MESSAGE_BUFFER_LEN);
+}
+
+struct message *connection_get_output_message_len(struct connection *conn, long len)
 {
 	struct message *msg;
-	int i;
 
-	msg = NULL;
 	mutex_lock(conn->lock);
-	for(i = 0; i < MAX_OUTPUT; i++){
-		if(conn->output[i].state == MESSAGE_FREE){
-			msg = &conn->output[i];
-			msg->state = MESSAGE_BUSY;
-			break;
-		}
+	if(conn->output_count >= MAX_OUTPUT){
+		mutex_unlock(conn->lock);
+		return NULL;
 	}
+	conn->output_count += 1;
 	mutex_unlock(conn->lock);
+
+	msg = message_alloc(len);
+	if(msg == NULL){
+		mutex_lock(conn->lock);
+		conn->output_count -= 1;
+		mutex_unlock(conn->lock);
+	}
 	return msg;
 }
 
-void connection_send(struct connection *conn, struct message *msg)
+void connection_cork(struct connection *conn)
 {
-	struct message **it;
+	mutex_lock(conn->lock);
+	if((conn->flags & (CONNECTION_CLOSED | CONNECTION_CORKED)) == 0){
+		// if the backend can't cork, messages are still
+		// sent but each write may go out on its own segment
+		if(net_socket_cork(conn->sock, 1) == 0)
+			conn->flags |= CONNECTION_CORKED;
+	}
+	mutex_unlock(conn->lock);
+}
 
+void connection_flush(struct connection *conn)
+{
 	mutex_lock(conn->lock);
-	if(conn->output_queue == NULL){
-		// add message to output queue
-		msg->next = NULL;
-		conn->output_queue = msg;
+	if((conn->flags & CONNECTION_CORKED) != 0){
+		// messages still on the output queue are written after
+		// this and go out right away as the socket is uncorked
+		conn->flags &= ~CONNECTION_CORKED;
+		if((conn->flags & CONNECTION_CLOSED) == 0)
+			net_socket_cork(conn->sock, 0);
+	}
+	mutex_unlock(conn->lock);
+}
+
+// NOTE: must be used INSIDE the connection lock
+// queues a message already counted on output_count and starts
+// the write chain if it isn't running; returns -1 if the chain
+// couldn't be started and the connection must be closed (and
+// the reference taken for the chain released)
+static int queue_output(struct connection *conn, struct message *msg)
+{
+	// push msg to the end of queue so it will
+	// be processed by the write chain
+	conn->output[(conn->output_first + conn->output_queued) % MAX_OUTPUT] = msg;
+	conn->output_queued += 1;
+	if(conn->output_queued > 1)
+		return 0;
 
-		// schedule write timeout
+	// schedule write timeout
+	conn->ref_count += 1;
+	if(timeout_add(&conn->wr_timeout, WR_TIMEOUT, write_timeout_handler, conn) == 0){
+		// restart write chain
 		conn->ref_count += 1;
-		conn->wr_timeout = scheduler_add(WR_TIMEOUT, write_timeout_handler, conn);
-		if(conn->wr_timeout != NULL){
-			// restart write chain
-			conn->ref_count += 1;
-			if(net_async_write(conn->sock, msg->buffer, msg->length,
-					on_write, conn) == 0){
-				mutex_unlock(conn->lock);
-				return;
-			}
+		if(flush_output(conn) == 0)
+			return 0;
 
-			// if the async write failed, cancel the write timeout
-			cancel_wr_timeout(conn);
-		}
+		// if the async write failed, cancel the write timeout
+		cancel_wr_timeout(conn);
+	}
+	return -1;
+}
+
+void connection_send(struct connection *conn, struct message *msg)
+{
+	mutex_lock(conn->lock);
+	// handlers may still be running after the connection
+	// is closed so the message is just dropped
+	if((conn->flags & CONNECTION_CLOSED) != 0){
+		message_free(msg);
+		conn->output_count -= 1;
+		mutex_unlock(conn->lock);
+		return;
+	}
+
+	// the message is incomplete
+	if((msg->flags & MESSAGE_OVERFLOW) != 0){
+		LOG_ERROR("connection_send: message overflow (length = %ld)", msg->length);
+		message_free(msg);
+		conn->output_count -= 1;
+		mutex_unlock(conn->lock);
+		return;
+	}
 
+	if(queue_output(conn, msg) != 0){
 		mutex_unlock(conn->lock);
 		connection_close(conn, 1);
 		internal_release(conn);
+		return;
 	}
-	else{
-		// push msg to the end of queue so it will
-		// be processed by the write chain
-		it = &conn->output_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = msg;
+	mutex_unlock(conn->lock);
+}
+
+int connection_send_shared(struct connection **conns, int count, struct message *msg)
+{
+	struct connection *conn;
+	int sent = 0;
 
+	if((msg->flags & MESSAGE_OVERFLOW) != 0){
+		LOG_ERROR("connection_send_shared: message overflow (length = %ld)", msg->length);
+		return 0;
+	}
+
+	for(int i = 0; i < count; i++){
+		conn = conns[i];
+		mutex_lock(conn->lock);
+		// closed connections and the ones that are too far
+		// behind don't get the message
+		if((conn->flags & CONNECTION_CLOSED) != 0
+				|| conn->output_count >= MAX_OUTPUT){
+			mutex_unlock(conn->lock);
+			continue;
+		}
+
+		// each connection holds its own reference until
+		// the message is written
+		conn->output_count += 1;
+		message_retain(msg);
+		if(queue_output(conn, msg) != 0){
+			mutex_unlock(conn->lock);
+			connection_close(conn, 1);
+			internal_release(conn);
+			continue;
+		}
 		mutex_unlock(conn->lock);
+		sent += 1;
+	}
+	return sent;
+}
+
+// registry functions
+long connection_count()
+{
+	long count;
+	mutex_lock(registry_lock);
+	count = registry_count;
+	mutex_unlock(registry_lock);
+	return count;
+}
+
+void connection_foreach(void (*fp)(struct connection*, void*), void *arg)
+{
+	struct connection *conns[MAX_CONNECTIONS];
+	long count;
+
+	// fp runs without the registry lock so it may close
+	// connections or send them messages
+	count = registry_snapshot(conns);
+	for(long i = 0; i < count; i++){
+		fp(conns[i], arg);
+		internal_release(conns[i]);
 	}
 }
+
+static void close_handler(struct connection *conn, void *arg)
+{
+	connection_close(conn, *(int*)arg);
+}
+
+void connection_close_all(int abort)
+{
+	connection_foreach(close_handler, &abort);
+}
+
+struct broadcast{
+	struct message	*msg;
+	long		count;
+};
+
+static void broadcast_handler(struct connection *conn, void *arg)
+{
+	struct broadcast *bc = arg;
+	bc->count += connection_send_shared(&conn, 1, bc->msg);
+}
+
+long connection_broadcast(struct message *msg)
+{
+	struct broadcast bc;
+	bc.msg = msg;
+	bc.count = 0;
+	connection_foreach(broadcast_handler, &bc);
+	return bc.count;
+}
+
+// NOTE: must be used INSIDE the registry lock
+static void wait_registry_empty(long timeout)
+{
+	long deadline, now;
+
+	deadline = sys_get_tick_count() + timeout;
+	while(registry_count > 0){
+		now = sys_get_tick_count();
+		if(now >= deadline)
+			break;
+		condvar_timedwait(registry_empty, registry_lock, deadline - now);
+	}
+}
+
+long connection_drain(long timeout)
+{
+	long aborted;
+
+	// closing connections are released once their output
+	// queue is flushed (or the write timeout fires)
+	connection_close_all(0);
+	mutex_lock(registry_lock);
+	wait_registry_empty(timeout);
+	aborted = registry_count;
+	mutex_unlock(registry_lock);
+	if(aborted == 0)
+		return 0;
+
+	// abort what's left and give the reactors some
+	// time to cancel their operations
+	LOG_WARNING("connection_drain: aborting %ld connections that didn't flush their output in %ld msec",
+		aborted, timeout);
+	connection_close_all(1);
+	mutex_lock(registry_lock);
+	wait_registry_empty(DRAIN_ABORT_TIMEOUT);
+	mutex_unlock(registry_lock);
+	return aborted;
+}
+
+void connection_get_stats(struct connection *conn, struct connection_stats *stats)
+{
+	mutex_lock(conn->lock);
+	stats->messages_in = conn->messages_in;
+	stats->messages_out = conn->messages_out;
+	stats->bytes_in = conn->bytes_in;
+	stats->bytes_out = conn->bytes_out;
+	stats->output_queued = conn->output_queued;
+	stats->connected_time = sys_get_tick_count() - conn->connected_at;
+	mutex_unlock(conn->lock);
+}
@@ -4,14 +4,74 @@
 struct connection;
 struct socket;
 struct protocol;
+struct message;
+
+struct connection_stats{
+	long	messages_in;
+	long	messages_out;
+	long	bytes_in;
+	long	bytes_out;
+	long	output_queued;		// messages waiting to be written
+	long	connected_time;		// msec since it was accepted
+};
 
 void		connection_init(void);
 void		connection_shutdown(void);
 
+// limits the concurrent connections and the new connections
+// per second from each address (0 disables a limit); connections
+// over the limits are closed as soon as they're accepted
+void		connection_set_admission(int max_connections, int max_rate);
+
+// enables zero-copy sends on new connections for
+// output writes of at least threshold bytes
+void		connection_set_zerocopy(int threshold);
+
 void        connection_accept(struct socket *sock, struct protocol *protocol);
 void		connection_close(struct connection *conn, int abort);
 
+// output messages are borrowed from the message pool and must be
+// handed back with connection_send (they're freed once written or
+// right away if the connection is closed); NULL is returned if the
+// connection has too many messages queued or the pool is exhausted
 struct message	*connection_get_output_message(struct connection *conn);
+struct message	*connection_get_output_message_len(struct connection *conn, long len);
 void		connection_send(struct connection *conn, struct message *msg);
 
+// queues msg (a message from message_alloc already finished by
+// message_end) on count connections without copying it: each one
+// holds a reference until it's written and the caller keeps its own
+// to release with message_free; connections that are closed or have
+// too many messages queued are skipped and the number of connections
+// it was queued on is returned
+int		connection_send_shared(struct connection **conns, int count, struct message *msg);
+
+// messages sent between connection_cork and connection_flush are
+// coalesced into full segments and pushed out on the flush (e.g.
+// all of a player's updates for a game tick)
+void		connection_cork(struct connection *conn);
+void		connection_flush(struct connection *conn);
+
+void		connection_get_stats(struct connection *conn, struct connection_stats *stats);
+
+// live connections
+// ====================
+long		connection_count(void);
+
+// calls fp on every live connection (e.g. to iterate online
+// players); each connection is referenced while fp runs so it
+// may be closed or sent messages from inside fp
+void		connection_foreach(void (*fp)(struct connection*, void*), void *arg);
+void		connection_close_all(int abort);
+
+// queues msg on every live connection with connection_send_shared
+// and returns on how many it was queued
+long		connection_broadcast(struct message *msg);
+
+// gracefully closes every connection and waits up to timeout msec
+// for their output to be flushed, then aborts the ones left; returns
+// how many had to be aborted
+// NOTE: the reactors must keep running while this waits
+long		connection_drain(long timeout);
+
 #endif //CONNECTION_H_
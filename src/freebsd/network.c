@@ -12,45 +12,71 @@
 #include <sys/types.h>
 #include <sys/event.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netinet/tcp_var.h>
+#include <sys/sysctl.h>
 
 #define OP_NONE		0x00
 #define OP_ACCEPT	0x01
 #define OP_READ		0x02
 #define OP_WRITE	0x03
+#define OP_WRITEV	0x04
+#define OP_READ_SOME	0x05
+#define OP_ACCEPT_BATCH	0x06
 struct async_op{
 	long		opcode;
 	struct socket	*socket;
 	void		*buf;
 	long		len;
 
+	// vectored write buffers (len has the
+	// total remaining bytes)
+	struct iovec	iov[NET_MAX_IOV];
+	int		iovpos;
+	int		iovcnt;
+
 	int		error;
 	int		transfered;
 	void		(*complete)(struct socket*, int, int, void*);
 	void		*udata;
 
+	// socket that owns the operation slot
+	struct socket	*owner;
 	struct async_op	*next;
 };
 
+struct op_queue{
+	struct async_op	*head;
+	struct async_op	*tail;
+};
+
+// each socket has SOCKET_MAX_OPS operation slots inline and
+// borrows from a shared pool when they're all in use
 #define MAX_SOCKETS		2048
 #define SOCKET_MAX_OPS		8
+#define MAX_POOL_OPS		4096
 struct socket{
 	int			fd;
 	struct sockaddr		addr;
 	struct async_op		ops[SOCKET_MAX_OPS];
-	struct async_op		*usr_queue;
-	struct async_op		*rd_queue;
-	struct async_op		*wr_queue;
+	struct async_op		*free_ops;
+	struct op_queue		usr_queue;
+	struct op_queue		rd_queue;
+	struct op_queue		wr_queue;
 	struct mutex		*lock;
 };
 
 static int		kq = -1;
 static struct mmblock	*sockblk = NULL;
+static struct mmblock	*opblk = NULL;
 
 static int setoptions(int fd)
 {
 	int flags;
 	struct linger linger;
+	int opt;
 
 	// set linger
 	linger.l_onoff = 0;
@@ -60,6 +86,15 @@ static int setoptions(int fd)
 		return -1;
 	}
 
+	// disable nagle so output goes out as soon as it's written;
+	// batching is done explicitly with net_socket_cork (accepted
+	// sockets inherit this option from the listening socket)
+	opt = 1;
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int)) == -1){
+		LOG_ERROR("setoptions: failed to set socket nodelay option (error = %d)", errno);
+		return -1;
+	}
+
 	// set nonblocking
 	flags = fcntl(fd, F_GETFL);
 	if(flags == -1){
@@ -87,12 +122,19 @@ static struct socket *socket_handle(int fd)
 
 	// initialize handle
 	sock->fd = fd;
-	sock->usr_queue = NULL;
-	sock->rd_queue = NULL;
-	sock->wr_queue = NULL;
+	sock->usr_queue.head = NULL;
+	sock->usr_queue.tail = NULL;
+	sock->rd_queue.head = NULL;
+	sock->rd_queue.tail = NULL;
+	sock->wr_queue.head = NULL;
+	sock->wr_queue.tail = NULL;
 	//memset(&sock->addr, 0, sizeof(struct sockaddr));
-	for(int i = 0; i < SOCKET_MAX_OPS; i++)
+	sock->free_ops = NULL;
+	for(int i = SOCKET_MAX_OPS - 1; i >= 0; i--){
 		sock->ops[i].opcode = OP_NONE;
+		sock->ops[i].next = sock->free_ops;
+		sock->free_ops = &sock->ops[i];
+	}
 	mutex_create(&sock->lock);
 	return sock;
 }
@@ -120,136 +162,228 @@ void trigger_usr(struct socket *sock)
 		LOG_ERROR("trigger_usr: failed to trigger user event (error = %d)", errno);
 }
 
-static void cancel_rd_ops(struct socket *sock)
+// NOTE: must be used INSIDE the socket lock
+static void queue_push(struct op_queue *q, struct async_op *op)
 {
-	struct async_op **op;
-	mutex_lock(sock->lock);
-	// get usr_queue tail
-	op = &sock->usr_queue;
-	while(*op != NULL)
-		op = &(*op)->next;
-
-	// push rd_queue into usr_queue
-	*op = sock->rd_queue;
-	sock->rd_queue = NULL;
+	op->next = NULL;
+	if(q->tail == NULL)
+		q->head = op;
+	else
+		q->tail->next = op;
+	q->tail = op;
+}
 
-	// cancel operations
-	while(*op != NULL){
-		(*op)->error = ECANCELED;
-		op = &(*op)->next;
+// NOTE: must be used INSIDE the socket lock
+static struct async_op *queue_pop(struct op_queue *q)
+{
+	struct async_op *op = q->head;
+	if(op != NULL){
+		q->head = op->next;
+		if(q->head == NULL)
+			q->tail = NULL;
 	}
+	return op;
+}
+
+// NOTE: must be used INSIDE the socket lock
+// moves every operation from src to the tail of dst and
+// cancels them
+static void queue_cancel(struct op_queue *dst, struct op_queue *src)
+{
+	struct async_op *op;
+
+	if(src->head == NULL)
+		return;
+
+	for(op = src->head; op != NULL; op = op->next)
+		op->error = ECANCELED;
+
+	if(dst->tail == NULL)
+		dst->head = src->head;
+	else
+		dst->tail->next = src->head;
+	dst->tail = src->tail;
+	src->head = NULL;
+	src->tail = NULL;
+}
+
+static void cancel_rd_ops(struct socket *sock)
+{
+	mutex_lock(sock->lock);
+	queue_cancel(&sock->usr_queue, &sock->rd_queue);
 	mutex_unlock(sock->lock);
 }
 
 static void cancel_wr_ops(struct socket *sock)
 {
-	struct async_op **op;
 	mutex_lock(sock->lock);
-	// get usr_queue tail
-	op = &sock->usr_queue;
-	while(*op != NULL)
-		op = &(*op)->next;
-
-	// push wr_queue into usr_queue
-	*op = sock->wr_queue;
-	sock->wr_queue = NULL;
-
-	// cancel operations
-	while(*op != NULL){
-		(*op)->error = ECANCELED;
-		op = &(*op)->next;
-	}
+	queue_cancel(&sock->usr_queue, &sock->wr_queue);
 	mutex_unlock(sock->lock);
 }
 
 // NOTE: must be used INSIDE the socket lock
 static struct async_op *socket_op(struct socket *sock, int opcode)
 {
-	struct async_op *op = NULL;
-	for(int i = 0; i < SOCKET_MAX_OPS; i++){
-		if(sock->ops[i].opcode == OP_NONE){
-			op = &sock->ops[i];
-			op->opcode = opcode;
-			op->next = NULL;
-			break;
-		}
+	struct async_op *op = sock->free_ops;
+	if(op != NULL){
+		sock->free_ops = op->next;
 	}
+	else{
+		// every inline slot is in use (probably a deep
+		// write queue) so borrow one from the pool
+		op = mmblock_xalloc(opblk);
+		if(op == NULL)
+			return NULL;
+	}
+	op->owner = sock;
+	op->opcode = opcode;
+	op->next = NULL;
 	return op;
 }
 
 // NOTE: must be used INSIDE the socket lock
-static void defer_completion(struct socket *sock, struct async_op *op)
+static void socket_op_release(struct socket *sock, struct async_op *op)
 {
-	struct async_op **it;
+	op->opcode = OP_NONE;
+	if(op >= sock->ops && op < sock->ops + SOCKET_MAX_OPS){
+		op->next = sock->free_ops;
+		sock->free_ops = op;
+	}
+	else{
+		mmblock_xfree(opblk, op);
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+// the operation slot is released before running the completion
+// routine so it may be reused by it (this also makes it safe for
+// the routine to release the socket)
+static void complete_op(struct socket *sock, struct async_op *op)
+{
+	void (*complete)(struct socket*, int, int, void*) = op->complete;
+	struct socket *socket = op->socket;
+	int error = op->error;
+	int transfered = op->transfered;
+	void *udata = op->udata;
+
+	socket_op_release(sock, op);
+	mutex_unlock(sock->lock);
+	complete(socket, error, transfered, udata);
+}
 
+// NOTE: must be used INSIDE the socket lock
+static void defer_completion(struct socket *sock, struct async_op *op)
+{
 	// trigger user event if this is the first op
 	// (it doesn't matter the order here because of the lock)
-	if(sock->usr_queue == NULL)
+	if(sock->usr_queue.head == NULL)
 		trigger_usr(sock);
-
-	it = &sock->usr_queue;
-	while(*it != NULL)
-		it = &(*it)->next;
-	*it = op;
+	queue_push(&sock->usr_queue, op);
 }
 
 // NOTE: must be used INSIDE the socket lock
-static int try_complete_accept(struct socket *sock, struct async_op *op)
+// returns 0 if a connection was accepted, -1 if there are no
+// pending connections or the error code
+static int accept_one(struct socket *sock, struct socket **out)
 {
-	int fd, error;
+	int fd;
 	struct kevent events[3];
 	struct sockaddr addr;
 	socklen_t addrlen;
 
+	// accept4 sets the socket flags so there is no need to call
+	// setoptions (linger is already disabled by default)
 	addrlen = sizeof(struct sockaddr);
-	fd = accept(sock->fd, &addr, &addrlen);
+	fd = accept4(sock->fd, &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if(fd == -1){
-		error = errno;
-		if(error == EWOULDBLOCK)
+		if(errno == EWOULDBLOCK)
 			return -1;
-		op->error = error;
-		return 0;
+		return errno;
 	}
 
-	// set socket options
-	if(setoptions(fd) == -1){
-		LOG_ERROR("try_complete_accept: failed to set new socket options");
+	*out = socket_handle(fd);
+	if(*out == NULL){
+		LOG_ERROR("accept_one: failed to create new socket handle");
 		close(fd);
-		op->error = EAGAIN;
-		return 0;
-	}
-
-	op->socket = socket_handle(fd);
-	if(op->socket == NULL){
-		LOG_ERROR("try_complete_accept: failed to create new socket handle");
-		close(fd);
-		op->error = EAGAIN;
-		return 0;
+		return EAGAIN;
 	}
 
 	// copy address to socket
-	memcpy(&op->socket->addr, &addr, sizeof(struct sockaddr));
+	memcpy(&(*out)->addr, &addr, sizeof(struct sockaddr));
 
 	// add new socket to kqueue
-	EV_SET(events+0, fd, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, op->socket);
-	EV_SET(events+1, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, op->socket);
-	EV_SET(events+2, fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, op->socket);
+	EV_SET(events+0, fd, EVFILT_USER, EV_ADD | EV_CLEAR, 0, 0, *out);
+	EV_SET(events+1, fd, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, *out);
+	EV_SET(events+2, fd, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, *out);
 	if(kevent(kq, events, 3, NULL, 0, NULL) == -1){
-		LOG_ERROR("try_complete_accept: failed to add new socket to kqueue (error = %d)", errno);
-		socket_release(op->socket);
-		op->socket = NULL;
-		op->error = EAGAIN;
+		LOG_ERROR("accept_one: failed to add new socket to kqueue (error = %d)", errno);
+		socket_release(*out);
+		*out = NULL;
+		return EAGAIN;
 	}
 	return 0;
 }
 
+// NOTE: must be used INSIDE the socket lock
+static int try_complete_accept(struct socket *sock, struct async_op *op)
+{
+	int ret = accept_one(sock, &op->socket);
+	if(ret == -1)
+		return -1;
+
+	op->error = ret;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static int try_complete_accept_batch(struct socket *sock, struct async_op *op)
+{
+	struct socket **socks = op->buf;
+	int ret;
+
+	// drain the backlog until it's empty or the batch is full
+	while(op->transfered < op->len){
+		ret = accept_one(sock, &socks[op->transfered]);
+		if(ret == -1)
+			break;
+
+		// errors are only reported on empty batches (if the
+		// error persists it will show up on the next one)
+		if(ret != 0){
+			if(op->transfered == 0)
+				op->error = ret;
+			return 0;
+		}
+		op->transfered += 1;
+	}
+	return (op->transfered > 0) ? 0 : -1;
+}
+
+// skip the first n bytes of a vectored write
+static void consume_iov(struct async_op *op, long n)
+{
+	struct iovec *iov;
+	while(n > 0){
+		iov = &op->iov[op->iovpos];
+		if((size_t)n < iov->iov_len){
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+			break;
+		}
+		n -= iov->iov_len;
+		op->iovpos += 1;
+	}
+}
+
 // NOTE: must be used INSIDE the socket lock
 static int try_complete(struct socket *sock, struct async_op *op)
 {
 	int ret, error;
 	while(op->len > 0){
-		if(op->opcode == OP_READ)
+		if(op->opcode == OP_READ || op->opcode == OP_READ_SOME)
 			ret = recv(sock->fd, op->buf, op->len, 0);
+		else if(op->opcode == OP_WRITEV)
+			ret = writev(sock->fd, &op->iov[op->iovpos], op->iovcnt - op->iovpos);
 		else /*if(op->opcode == OP_WRITE)*/
 			ret = send(sock->fd, op->buf, op->len, 0);
 
@@ -266,27 +400,45 @@ static int try_complete(struct socket *sock, struct async_op *op)
 			//op->error = ECONNRESET;
 			return 0;
 		}
-		op->buf += ret;
+		if(op->opcode == OP_WRITEV)
+			consume_iov(op, ret);
+		else
+			op->buf += ret;
 		op->len -= ret;
 		op->transfered += ret;
+
+		// read_some completes with whatever was available
+		if(op->opcode == OP_READ_SOME)
+			return 0;
 	}
 	return 0;
 }
 
-int net_init(void)
+int net_init(int reactors)
 {
+	// NOTE: a single kqueue is used for now
+	if(reactors != 1)
+		LOG_WARNING("net_init: multiple reactors not supported on this platform (using 1)");
+
 	// create kqueue
 	if((kq = kqueue()) == -1){
 		LOG_ERROR("net_init: failed to create kqueue (error = %d)", errno);
 		return -1;
 	}
 
-	// create socket memory block
+	// create socket and operation pool memory blocks
 	sockblk = mmblock_create(MAX_SOCKETS, sizeof(struct socket));
 	mmblock_init_lock(sockblk);
+	opblk = mmblock_create(MAX_POOL_OPS, sizeof(struct async_op));
+	mmblock_init_lock(opblk);
 	return 0;
 }
 
+int net_reactor_count(void)
+{
+	return 1;
+}
+
 void net_shutdown(void)
 {
 	if(sockblk != NULL){
@@ -294,6 +446,11 @@ void net_shutdown(void)
 		sockblk = NULL;
 	}
 
+	if(opblk != NULL){
+		mmblock_release(opblk);
+		opblk = NULL;
+	}
+
 	if(kq != -1){
 		close(kq);
 		kq = -1;
@@ -338,13 +495,18 @@ struct socket *net_socket(void)
 	return sock;
 }
 
-struct socket *net_server_socket(int port)
+struct socket *net_server_socket(int port, int reactor)
 {
-	int fd;
+	int fd, opt;
 	struct socket *sock;
 	struct kevent events[2];
 	struct sockaddr_in addr;
 
+	if(reactor != 0){
+		LOG_ERROR("net_server_socket: invalid reactor #%d", reactor);
+		return NULL;
+	}
+
 	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
 	if(fd == -1){
 		LOG_ERROR("net_server_socket: failed to create socket (error = %d)", errno);
@@ -357,6 +519,15 @@ struct socket *net_server_socket(int port)
 		return NULL;
 	}
 
+	// allow restarting the server while connections from
+	// the last run are still on TIME_WAIT
+	opt = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_server_socket: failed to set reuseaddr option (error = %d)", errno);
+		close(fd);
+		return NULL;
+	}
+
 	// bind to port
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
@@ -446,13 +617,13 @@ void net_close(struct socket *sock)
 int net_async_accept(struct socket *sock,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
 	mutex_lock(sock->lock);
 	op = socket_op(sock, OP_ACCEPT);
 	if(op == NULL){
 		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_accept: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		LOG_ERROR("net_async_accept: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = NULL;
@@ -460,17 +631,47 @@ int net_async_accept(struct socket *sock,
 	op->complete = fp;
 	op->udata = udata;
 
-	if(sock->rd_queue == NULL){
+	if(sock->rd_queue.head == NULL){
 		if(try_complete_accept(sock, op) == 0)
 			defer_completion(sock, op);
 		else
-			sock->rd_queue = op;
+			queue_push(&sock->rd_queue, op);
 	}
 	else{
-		it = &sock->rd_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->rd_queue, op);
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_ACCEPT_BATCH);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_accept_batch: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = socks;
+	op->len = max;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+
+	if(sock->rd_queue.head == NULL){
+		if(try_complete_accept_batch(sock, op) == 0)
+			defer_completion(sock, op);
+		else
+			queue_push(&sock->rd_queue, op);
+	}
+	else{
+		queue_push(&sock->rd_queue, op);
 	}
 	mutex_unlock(sock->lock);
 	return 0;
@@ -479,13 +680,13 @@ int net_async_accept(struct socket *sock,
 int net_async_read(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
 	mutex_lock(sock->lock);
 	op = socket_op(sock, OP_READ);
 	if(op == NULL){
 		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_read: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		LOG_ERROR("net_async_read: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = sock;
@@ -498,7 +699,7 @@ int net_async_read(struct socket *sock, char *buf, int len,
 
 	// if there are no pending read operations, we may try to
 	// complete the read operation now
-	if(sock->rd_queue == NULL){
+	if(sock->rd_queue.head == NULL){
 		// if the operation completed, defer the completion
 		// routine to net_work, else add it to the read queue
 		// so it will be completed when the socket is ready
@@ -506,14 +707,45 @@ int net_async_read(struct socket *sock, char *buf, int len,
 		if(try_complete(sock, op) == 0)
 			defer_completion(sock, op);
 		else
-			sock->rd_queue = op;
+			queue_push(&sock->rd_queue, op);
+	}
+	else{
+		// insert into read queue tail
+		queue_push(&sock->rd_queue, op);
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_read_some(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_READ_SOME);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_read_some: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+
+	if(sock->rd_queue.head == NULL){
+		if(try_complete(sock, op) == 0)
+			defer_completion(sock, op);
+		else
+			queue_push(&sock->rd_queue, op);
 	}
 	else{
 		// insert into read queue tail
-		it = &sock->rd_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->rd_queue, op);
 	}
 	mutex_unlock(sock->lock);
 	return 0;
@@ -521,13 +753,13 @@ int net_async_read(struct socket *sock, char *buf, int len,
 int net_async_write(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
 	mutex_lock(sock->lock);
 	op = socket_op(sock, OP_WRITE);
 	if(op == NULL){
 		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_write: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		LOG_ERROR("net_async_write: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = sock;
@@ -538,24 +770,66 @@ int net_async_write(struct socket *sock, char *buf, int len,
 	op->complete = fp;
 	op->udata = udata;
 
-	if(sock->wr_queue == NULL){
+	if(sock->wr_queue.head == NULL){
 		if(try_complete(sock, op) == 0)
 			defer_completion(sock, op);
 		else
-			sock->wr_queue = op;
+			queue_push(&sock->wr_queue, op);
 	}
 	else{
 		// insert into write queue tail
-		it = &sock->wr_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->wr_queue, op);
 	}
 	mutex_unlock(sock->lock);
 	return 0;
 }
 
-int net_work(void)
+int net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	if(count < 1 || count > NET_MAX_IOV){
+		LOG_ERROR("net_async_writev: invalid number of buffers %d (max = %d)", count, NET_MAX_IOV);
+		return -1;
+	}
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_WRITEV);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_writev: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->len = 0;
+	for(int i = 0; i < count; i++){
+		op->iov[i].iov_base = bufs[i].buf;
+		op->iov[i].iov_len = bufs[i].len;
+		op->len += bufs[i].len;
+	}
+	op->iovpos = 0;
+	op->iovcnt = count;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+
+	if(sock->wr_queue.head == NULL){
+		if(try_complete(sock, op) == 0)
+			defer_completion(sock, op);
+		else
+			queue_push(&sock->wr_queue, op);
+	}
+	else{
+		// insert into write queue tail
+		queue_push(&sock->wr_queue, op);
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_work(int reactor)
 {
 	// set the kevent timeout to 1 sec
 	static struct timespec timeout = {
@@ -583,16 +857,13 @@ int net_work(void)
 		if(events[i].filter == EVFILT_USER){
 			while(1){
 				mutex_lock(sock->lock);
-				if((op = sock->usr_queue) == NULL){
+				if((op = queue_pop(&sock->usr_queue)) == NULL){
 					mutex_unlock(sock->lock);
 					break;
 				}
-				sock->usr_queue = op->next;
-				mutex_unlock(sock->lock);
 
-				// complete and release op
-				op->complete(op->socket, op->error, op->transfered, op->udata);
-				op->opcode = OP_NONE;
+				// release op and complete
+				complete_op(sock, op);
 			}
 		}
 
@@ -601,7 +872,7 @@ int net_work(void)
 			while(1){
 				mutex_lock(sock->lock);
 				// get next operation from the queue
-				if((op = sock->rd_queue) == NULL){
+				if((op = sock->rd_queue.head) == NULL){
 					mutex_unlock(sock->lock);
 					break;
 				}
@@ -609,7 +880,9 @@ int net_work(void)
 				// try to complete the operation
 				if(op->opcode == OP_ACCEPT)
 					ret = try_complete_accept(sock, op);
-				else /*if(op->opcode == OP_READ)*/
+				else if(op->opcode == OP_ACCEPT_BATCH)
+					ret = try_complete_accept_batch(sock, op);
+				else /*if(op->opcode == OP_READ || op->opcode == OP_READ_SOME)*/
 					ret = try_complete(sock, op);
 
 				// if operation is not ready for completion,
@@ -620,12 +893,10 @@ int net_work(void)
 				}
 
 				// advance read queue if the operation completed
-				sock->rd_queue = op->next;
-				mutex_unlock(sock->lock);
+				queue_pop(&sock->rd_queue);
 
-				// complete and release op
-				op->complete(op->socket, op->error, op->transfered, op->udata);
-				op->opcode = OP_NONE;
+				// release op and complete
+				complete_op(sock, op);
 			}
 		}
 
@@ -634,7 +905,7 @@ int net_work(void)
 			while(1){
 				mutex_lock(sock->lock);
 				// get next operation from the queue
-				if((op = sock->wr_queue) == NULL){
+				if((op = sock->wr_queue.head) == NULL){
 					mutex_unlock(sock->lock);
 					break;
 				}
@@ -650,12 +921,10 @@ int net_work(void)
 				}
 
 				// advance write queue if the operation completed
-				sock->wr_queue = op->next;
-				mutex_unlock(sock->lock);
+				queue_pop(&sock->wr_queue);
 
-				// complete and release op
-				op->complete(op->socket, op->error, op->transfered, op->udata);
-				op->opcode = OP_NONE;
+				// release op and complete
+				complete_op(sock, op);
 			}
 		}
 	}
@@ -663,6 +932,42 @@ int net_work(void)
 	return 0;
 }
 
+int net_socket_cork(struct socket *sock, int cork)
+{
+	int opt = (cork != 0) ? 1 : 0;
+
+	// TCP_NOPUSH is the BSD equivalent of TCP_CORK and clearing
+	// it pushes any partial segment immediately
+	if(setsockopt(sock->fd, IPPROTO_TCP, TCP_NOPUSH, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_socket_cork: failed to set socket nopush option (error = %d)", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int net_socket_zerocopy(struct socket *sock, int threshold)
+{
+	// MSG_ZEROCOPY is linux only
+	return -1;
+}
+
+int net_listen_drops(long *overflows, long *drops)
+{
+	struct tcpstat stats;
+	size_t len;
+
+	// listen queue overflows are the only
+	// listen drops counted on freebsd
+	len = sizeof(struct tcpstat);
+	if(sysctlbyname("net.inet.tcp.stats", &stats, &len, NULL, 0) == -1){
+		LOG_ERROR("net_listen_drops: failed to get tcp stats (error = %d)", errno);
+		return -1;
+	}
+	*overflows = (long)stats.tcps_listendrop;
+	*drops = (long)stats.tcps_listendrop;
+	return 0;
+}
+
 unsigned long net_remote_address(struct socket *sock)
 {
 	if(sock->addr.sa_family != AF_INET) return 0;
@@ -61,6 +61,40 @@ int atomic_compare_exchange(atomic_int *x, int cmp, int val)
 	return cmp;
 }
 
+void *atomic_load_ptr(atomic_ptr *x)
+{
+	return *x;
+}
+
+void atomic_store_ptr(atomic_ptr *x, void *val)
+{
+	*x = val;
+}
+
+// NOTE: the operand size on the pointer versions is
+// picked by the assembler from the register size
+void *atomic_exchange_ptr(atomic_ptr *x, void *val)
+{
+	__asm__ __volatile__(
+		"lock"			"\n\t"
+		"xchg %1, %0"		"\n\t"
+		: "+m"(*x), "+r"(val)
+		:
+		: "memory");
+	return val;
+}
+
+void *atomic_compare_exchange_ptr(atomic_ptr *x, void *cmp, void *val)
+{
+	__asm__ __volatile__(
+		"lock"			"\n\t"
+		"cmpxchg %2, %0"	"\n\t"
+		: "+m"(*x), "+a"(cmp)
+		: "r"(val)
+		: "memory");
+	return cmp;
+}
+
 void atomic_lwfence()
 {
 	// this may not be optimal
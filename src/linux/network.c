@@ -1,89 +1,189 @@
+// accept4 is a GNU extension
+#define _GNU_SOURCE
+
 #include "../network.h"
 
 #include "../mmblock.h"
 #include "../log.h"
 #include "../thread.h"
+#include "../atomic.h"
 
 #include <stddef.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include <sys/socket.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #define OP_NONE		0x00
 #define OP_ACCEPT	0x01
 #define OP_READ		0x02
 #define OP_WRITE	0x03
+#define OP_WRITEV	0x04
+#define OP_READ_SOME	0x05
+#define OP_ACCEPT_BATCH	0x06
+#define OP_RELEASE	0x07
 struct async_op{
 	long		opcode;
 	struct socket	*socket;
 	void		*buf;
 	long		len;
 
+	// vectored write buffers (len has the
+	// total remaining bytes)
+	struct iovec	iov[NET_MAX_IOV];
+	int		iovpos;
+	int		iovcnt;
+
+	// zero-copy state of write operations and the
+	// notification id of the last zero-copy send
+	int		zerocopy;
+	uint32_t	zc_last;
+
 	int		error;
 	int		transfered;
 	void		(*complete)(struct socket*, int, int, void*);
 	void		*udata;
 
+	// socket that owns the operation slot
+	struct socket	*owner;
 	struct async_op	*next;
 };
 
+struct op_queue{
+	struct async_op	*head;
+	struct async_op	*tail;
+};
+
+// zero-copy flags of write operations
+#define ZC_NONE			0x00
+#define ZC_REQUESTED		0x01
+#define ZC_SENT			0x02
+
+// each socket has SOCKET_MAX_OPS operation slots inline and
+// borrows from a shared pool when they're all in use
 #define MAX_SOCKETS		2048
 #define SOCKET_MAX_OPS		8
+#define MAX_POOL_OPS		4096
 struct socket{
 	int			fd;
+	struct reactor		*reactor;
 	struct sockaddr		addr;
 	struct async_op		ops[SOCKET_MAX_OPS];
-	struct async_op		*rd_queue;
-	struct async_op		*wr_queue;
-	struct mutex		*lock;
+	struct async_op		*free_ops;
+	struct op_queue		rd_queue;
+	struct op_queue		wr_queue;
+	atomic_int		lock;
+
+	// zero-copy sends: writes with at least zc_threshold bytes
+	// use MSG_ZEROCOPY and are held on zc_queue (along with every
+	// write completed after them) until the kernel notifies it's
+	// done with their buffers; notifications are numbered from 0
+	// on each socket and zc_done is the first one not received
+	int			zc_threshold;
+	uint32_t		zc_next;
+	uint32_t		zc_done;
+	struct op_queue		zc_queue;
+
+	// position on the socket table and the number of times the
+	// slot was released (epoll events carry both so events for
+	// a closed socket are dropped even if the slot is reused)
+	uint32_t		index;
+	uint32_t		generation;
+	struct socket		*next_free;
+	struct async_op		release_op;
 };
 
-static int		epoll_fd = -1;
-static struct mmblock	*sockblk = NULL;
+// socket lock states
+#define LOCK_FREE		0
+#define LOCK_HELD		1
+#define LOCK_WAITERS		2
+
+// epoll key of the reactor wakeup fd (sockets never have
+// an index this high)
+#define WAKEUP_KEY		UINT64_MAX
+
+// each reactor has its own epoll set and deferred list and
+// a socket is bound to the reactor that created/accepted it
+struct reactor{
+	int			epoll_fd;
 
-static struct async_op	*deferred_head = NULL;
-static struct async_op	*deferred_tail = NULL;
-static struct mutex	*deferred_lock = NULL;
+	// the wakeup fd is registered in the epoll set (with a NULL
+	// data pointer) so defer_completion can interrupt epoll_wait
+	int			wakeup_fd;
+	atomic_int		polling;
+
+	// intrusive lock-free stack pushed by any thread and
+	// taken whole by net_work with a single exchange
+	atomic_ptr		deferred;
+};
 
-static void defer_completion(struct async_op *op)
+static struct reactor	reactors[NET_MAX_REACTORS];
+static int		reactor_count = 0;
+static atomic_int	next_reactor = 0;
+static struct socket	*socktab = NULL;
+static struct socket	*free_sockets = NULL;
+static struct mutex	*socktab_lock = NULL;
+static struct mmblock	*opblk = NULL;
+
+static void wakeup(struct reactor *r)
 {
-	mutex_lock(deferred_lock);
-	op->next = NULL;
-	if(deferred_tail == NULL){
-		deferred_head = op;
-		deferred_tail = op;
-	}
-	else{
-		deferred_tail->next = op;
-		deferred_tail = op;
-	}
-	mutex_unlock(deferred_lock);
+	eventfd_t val = 1;
+	if(write(r->wakeup_fd, &val, sizeof(eventfd_t)) == -1 && errno != EAGAIN)
+		LOG_ERROR("wakeup: failed to signal wakeup fd (error = %d)", errno);
 }
 
-static struct async_op *pop_deferred(void)
+static void defer_completion(struct reactor *r, struct async_op *op)
 {
-	struct async_op *op;
-	mutex_lock(deferred_lock);
-	if(deferred_head == NULL){
-		mutex_unlock(deferred_lock);
+	struct async_op *head;
+	do{
+		head = atomic_load_ptr(&r->deferred);
+		op->next = head;
+	} while(atomic_compare_exchange_ptr(&r->deferred, head, op) != head);
+
+	// only wake net_work if it's (about to be) blocked on
+	// epoll_wait: if the list wasn't empty the producer that
+	// made it non empty already took care of it and the
+	// exchange makes so a single producer pays for the syscall
+	if(head == NULL && atomic_load(&r->polling) != 0
+			&& atomic_exchange(&r->polling, 0) != 0)
+		wakeup(r);
+}
+
+// take every deferred operation at once and return
+// them in the order they were deferred
+static struct async_op *take_deferred(struct reactor *r)
+{
+	struct async_op *op, *next, *list;
+	if(atomic_load_ptr(&r->deferred) == NULL)
 		return NULL;
-	}
 
-	op = deferred_head;
-	deferred_head = op->next;
-	if(deferred_head == NULL)
-		deferred_tail = NULL;
-	mutex_unlock(deferred_lock);
-	return op;
+	op = atomic_exchange_ptr(&r->deferred, NULL);
+	list = NULL;
+	while(op != NULL){
+		next = op->next;
+		op->next = list;
+		list = op;
+		op = next;
+	}
+	return list;
 }
 
 static int setoptions(int fd)
 {
 	int flags;
 	struct linger linger;
+	int opt;
 
 	// set linger
 	linger.l_onoff = 0;
@@ -93,6 +193,15 @@ static int setoptions(int fd)
 		return -1;
 	}
 
+	// disable nagle so output goes out as soon as it's written;
+	// batching is done explicitly with net_socket_cork (accepted
+	// sockets inherit this option from the listening socket)
+	opt = 1;
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int)) == -1){
+		LOG_ERROR("setoptions: failed to set socket nodelay option (error = %d)", errno);
+		return -1;
+	}
+
 	// set nonblocking
 	flags = fcntl(fd, F_GETFL);
 	if(flags == -1){
@@ -107,49 +216,147 @@ static int setoptions(int fd)
 	return 0;
 }
 
-static struct socket *socket_handle(int fd)
+static struct socket *socket_handle(int fd, struct reactor *r)
 {
 	struct socket *sock;
 
 	// create handle
-	sock = mmblock_xalloc(sockblk);
+	mutex_lock(socktab_lock);
+	sock = free_sockets;
+	if(sock != NULL)
+		free_sockets = sock->next_free;
+	mutex_unlock(socktab_lock);
 	if(sock == NULL){
-		LOG_ERROR("net_socket: socket memory block is at maximum capacity (%d)", MAX_SOCKETS);
+		LOG_ERROR("net_socket: socket table is at maximum capacity (%d)", MAX_SOCKETS);
 		return NULL;
 	}
 
 	// initialize handle
 	sock->fd = fd;
-	sock->rd_queue = NULL;
-	sock->wr_queue = NULL;
+	sock->reactor = r;
+	sock->rd_queue.head = NULL;
+	sock->rd_queue.tail = NULL;
+	sock->wr_queue.head = NULL;
+	sock->wr_queue.tail = NULL;
 	//memset(&sock->addr, 0, sizeof(struct sockaddr));
-	for(int i = 0; i < SOCKET_MAX_OPS; i++)
+	sock->free_ops = NULL;
+	for(int i = SOCKET_MAX_OPS - 1; i >= 0; i--){
 		sock->ops[i].opcode = OP_NONE;
-	mutex_create(&sock->lock);
+		sock->ops[i].next = sock->free_ops;
+		sock->free_ops = &sock->ops[i];
+	}
+	sock->lock = LOCK_FREE;
+	sock->release_op.opcode = OP_NONE;
+	sock->zc_threshold = 0;
+	sock->zc_next = 0;
+	sock->zc_done = 0;
+	sock->zc_queue.head = NULL;
+	sock->zc_queue.tail = NULL;
 	return sock;
 }
 
+// this is the only place the generation changes: a closed socket
+// is released by its reactor (OP_RELEASE) after every event it may
+// have already retrieved for it was processed so the epoll key is
+// only invalidated once the slot may be reused
 static void socket_release(struct socket *sock)
 {
 	close(sock->fd);
-	mutex_destroy(sock->lock);
-	mmblock_xfree(sockblk, sock);
+	sock->fd = -1;
+	mutex_lock(socktab_lock);
+	sock->generation += 1;
+	sock->next_free = free_sockets;
+	free_sockets = sock;
+	mutex_unlock(socktab_lock);
+}
+
+static uint64_t socket_key(struct socket *sock)
+{
+	return ((uint64_t)sock->generation << 32) | sock->index;
+}
+
+// returns NULL if the socket was closed
+// since the key was created
+static struct socket *socket_lookup(uint64_t key)
+{
+	struct socket *sock;
+	uint32_t index = (uint32_t)key;
+	if(index >= MAX_SOCKETS)
+		return NULL;
+	sock = &socktab[index];
+	if(sock->generation != (uint32_t)(key >> 32))
+		return NULL;
+	return sock;
+}
+
+// the socket lock is a futex word embedded in the socket so an
+// uncontended lock/unlock is a single atomic operation each and
+// contended waiters sleep instead of spinning (the lock owner may
+// be preempted in the middle of a send/recv)
+// the reactor can't skip it on sockets it owns: connection writes
+// are issued by whichever worker runs the protocol handlers and
+// listeners are closed from server_run so any socket may be used
+// by another thread at any time (handing those operations over to
+// the reactor would trade an uncontended atomic for a wakeup)
+// NOTE: unlike struct mutex it's NOT recursive
+static void socket_lock(struct socket *sock)
+{
+	int c = atomic_compare_exchange(&sock->lock, LOCK_FREE, LOCK_HELD);
+	if(c == LOCK_FREE)
+		return;
+
+	if(c != LOCK_WAITERS)
+		c = atomic_exchange(&sock->lock, LOCK_WAITERS);
+	while(c != LOCK_FREE){
+		syscall(SYS_futex, &sock->lock, FUTEX_WAIT_PRIVATE, LOCK_WAITERS, NULL, NULL, 0);
+		c = atomic_exchange(&sock->lock, LOCK_WAITERS);
+	}
+}
+
+static void socket_unlock(struct socket *sock)
+{
+	if(atomic_fetch_add(&sock->lock, -1) != LOCK_HELD){
+		atomic_store(&sock->lock, LOCK_FREE);
+		syscall(SYS_futex, &sock->lock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void queue_push(struct op_queue *q, struct async_op *op)
+{
+	op->next = NULL;
+	if(q->tail == NULL)
+		q->head = op;
+	else
+		q->tail->next = op;
+	q->tail = op;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static struct async_op *queue_pop(struct op_queue *q)
+{
+	struct async_op *op = q->head;
+	if(op != NULL){
+		q->head = op->next;
+		if(q->head == NULL)
+			q->tail = NULL;
+	}
+	return op;
 }
 
 static void cancel_rd_ops(struct socket *sock)
 {
 	struct async_op *op;
 	while(1){
-		mutex_lock(sock->lock);
-		if((op = sock->rd_queue) == NULL){
-			mutex_unlock(sock->lock);
+		socket_lock(sock);
+		if((op = queue_pop(&sock->rd_queue)) == NULL){
+			socket_unlock(sock);
 			break;
 		}
-		sock->rd_queue = op->next;
-		mutex_unlock(sock->lock);
+		socket_unlock(sock);
 
 		op->error = ECANCELED;
-		defer_completion(op);
+		defer_completion(sock->reactor, op);
 	}
 }
 
@@ -157,97 +364,199 @@ static void cancel_wr_ops(struct socket *sock)
 {
 	struct async_op *op;
 	while(1){
-		mutex_lock(sock->lock);
-		if((op = sock->wr_queue) == NULL){
-			mutex_unlock(sock->lock);
-			break;
+		// writes waiting for zero-copy notifications come first
+		// and were already sent so they complete successfully
+		// (their notifications won't arrive after the socket is
+		// closed but the kernel keeps its own page references)
+		socket_lock(sock);
+		if((op = queue_pop(&sock->zc_queue)) == NULL){
+			if((op = queue_pop(&sock->wr_queue)) == NULL){
+				socket_unlock(sock);
+				break;
+			}
+			op->error = ECANCELED;
 		}
-		sock->wr_queue = op->next;
-		mutex_unlock(sock->lock);
+		socket_unlock(sock);
 
-		op->error = ECANCELED;
-		defer_completion(op);
+		defer_completion(sock->reactor, op);
 	}
 }
 
 // NOTE: must be used INSIDE the socket lock
 static struct async_op *socket_op(struct socket *sock, int opcode)
 {
-	struct async_op *op = NULL;
-	for(int i = 0; i < SOCKET_MAX_OPS; i++){
-		if(sock->ops[i].opcode == OP_NONE){
-			op = &sock->ops[i];
-			op->opcode = opcode;
-			op->next = NULL;
-			break;
-		}
+	struct async_op *op = sock->free_ops;
+	if(op != NULL){
+		sock->free_ops = op->next;
+	}
+	else{
+		// every inline slot is in use (probably a deep
+		// write queue) so borrow one from the pool
+		op = mmblock_xalloc(opblk);
+		if(op == NULL)
+			return NULL;
 	}
+	op->owner = sock;
+	op->opcode = opcode;
+	op->zerocopy = ZC_NONE;
+	op->next = NULL;
 	return op;
 }
 
 // NOTE: must be used INSIDE the socket lock
-static int try_complete_accept(struct socket *sock, struct async_op *op)
+static void socket_op_release(struct socket *sock, struct async_op *op)
+{
+	op->opcode = OP_NONE;
+	if(op >= sock->ops && op < sock->ops + SOCKET_MAX_OPS){
+		op->next = sock->free_ops;
+		sock->free_ops = op;
+	}
+	else{
+		mmblock_xfree(opblk, op);
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+// the operation slot is released before running the completion
+// routine so it may be reused by it (this also makes it safe for
+// the routine to release the socket)
+static void complete_op(struct socket *sock, struct async_op *op)
+{
+	void (*complete)(struct socket*, int, int, void*) = op->complete;
+	struct socket *socket = op->socket;
+	int error = op->error;
+	int transfered = op->transfered;
+	void *udata = op->udata;
+
+	socket_op_release(sock, op);
+	socket_unlock(sock);
+	complete(socket, error, transfered, udata);
+}
+
+// NOTE: must be used INSIDE the socket lock
+// returns 0 if a connection was accepted, -1 if there are no
+// pending connections or the error code
+static int accept_one(struct socket *sock, struct socket **out)
 {
-	int fd, error;
+	int fd;
 	struct epoll_event event;
 	struct sockaddr addr;
 	socklen_t addrlen;
 
+	// accept4 sets the socket flags so there is no need to call
+	// setoptions (linger is already disabled by default)
 	addrlen = sizeof(struct sockaddr);
-	fd = accept(sock->fd, &addr, &addrlen);
+	fd = accept4(sock->fd, &addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if(fd == -1){
-		error = errno;
-		if(error == EWOULDBLOCK)
+		if(errno == EWOULDBLOCK)
 			return -1;
-		op->error = error;
-		return 0;
-	}
-
-	// set socket options
-	if(setoptions(fd) == -1){
-		LOG_ERROR("try_complete_accept: failed to set new socket options");
-		close(fd);
-		op->error = EAGAIN;
-		return 0;
+		return errno;
 	}
 
-	op->socket = socket_handle(fd);
-	if(op->socket == NULL){
-		LOG_ERROR("try_complete_accept: failed to create new socket handle");
+	// accepted sockets stay on the listening socket reactor
+	*out = socket_handle(fd, sock->reactor);
+	if(*out == NULL){
+		LOG_ERROR("accept_one: failed to create new socket handle");
 		close(fd);
-		op->error = EAGAIN;
-		return 0;
+		return EAGAIN;
 	}
 
 	// copy address to socket
-	memcpy(&op->socket->addr, &addr, sizeof(struct sockaddr));
+	memcpy(&(*out)->addr, &addr, sizeof(struct sockaddr));
 
 	event.events = EPOLLET | EPOLLIN | EPOLLOUT;
-	event.data.ptr = op->socket;
-	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
-		LOG_ERROR("try_complete_accept: failed to add new socket to epoll");
-		socket_release(op->socket);
-		op->socket = NULL;
-		op->error = EAGAIN;
-		return 0;
+	event.data.u64 = socket_key(*out);
+	if(epoll_ctl(sock->reactor->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+		LOG_ERROR("accept_one: failed to add new socket to epoll");
+		socket_release(*out);
+		*out = NULL;
+		return EAGAIN;
 	}
 	return 0;
 }
 
+// NOTE: must be used INSIDE the socket lock
+static int try_complete_accept(struct socket *sock, struct async_op *op)
+{
+	int ret = accept_one(sock, &op->socket);
+	if(ret == -1)
+		return -1;
+
+	op->error = ret;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static int try_complete_accept_batch(struct socket *sock, struct async_op *op)
+{
+	struct socket **socks = op->buf;
+	int ret;
+
+	// drain the backlog until it's empty or the batch is full
+	while(op->transfered < op->len){
+		ret = accept_one(sock, &socks[op->transfered]);
+		if(ret == -1)
+			break;
+
+		// errors are only reported on empty batches (if the
+		// error persists it will show up on the next one)
+		if(ret != 0){
+			if(op->transfered == 0)
+				op->error = ret;
+			return 0;
+		}
+		op->transfered += 1;
+	}
+	return (op->transfered > 0) ? 0 : -1;
+}
+
+// skip the first n bytes of a vectored write
+static void consume_iov(struct async_op *op, long n)
+{
+	struct iovec *iov;
+	while(n > 0){
+		iov = &op->iov[op->iovpos];
+		if((size_t)n < iov->iov_len){
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+			break;
+		}
+		n -= iov->iov_len;
+		op->iovpos += 1;
+	}
+}
+
 // NOTE: must be used INSIDE the socket lock
 static int try_complete(struct socket *sock, struct async_op *op)
 {
-	int ret, error;
+	int ret, error, flags;
+	struct msghdr msg;
 	while(op->len > 0){
-		if(op->opcode == OP_READ)
+		flags = (op->zerocopy & ZC_REQUESTED) ? MSG_ZEROCOPY : 0;
+		if(op->opcode == OP_READ || op->opcode == OP_READ_SOME){
 			ret = recv(sock->fd, op->buf, op->len, 0);
-		else /*if(op->opcode == OP_WRITE)*/
-			ret = send(sock->fd, op->buf, op->len, 0);
+		}
+		else if(op->opcode == OP_WRITEV){
+			memset(&msg, 0, sizeof(struct msghdr));
+			msg.msg_iov = &op->iov[op->iovpos];
+			msg.msg_iovlen = op->iovcnt - op->iovpos;
+			ret = sendmsg(sock->fd, &msg, flags);
+		}
+		else /*if(op->opcode == OP_WRITE)*/{
+			ret = send(sock->fd, op->buf, op->len, flags);
+		}
 
 		if(ret == -1){
 			error = errno;
 			if(error == EWOULDBLOCK)
 				return -1;
+
+			// the kernel ran out of memory to pin pages for
+			// zero-copy so fall back to copying the rest
+			if(error == ENOBUFS && flags != 0){
+				op->zerocopy &= ~ZC_REQUESTED;
+				continue;
+			}
 			op->error = error;
 			return 0;
 		}
@@ -257,56 +566,191 @@ static int try_complete(struct socket *sock, struct async_op *op)
 			//op->error = ECONNRESET;
 			return 0;
 		}
-		op->buf += ret;
+
+		// each successful zero-copy send gets the next
+		// notification id
+		if(flags != 0){
+			op->zerocopy |= ZC_SENT;
+			op->zc_last = sock->zc_next;
+			sock->zc_next += 1;
+		}
+
+		if(op->opcode == OP_WRITEV)
+			consume_iov(op, ret);
+		else
+			op->buf += ret;
 		op->len -= ret;
 		op->transfered += ret;
+
+		// read_some completes with whatever was available
+		if(op->opcode == OP_READ_SOME)
+			return 0;
 	}
 	return 0;
 }
 
-int net_init(void)
+// NOTE: must be used INSIDE the socket lock
+// returns 1 if the completed write must wait for zero-copy
+// notifications (it's moved to zc_queue) or 0 if it may complete
+static int hold_write(struct socket *sock, struct async_op *op)
 {
+	// writes complete in order so anything completed
+	// after a held write is held as well
+	if(sock->zc_queue.head == NULL && ((op->zerocopy & ZC_SENT) == 0
+			|| (int32_t)(op->zc_last - sock->zc_done) < 0))
+		return 0;
+
+	queue_push(&sock->zc_queue, op);
+	return 1;
+}
+
+// NOTE: must be used INSIDE the socket lock
+// reads zero-copy notifications from the socket error queue
+static void read_zc_notifications(struct socket *sock)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+
+	while(1){
+		memset(&msg, 0, sizeof(struct msghdr));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if(recvmsg(sock->fd, &msg, MSG_ERRQUEUE) == -1){
+			if(errno != EAGAIN)
+				LOG_ERROR("read_zc_notifications: failed to read error queue (error = %d)", errno);
+			break;
+		}
+
+		for(cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)){
+			if(!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR)
+					&& !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+				continue;
+
+			// each notification covers the range [ee_info, ee_data]
+			// and TCP delivers them in order
+			serr = (struct sock_extended_err*)CMSG_DATA(cm);
+			if(serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if((int32_t)(serr->ee_data + 1 - sock->zc_done) > 0)
+				sock->zc_done = serr->ee_data + 1;
+		}
+	}
+}
+
+static int reactor_init(struct reactor *r)
+{
+	struct epoll_event event;
+
 	// create epoll fd
-	epoll_fd = epoll_create1(0);
-	if(epoll_fd == -1){
-		LOG_ERROR("net_init: failed to create epoll fd (error = %d)", errno);
+	r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if(r->epoll_fd == -1){
+		LOG_ERROR("reactor_init: failed to create epoll fd (error = %d)", errno);
+		return -1;
+	}
+
+	// create wakeup fd and add it to epoll
+	r->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(r->wakeup_fd == -1){
+		LOG_ERROR("reactor_init: failed to create wakeup fd (error = %d)", errno);
+		close(r->epoll_fd);
+		r->epoll_fd = -1;
+		return -1;
+	}
+
+	event.events = EPOLLIN;
+	event.data.u64 = WAKEUP_KEY;
+	if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->wakeup_fd, &event) == -1){
+		LOG_ERROR("reactor_init: failed to add wakeup fd to epoll (error = %d)", errno);
+		close(r->wakeup_fd);
+		close(r->epoll_fd);
+		r->wakeup_fd = -1;
+		r->epoll_fd = -1;
+		return -1;
+	}
+	r->polling = 0;
+
+	r->deferred = NULL;
+	return 0;
+}
+
+static void reactor_release(struct reactor *r)
+{
+	close(r->wakeup_fd);
+	close(r->epoll_fd);
+}
+
+int net_init(int count)
+{
+	if(count < 1 || count > NET_MAX_REACTORS){
+		LOG_ERROR("net_init: invalid number of reactors %d (max = %d)", count, NET_MAX_REACTORS);
 		return -1;
 	}
 
-	// create socket memory block
-	sockblk = mmblock_create(MAX_SOCKETS, sizeof(struct socket));
-	mmblock_init_lock(sockblk);
+	for(reactor_count = 0; reactor_count < count; reactor_count++){
+		if(reactor_init(&reactors[reactor_count]) != 0){
+			LOG_ERROR("net_init: failed to initialize reactor #%d", reactor_count);
+			net_shutdown();
+			return -1;
+		}
+	}
+	next_reactor = 0;
 
-	// init deferred list
-	deferred_head = NULL;
-	deferred_tail = NULL;
-	mutex_create(&deferred_lock);
+	// create socket table
+	socktab = malloc(MAX_SOCKETS * sizeof(struct socket));
+	if(socktab == NULL){
+		LOG_ERROR("net_init: failed to allocate socket table");
+		net_shutdown();
+		return -1;
+	}
+	free_sockets = NULL;
+	for(int i = MAX_SOCKETS - 1; i >= 0; i--){
+		socktab[i].fd = -1;
+		socktab[i].index = i;
+		socktab[i].generation = 0;
+		socktab[i].next_free = free_sockets;
+		free_sockets = &socktab[i];
+	}
+	mutex_create(&socktab_lock);
+
+	// create operation pool memory block
+	opblk = mmblock_create(MAX_POOL_OPS, sizeof(struct async_op));
+	mmblock_init_lock(opblk);
 	return 0;
 }
 
 void net_shutdown(void)
 {
-	if(deferred_lock != NULL){
-		mutex_destroy(deferred_lock);
-		deferred_lock = NULL;
+	if(socktab != NULL){
+		mutex_destroy(socktab_lock);
+		free(socktab);
+		socktab = NULL;
+		free_sockets = NULL;
 	}
 
-	if(sockblk != NULL){
-		mmblock_release(sockblk);
-		sockblk = NULL;
+	if(opblk != NULL){
+		mmblock_release(opblk);
+		opblk = NULL;
 	}
 
-	if(epoll_fd != -1){
-		close(epoll_fd);
-		epoll_fd = -1;
+	while(reactor_count > 0){
+		reactor_count -= 1;
+		reactor_release(&reactors[reactor_count]);
 	}
 }
 
+int net_reactor_count(void)
+{
+	return reactor_count;
+}
+
 struct socket *net_socket(void)
 {
 	int fd;
 	struct epoll_event event;
 	struct socket *sock;
+	struct reactor *r;
 
 	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
 	if(fd == -1){
@@ -320,7 +764,9 @@ struct socket *net_socket(void)
 		return NULL;
 	}
 
-	sock = socket_handle(fd);
+	// spread sockets over reactors
+	r = &reactors[(unsigned)atomic_fetch_add(&next_reactor, 1) % reactor_count];
+	sock = socket_handle(fd, r);
 	if(sock == NULL){
 		LOG_ERROR("net_socket: failed to create socket handle");
 		close(fd);
@@ -329,8 +775,8 @@ struct socket *net_socket(void)
 
 	// add socket to epoll
 	event.events = EPOLLET | EPOLLIN | EPOLLOUT;
-	event.data.ptr = sock;
-	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+	event.data.u64 = socket_key(sock);
+	if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
 		LOG_ERROR("net_socket: failed to add socket to epoll (error = %d)", errno);
 		socket_release(sock);
 		return NULL;
@@ -339,12 +785,19 @@ struct socket *net_socket(void)
 	return sock;
 }
 
-struct socket *net_server_socket(int port)
+struct socket *net_server_socket(int port, int reactor)
 {
-	int fd;
+	int fd, opt;
 	struct socket *sock;
 	struct epoll_event event;
 	struct sockaddr_in addr;
+	struct reactor *r;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_server_socket: invalid reactor #%d", reactor);
+		return NULL;
+	}
+	r = &reactors[reactor];
 
 	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
 	if(fd == -1){
@@ -358,6 +811,27 @@ struct socket *net_server_socket(int port)
 		return NULL;
 	}
 
+	// allow restarting the server while connections from
+	// the last run are still on TIME_WAIT
+	opt = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_server_socket: failed to set reuseaddr option (error = %d)", errno);
+		close(fd);
+		return NULL;
+	}
+
+	// with multiple reactors each one has its own listening
+	// socket on the same port and the kernel balances the
+	// incoming connections between them
+	if(reactor_count > 1){
+		opt = 1;
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) == -1){
+			LOG_ERROR("net_server_socket: failed to set reuseport option (error = %d)", errno);
+			close(fd);
+			return NULL;
+		}
+	}
+
 	// bind to port
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(port);
@@ -376,7 +850,7 @@ struct socket *net_server_socket(int port)
 	}
 
 	// create socket handle
-	sock = socket_handle(fd);
+	sock = socket_handle(fd, r);
 	if(sock == NULL){
 		LOG_ERROR("net_server_socket: failed to create socket handle");
 		close(fd);
@@ -385,8 +859,8 @@ struct socket *net_server_socket(int port)
 
 	// add socket to epoll
 	event.events = EPOLLET | EPOLLIN;
-	event.data.ptr = sock;
-	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
+	event.data.u64 = socket_key(sock);
+	if(epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1){
 		LOG_ERROR("net_server_socket: failed to add socket to epoll (error = %d)", errno);
 		socket_release(sock);
 		return NULL;
@@ -404,16 +878,8 @@ void net_socket_shutdown(struct socket *sock, int how)
 		cancel_wr_ops(sock);
 }
 
-static void release_operation(struct socket *sock, int error, int transfered, void *udata)
-{
-	LOG("release operation");
-	socket_release(sock);
-}
-
 void net_close(struct socket *sock)
 {
-	struct async_op *op;
-
 	if(sock == NULL) return;
 
 	// NOTE: after calling net_close, the socket
@@ -421,9 +887,12 @@ void net_close(struct socket *sock)
 	// will have undefined behaviour (probably crash)
 
 	// remove socket from epoll
-	if(epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL) == -1)
+	if(epoll_ctl(sock->reactor->epoll_fd, EPOLL_CTL_DEL, sock->fd, NULL) == -1)
 		LOG_ERROR("net_close: failed to remove socket from epoll set (error = %d)", errno);
 
+	// events net_work already retrieved for the socket will find
+	// its queues empty and it's only released (and its epoll key
+	// invalidated) by the reactor after they're processed
 	// cancel queued operations
 	cancel_rd_ops(sock);
 	cancel_wr_ops(sock);
@@ -431,24 +900,21 @@ void net_close(struct socket *sock)
 	// adding the release operation last to the deferred list
 	// will make so every previous operation will be completed
 	// before actually releasing the socket resources
-	mutex_lock(sock->lock);
-	op = socket_op(sock, OP_READ);
-	mutex_unlock(sock->lock);
-	op->socket = sock;
-	op->complete = release_operation;
-	defer_completion(op);
+	sock->release_op.opcode = OP_RELEASE;
+	sock->release_op.owner = sock;
+	defer_completion(sock->reactor, &sock->release_op);
 }
 
 int net_async_accept(struct socket *sock,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
-	mutex_lock(sock->lock);
+	socket_lock(sock);
 	op = socket_op(sock, OP_ACCEPT);
 	if(op == NULL){
-		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_accept: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		socket_unlock(sock);
+		LOG_ERROR("net_async_accept: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = NULL;
@@ -456,32 +922,62 @@ int net_async_accept(struct socket *sock,
 	op->complete = fp;
 	op->udata = udata;
 
-	if(sock->rd_queue == NULL){
+	if(sock->rd_queue.head == NULL){
 		if(try_complete_accept(sock, op) == 0)
-			defer_completion(op);
+			defer_completion(sock->reactor, op);
 		else
-			sock->rd_queue = op;
+			queue_push(&sock->rd_queue, op);
 	}
 	else{
-		it = &sock->rd_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->rd_queue, op);
 	}
-	mutex_unlock(sock->lock);
+	socket_unlock(sock);
+	return 0;
+}
+
+int net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	socket_lock(sock);
+	op = socket_op(sock, OP_ACCEPT_BATCH);
+	if(op == NULL){
+		socket_unlock(sock);
+		LOG_ERROR("net_async_accept_batch: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = socks;
+	op->len = max;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+
+	if(sock->rd_queue.head == NULL){
+		if(try_complete_accept_batch(sock, op) == 0)
+			defer_completion(sock->reactor, op);
+		else
+			queue_push(&sock->rd_queue, op);
+	}
+	else{
+		queue_push(&sock->rd_queue, op);
+	}
+	socket_unlock(sock);
 	return 0;
 }
 
 int net_async_read(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
-	mutex_lock(sock->lock);
+	socket_lock(sock);
 	op = socket_op(sock, OP_READ);
 	if(op == NULL){
-		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_read: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		socket_unlock(sock);
+		LOG_ERROR("net_async_read: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = sock;
@@ -494,36 +990,34 @@ int net_async_read(struct socket *sock, char *buf, int len,
 
 	// if there are no pending read operations, we may try to
 	// complete the read operation now
-	if(sock->rd_queue == NULL){
+	if(sock->rd_queue.head == NULL){
 		// if the operation completed, defer the completion
 		// routine to net_work, else add it to the read queue
 		// so it will be completed when the socket is ready
 		// to read
 		if(try_complete(sock, op) == 0)
-			defer_completion(op);
+			defer_completion(sock->reactor, op);
 		else
-			sock->rd_queue = op;
+			queue_push(&sock->rd_queue, op);
 	}
 	else{
 		// insert into read queue tail
-		it = &sock->rd_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->rd_queue, op);
 	}
-	mutex_unlock(sock->lock);
+	socket_unlock(sock);
 	return 0;
 }
-int net_async_write(struct socket *sock, char *buf, int len,
+
+int net_async_read_some(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	struct async_op *op, **it;
+	struct async_op *op;
 
-	mutex_lock(sock->lock);
-	op = socket_op(sock, OP_WRITE);
+	socket_lock(sock);
+	op = socket_op(sock, OP_READ_SOME);
 	if(op == NULL){
-		mutex_unlock(sock->lock);
-		LOG_ERROR("net_async_write: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		socket_unlock(sock);
+		LOG_ERROR("net_async_read_some: operation pool exhausted (max = %d)", MAX_POOL_OPS);
 		return -1;
 	}
 	op->socket = sock;
@@ -534,94 +1028,207 @@ int net_async_write(struct socket *sock, char *buf, int len,
 	op->complete = fp;
 	op->udata = udata;
 
-	if(sock->wr_queue == NULL){
+	if(sock->rd_queue.head == NULL){
 		if(try_complete(sock, op) == 0)
-			defer_completion(op);
+			defer_completion(sock->reactor, op);
 		else
-			sock->wr_queue = op;
+			queue_push(&sock->rd_queue, op);
+	}
+	else{
+		// insert into read queue tail
+		queue_push(&sock->rd_queue, op);
+	}
+	socket_unlock(sock);
+	return 0;
+}
+int net_async_write(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	socket_lock(sock);
+	op = socket_op(sock, OP_WRITE);
+	if(op == NULL){
+		socket_unlock(sock);
+		LOG_ERROR("net_async_write: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(sock->zc_threshold > 0 && op->len >= sock->zc_threshold)
+		op->zerocopy = ZC_REQUESTED;
+
+	if(sock->wr_queue.head == NULL){
+		if(try_complete(sock, op) != 0)
+			queue_push(&sock->wr_queue, op);
+		else if(hold_write(sock, op) == 0)
+			defer_completion(sock->reactor, op);
 	}
 	else{
 		// insert into write queue tail
-		it = &sock->wr_queue;
-		while(*it != NULL)
-			it = &(*it)->next;
-		*it = op;
+		queue_push(&sock->wr_queue, op);
 	}
-	mutex_unlock(sock->lock);
+	socket_unlock(sock);
 	return 0;
 }
 
-int net_work(void)
+int net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
-	int ret;
+	struct async_op *op;
+
+	if(count < 1 || count > NET_MAX_IOV){
+		LOG_ERROR("net_async_writev: invalid number of buffers %d (max = %d)", count, NET_MAX_IOV);
+		return -1;
+	}
+
+	socket_lock(sock);
+	op = socket_op(sock, OP_WRITEV);
+	if(op == NULL){
+		socket_unlock(sock);
+		LOG_ERROR("net_async_writev: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->len = 0;
+	for(int i = 0; i < count; i++){
+		op->iov[i].iov_base = bufs[i].buf;
+		op->iov[i].iov_len = bufs[i].len;
+		op->len += bufs[i].len;
+	}
+	op->iovpos = 0;
+	op->iovcnt = count;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(sock->zc_threshold > 0 && op->len >= sock->zc_threshold)
+		op->zerocopy = ZC_REQUESTED;
+
+	if(sock->wr_queue.head == NULL){
+		if(try_complete(sock, op) != 0)
+			queue_push(&sock->wr_queue, op);
+		else if(hold_write(sock, op) == 0)
+			defer_completion(sock->reactor, op);
+	}
+	else{
+		// insert into write queue tail
+		queue_push(&sock->wr_queue, op);
+	}
+	socket_unlock(sock);
+	return 0;
+}
+
+int net_work(int reactor)
+{
+	int ret, count, timeout;
+	eventfd_t val;
 	struct epoll_event events[64];
 	struct socket *sock;
-	struct async_op *op;
+	struct async_op *op, *next;
+	struct reactor *r;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_work: invalid reactor #%d", reactor);
+		return -1;
+	}
+	r = &reactors[reactor];
 
 	// this is for deferred completion: the operation
 	// is completed when the call happens but the completion
 	// is deferred to net_work
-	while(1){
-		op = pop_deferred();
-		if(op == NULL) break;
-		op->complete(op->socket, op->error, op->transfered, op->udata);
-		op->opcode = OP_NONE;
+	while((op = take_deferred(r)) != NULL){
+		while(op != NULL){
+			next = op->next;
+			if(op->opcode == OP_RELEASE){
+				socket_release(op->owner);
+			}
+			else{
+				socket_lock(op->owner);
+				complete_op(op->owner, op);
+			}
+			op = next;
+		}
 	}
 
+	// announce we're going to block so defer_completion will
+	// signal the wakeup fd, then re-check the deferred list in
+	// case an operation was queued before the flag was visible
+	atomic_store(&r->polling, 1);
+	atomic_hwfence();
+	timeout = (atomic_load_ptr(&r->deferred) == NULL) ? NET_WORK_TIMEOUT : 0;
+
 	// retrieve epoll events
-	// NOTE: without signals (which is clunky) there is no way to signal
-	// epoll_wait to resume so we cannot set a timout here or else the
-	// deferred operations will stall if there is no event from the epoll
-	ret = epoll_wait(epoll_fd, events, 64, 0);
-	if(ret == -1){
+	count = epoll_wait(r->epoll_fd, events, 64, timeout);
+	atomic_store(&r->polling, 0);
+	if(count == -1){
+		if(errno == EINTR)
+			return 0;
 		LOG_ERROR("net_work: epoll_wait failed (error = %d)", errno);
 		return -1;
 	}
 
 	// process epoll events
-	for(int i = 0; i < ret; i++){
-		sock = events[i].data.ptr;
+	for(int i = 0; i < count; i++){
+		// wakeup fd (deferred operations are
+		// completed on the next call)
+		if(events[i].data.u64 == WAKEUP_KEY){
+			if(read(r->wakeup_fd, &val, sizeof(eventfd_t)) == -1 && errno != EAGAIN)
+				LOG_ERROR("net_work: failed to read wakeup fd (error = %d)", errno);
+			continue;
+		}
+
+		// drop events for sockets released since
+		// the key was registered
+		sock = socket_lookup(events[i].data.u64);
+		if(sock == NULL)
+			continue;
 
 		// socket ready to read
 		if((events[i].events & EPOLLIN) != 0){
 			while(1){
-				mutex_lock(sock->lock);
+				socket_lock(sock);
 				// get next operation from the queue
-				if((op = sock->rd_queue) == NULL){
-					mutex_unlock(sock->lock);
+				if((op = sock->rd_queue.head) == NULL){
+					socket_unlock(sock);
 					break;
 				}
 
 				// try to complete the operation
 				if(op->opcode == OP_ACCEPT)
 					ret = try_complete_accept(sock, op);
-				else /*if(op->opcode == OP_READ)*/
+				else if(op->opcode == OP_ACCEPT_BATCH)
+					ret = try_complete_accept_batch(sock, op);
+				else /*if(op->opcode == OP_READ || op->opcode == OP_READ_SOME)*/
 					ret = try_complete(sock, op);
 
 				// if operation is not ready for completion,
 				// break the loop
 				if(ret == -1){
-					mutex_unlock(sock->lock);
+					socket_unlock(sock);
 					break;
 				}
 
 				// advance read queue if the operation completed
-				sock->rd_queue = op->next;
-				mutex_unlock(sock->lock);
+				queue_pop(&sock->rd_queue);
 
-				// complete and release op
-				op->complete(op->socket, op->error, op->transfered, op->udata);
-				op->opcode = OP_NONE;
+				// release op and complete
+				complete_op(sock, op);
 			}
 		}
 
 		// socket ready to write
 		if((events[i].events & EPOLLOUT) != 0){
 			while(1){
-				mutex_lock(sock->lock);
+				socket_lock(sock);
 				// get next operation from the queue
-				if((op = sock->wr_queue) == NULL){
-					mutex_unlock(sock->lock);
+				if((op = sock->wr_queue.head) == NULL){
+					socket_unlock(sock);
 					break;
 				}
 
@@ -631,25 +1238,119 @@ int net_work(void)
 				// if operation is not ready for completion,
 				// break the loop
 				if(ret == -1){
-					mutex_unlock(sock->lock);
+					socket_unlock(sock);
 					break;
 				}
 
 				// advance write queue if the operation completed
-				sock->wr_queue = op->next;
-				mutex_unlock(sock->lock);
+				queue_pop(&sock->wr_queue);
+				if(hold_write(sock, op) != 0){
+					socket_unlock(sock);
+					continue;
+				}
 
-				// complete and release op
-				op->complete(op->socket, op->error, op->transfered, op->udata);
-				op->opcode = OP_NONE;
+				// release op and complete
+				complete_op(sock, op);
 			}
 		}
+
+		// zero-copy notifications (they are
+		// delivered through the error queue)
+		if((events[i].events & EPOLLERR) != 0){
+			socket_lock(sock);
+			// the threshold may have been set to 0 while sends
+			// were still waiting for their notifications
+			if(sock->zc_queue.head != NULL || sock->zc_next != sock->zc_done)
+				read_zc_notifications(sock);
+			while((op = sock->zc_queue.head) != NULL){
+				if((op->zerocopy & ZC_SENT) != 0
+						&& (int32_t)(op->zc_last - sock->zc_done) >= 0)
+					break;
+				queue_pop(&sock->zc_queue);
+				complete_op(sock, op);
+				socket_lock(sock);
+			}
+			socket_unlock(sock);
+		}
 	}
 
 	return 0;
 }
 
 
+int net_socket_cork(struct socket *sock, int cork)
+{
+	int opt = (cork != 0) ? 1 : 0;
+
+	// clearing the cork pushes any partial segment immediately
+	if(setsockopt(sock->fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_socket_cork: failed to set socket cork option (error = %d)", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int net_socket_zerocopy(struct socket *sock, int threshold)
+{
+	int opt = 1;
+
+	// zero-copy can't be turned off once enabled
+	// but a threshold of 0 stops using it
+	if(threshold > 0 && setsockopt(sock->fd, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_socket_zerocopy: failed to enable zero-copy (error = %d)", errno);
+		return -1;
+	}
+
+	socket_lock(sock);
+	sock->zc_threshold = (threshold > 0) ? threshold : 0;
+	socket_unlock(sock);
+	return 0;
+}
+
+int net_listen_drops(long *overflows, long *drops)
+{
+	char names[4096], values[4096];
+	char *name, *value, *name_save, *value_save;
+	int found;
+	FILE *fp;
+
+	// TcpExt has a line with the counter names
+	// followed by a line with their values
+	fp = fopen("/proc/net/netstat", "r");
+	if(fp == NULL){
+		LOG_ERROR("net_listen_drops: failed to open /proc/net/netstat (error = %d)", errno);
+		return -1;
+	}
+	found = 0;
+	while(fgets(names, sizeof(names), fp) != NULL){
+		if(strncmp(names, "TcpExt:", 7) == 0
+				&& fgets(values, sizeof(values), fp) != NULL){
+			found = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	if(found == 0)
+		return -1;
+
+	found = 0;
+	name = strtok_r(names, " \n", &name_save);
+	value = strtok_r(values, " \n", &value_save);
+	while(name != NULL && value != NULL){
+		if(strcmp(name, "ListenOverflows") == 0){
+			*overflows = strtol(value, NULL, 10);
+			found |= 1;
+		}
+		else if(strcmp(name, "ListenDrops") == 0){
+			*drops = strtol(value, NULL, 10);
+			found |= 2;
+		}
+		name = strtok_r(NULL, " \n", &name_save);
+		value = strtok_r(NULL, " \n", &value_save);
+	}
+	return (found == 3) ? 0 : -1;
+}
+
 unsigned long net_remote_address(struct socket *sock)
 {
 	if(sock->addr.sa_family != AF_INET) return 0;
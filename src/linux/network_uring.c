@@ -0,0 +1,1344 @@
+// accept4 is a GNU extension
+#define _GNU_SOURCE
+
+#include "../network.h"
+
+#include "../mmblock.h"
+#include "../log.h"
+#include "../thread.h"
+#include "../atomic.h"
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+
+#define OP_NONE		0x00
+#define OP_ACCEPT	0x01
+#define OP_READ		0x02
+#define OP_WRITE	0x03
+#define OP_RELEASE	0x04
+#define OP_WRITEV	0x05
+#define OP_READ_SOME	0x06
+#define OP_ACCEPT_BATCH	0x07
+struct async_op{
+	long		opcode;
+	struct socket	*socket;
+	void		*buf;
+	long		len;
+
+	// vectored write buffers (len has the total
+	// remaining bytes and msg is handed to the kernel)
+	struct iovec	iov[NET_MAX_IOV];
+	int		iovpos;
+	int		iovcnt;
+	struct msghdr	msg;
+
+	int		error;
+	int		transfered;
+	void		(*complete)(struct socket*, int, int, void*);
+	void		*udata;
+
+	// accept output
+	struct sockaddr	addr;
+	socklen_t	addrlen;
+
+	// when set, the accept is waiting for the listener
+	// to become readable before being resubmitted
+	int		polling;
+
+	// socket that owns the operation slot
+	struct socket	*owner;
+	struct async_op	*next;
+};
+
+struct op_queue{
+	struct async_op	*head;
+	struct async_op	*tail;
+};
+
+#define SOCKET_CLOSING		0x01
+
+// each socket has SOCKET_MAX_OPS operation slots inline and
+// borrows from a shared pool when they're all in use
+#define MAX_SOCKETS		2048
+#define SOCKET_MAX_OPS		8
+#define MAX_POOL_OPS		4096
+struct socket{
+	int			fd;
+	struct reactor		*reactor;
+	long			flags;
+	long			inflight;
+	struct sockaddr		addr;
+	struct async_op		ops[SOCKET_MAX_OPS];
+	struct async_op		release_op;
+	struct async_op		*free_ops;
+	struct op_queue		rd_queue;
+	struct op_queue		wr_queue;
+	struct mutex		*lock;
+};
+
+// io_uring rings: the SQ is shared between every thread
+// issuing operations (guarded by sq_lock) while the CQ is
+// only consumed by net_work
+#define RING_ENTRIES 1024
+struct ring{
+	int			fd;
+
+	void			*sq_ptr;
+	size_t			sq_len;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		sq_entries;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_len;
+
+	void			*cq_ptr;
+	size_t			cq_len;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	// number of SQEs written to the ring
+	// but not yet submitted to the kernel
+	unsigned		pending;
+};
+
+// each reactor has its own ring and deferred list and a
+// socket is bound to the reactor that created/accepted it
+struct reactor{
+	struct ring		ring;
+	struct mutex		*sq_lock;
+
+	// when set, net_work is (about to be) blocked on io_uring_enter
+	// and SQEs queued from other threads must be submitted by them
+	atomic_int		polling;
+
+	// operations completed outside the ring (cancelled before
+	// being submitted and socket releases)
+	// intrusive lock-free stack pushed by any thread and
+	// taken whole by net_work with a single exchange
+	atomic_ptr		deferred;
+};
+
+static struct reactor	reactors[NET_MAX_REACTORS];
+static int		reactor_count = 0;
+static atomic_int	next_reactor = 0;
+static struct mmblock	*sockblk = NULL;
+static struct mmblock	*opblk = NULL;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+		unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit,
+		min_complete, flags, arg, argsz);
+}
+
+static int ring_init(struct ring *r, unsigned entries)
+{
+	struct io_uring_params p;
+
+	memset(&p, 0, sizeof(struct io_uring_params));
+	r->fd = uring_setup(entries, &p);
+	if(r->fd == -1){
+		LOG_ERROR("ring_init: io_uring_setup failed (error = %d)", errno);
+		return -1;
+	}
+
+	// the timeout on net_work needs IORING_ENTER_EXT_ARG
+	if((p.features & IORING_FEAT_EXT_ARG) == 0){
+		LOG_ERROR("ring_init: kernel doesn't support IORING_FEAT_EXT_ARG");
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	// map submission and completion rings
+	r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if((p.features & IORING_FEAT_SINGLE_MMAP) != 0){
+		if(r->cq_len > r->sq_len)
+			r->sq_len = r->cq_len;
+		r->cq_len = r->sq_len;
+	}
+
+	r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ptr == MAP_FAILED){
+		LOG_ERROR("ring_init: failed to map submission ring (error = %d)", errno);
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	if((p.features & IORING_FEAT_SINGLE_MMAP) != 0){
+		r->cq_ptr = r->sq_ptr;
+	}
+	else{
+		r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ptr == MAP_FAILED){
+			LOG_ERROR("ring_init: failed to map completion ring (error = %d)", errno);
+			munmap(r->sq_ptr, r->sq_len);
+			close(r->fd);
+			r->fd = -1;
+			return -1;
+		}
+	}
+
+	r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED){
+		LOG_ERROR("ring_init: failed to map submission entries (error = %d)", errno);
+		if(r->cq_ptr != r->sq_ptr)
+			munmap(r->cq_ptr, r->cq_len);
+		munmap(r->sq_ptr, r->sq_len);
+		close(r->fd);
+		r->fd = -1;
+		return -1;
+	}
+
+	r->sq_head = (unsigned*)((char*)r->sq_ptr + p.sq_off.head);
+	r->sq_tail = (unsigned*)((char*)r->sq_ptr + p.sq_off.tail);
+	r->sq_mask = (unsigned*)((char*)r->sq_ptr + p.sq_off.ring_mask);
+	r->sq_array = (unsigned*)((char*)r->sq_ptr + p.sq_off.array);
+	r->sq_entries = p.sq_entries;
+	r->cq_head = (unsigned*)((char*)r->cq_ptr + p.cq_off.head);
+	r->cq_tail = (unsigned*)((char*)r->cq_ptr + p.cq_off.tail);
+	r->cq_mask = (unsigned*)((char*)r->cq_ptr + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)((char*)r->cq_ptr + p.cq_off.cqes);
+	r->pending = 0;
+
+	// SQEs are always used in ring order so the
+	// indirection array can be set up only once
+	for(unsigned i = 0; i < r->sq_entries; i++)
+		r->sq_array[i] = i;
+	return 0;
+}
+
+static void ring_release(struct ring *r)
+{
+	if(r->fd == -1)
+		return;
+	munmap(r->sqes, r->sqes_len);
+	if(r->cq_ptr != r->sq_ptr)
+		munmap(r->cq_ptr, r->cq_len);
+	munmap(r->sq_ptr, r->sq_len);
+	close(r->fd);
+	r->fd = -1;
+}
+
+// NOTE: must be used INSIDE the sq lock
+static void ring_flush(struct ring *r)
+{
+	int ret;
+	if(r->pending == 0)
+		return;
+	ret = uring_enter(r->fd, r->pending, 0, 0, NULL, 0);
+	if(ret == -1){
+		if(errno != EAGAIN && errno != EBUSY && errno != EINTR)
+			LOG_ERROR("ring_flush: io_uring_enter failed (error = %d)", errno);
+		return;
+	}
+	r->pending -= ret;
+}
+
+// NOTE: must be used INSIDE the sq lock
+static struct io_uring_sqe *ring_sqe(struct ring *r)
+{
+	struct io_uring_sqe *sqe;
+	unsigned tail;
+
+	// if the ring is full, submit what we have
+	// so the kernel consumes the entries
+	tail = *r->sq_tail;
+	atomic_lwfence();
+	if(tail - *r->sq_head >= r->sq_entries){
+		ring_flush(r);
+		atomic_lwfence();
+		if(tail - *r->sq_head >= r->sq_entries){
+			LOG_ERROR("ring_sqe: submission ring is full (%u)", r->sq_entries);
+			return NULL;
+		}
+	}
+
+	sqe = &r->sqes[tail & *r->sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	return sqe;
+}
+
+// NOTE: must be used INSIDE the sq lock
+static void ring_push(struct reactor *r)
+{
+	// make the SQE contents visible before the tail
+	atomic_lwfence();
+	*r->ring.sq_tail += 1;
+	r->ring.pending += 1;
+
+	// net_work batches every SQE queued while it's running but if
+	// it's blocked we need to submit from here
+	atomic_hwfence();
+	if(atomic_load(&r->polling) != 0)
+		ring_flush(&r->ring);
+}
+
+// NOTE: must be used INSIDE the socket lock
+static int submit_op(struct async_op *op)
+{
+	struct io_uring_sqe *sqe;
+	struct socket *sock = op->socket;
+	struct reactor *r = sock->reactor;
+
+	mutex_lock(r->sq_lock);
+	sqe = ring_sqe(&r->ring);
+	if(sqe == NULL){
+		mutex_unlock(r->sq_lock);
+		return -1;
+	}
+
+	if(op->polling != 0){
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = sock->fd;
+		sqe->poll_events = POLLIN;
+	}
+	else if(op->opcode == OP_ACCEPT || op->opcode == OP_ACCEPT_BATCH){
+		op->addrlen = sizeof(struct sockaddr);
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = sock->fd;
+		sqe->addr = (uint64_t)(uintptr_t)&op->addr;
+		sqe->addr2 = (uint64_t)(uintptr_t)&op->addrlen;
+		sqe->accept_flags = SOCK_CLOEXEC;
+	}
+	else if(op->opcode == OP_WRITEV){
+		memset(&op->msg, 0, sizeof(struct msghdr));
+		op->msg.msg_iov = &op->iov[op->iovpos];
+		op->msg.msg_iovlen = op->iovcnt - op->iovpos;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = sock->fd;
+		sqe->addr = (uint64_t)(uintptr_t)&op->msg;
+		sqe->len = 1;
+		sqe->msg_flags = MSG_NOSIGNAL;
+	}
+	else{
+		sqe->opcode = (op->opcode == OP_WRITE) ? IORING_OP_SEND : IORING_OP_RECV;
+		sqe->fd = sock->fd;
+		sqe->addr = (uint64_t)(uintptr_t)op->buf;
+		sqe->len = (uint32_t)op->len;
+		sqe->msg_flags = (op->opcode == OP_WRITE) ? MSG_NOSIGNAL : 0;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)op;
+	ring_push(r);
+	mutex_unlock(r->sq_lock);
+	sock->inflight += 1;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void submit_cancel(struct reactor *r, struct async_op *op)
+{
+	struct io_uring_sqe *sqe;
+
+	mutex_lock(r->sq_lock);
+	sqe = ring_sqe(&r->ring);
+	if(sqe != NULL){
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = (uint64_t)(uintptr_t)op;
+		sqe->user_data = 0;
+		ring_push(r);
+	}
+	mutex_unlock(r->sq_lock);
+}
+
+static void wakeup(struct reactor *r)
+{
+	struct io_uring_sqe *sqe;
+
+	// a NOP completion is enough to
+	// interrupt io_uring_enter
+	mutex_lock(r->sq_lock);
+	sqe = ring_sqe(&r->ring);
+	if(sqe != NULL){
+		sqe->opcode = IORING_OP_NOP;
+		sqe->user_data = 0;
+		ring_push(r);
+	}
+	mutex_unlock(r->sq_lock);
+}
+
+static void defer_completion(struct reactor *r, struct async_op *op)
+{
+	struct async_op *head;
+	do{
+		head = atomic_load_ptr(&r->deferred);
+		op->next = head;
+	} while(atomic_compare_exchange_ptr(&r->deferred, head, op) != head);
+
+	// the producer that made the list non empty is the
+	// one responsible for waking net_work
+	if(head == NULL && atomic_load(&r->polling) != 0)
+		wakeup(r);
+}
+
+// take every deferred operation at once and return
+// them in the order they were deferred
+static struct async_op *take_deferred(struct reactor *r)
+{
+	struct async_op *op, *next, *list;
+	if(atomic_load_ptr(&r->deferred) == NULL)
+		return NULL;
+
+	op = atomic_exchange_ptr(&r->deferred, NULL);
+	list = NULL;
+	while(op != NULL){
+		next = op->next;
+		op->next = list;
+		list = op;
+		op = next;
+	}
+	return list;
+}
+
+static int setoptions(int fd)
+{
+	struct linger linger;
+	int opt;
+
+	// set linger
+	linger.l_onoff = 0;
+	linger.l_linger = 0;
+	if(setsockopt(fd, SOL_SOCKET, SO_LINGER, (void *)&linger, sizeof(struct linger)) == -1){
+		LOG_ERROR("setoptions: failed to set socket linger option (error = %d)", errno);
+		return -1;
+	}
+
+	// disable nagle so output goes out as soon as it's written;
+	// batching is done explicitly with net_socket_cork (accepted
+	// sockets inherit this option from the listening socket)
+	opt = 1;
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(int)) == -1){
+		LOG_ERROR("setoptions: failed to set socket nodelay option (error = %d)", errno);
+		return -1;
+	}
+
+	// NOTE: sockets don't need to be nonblocking as
+	// operations are carried by the kernel
+	return 0;
+}
+
+static struct socket *socket_handle(int fd, struct reactor *r)
+{
+	struct socket *sock;
+
+	// create handle
+	sock = mmblock_xalloc(sockblk);
+	if(sock == NULL){
+		LOG_ERROR("net_socket: socket memory block is at maximum capacity (%d)", MAX_SOCKETS);
+		return NULL;
+	}
+
+	// initialize handle
+	sock->fd = fd;
+	sock->reactor = r;
+	sock->flags = 0;
+	sock->inflight = 0;
+	sock->rd_queue.head = NULL;
+	sock->rd_queue.tail = NULL;
+	sock->wr_queue.head = NULL;
+	sock->wr_queue.tail = NULL;
+	sock->free_ops = NULL;
+	for(int i = SOCKET_MAX_OPS - 1; i >= 0; i--){
+		sock->ops[i].opcode = OP_NONE;
+		sock->ops[i].next = sock->free_ops;
+		sock->free_ops = &sock->ops[i];
+	}
+	sock->release_op.opcode = OP_NONE;
+	mutex_create(&sock->lock);
+	return sock;
+}
+
+static void socket_release(struct socket *sock)
+{
+	close(sock->fd);
+	mutex_destroy(sock->lock);
+	mmblock_xfree(sockblk, sock);
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void queue_push(struct op_queue *q, struct async_op *op)
+{
+	op->next = NULL;
+	if(q->tail == NULL)
+		q->head = op;
+	else
+		q->tail->next = op;
+	q->tail = op;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static struct async_op *queue_pop(struct op_queue *q)
+{
+	struct async_op *op = q->head;
+	if(op != NULL){
+		q->head = op->next;
+		if(q->head == NULL)
+			q->tail = NULL;
+	}
+	return op;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void cancel_queue(struct socket *sock, struct op_queue *queue)
+{
+	struct async_op *op, *next;
+
+	if(queue->head == NULL)
+		return;
+
+	// the queue head is already on the ring and will
+	// complete with ECANCELED through the CQ
+	submit_cancel(sock->reactor, queue->head);
+
+	// the remaining operations were never submitted
+	op = queue->head->next;
+	queue->head->next = NULL;
+	queue->tail = queue->head;
+	while(op != NULL){
+		next = op->next;
+		op->error = ECANCELED;
+		defer_completion(sock->reactor, op);
+		op = next;
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+static struct async_op *socket_op(struct socket *sock, int opcode)
+{
+	struct async_op *op = sock->free_ops;
+	if(op != NULL){
+		sock->free_ops = op->next;
+	}
+	else{
+		// every inline slot is in use (probably a deep
+		// write queue) so borrow one from the pool
+		op = mmblock_xalloc(opblk);
+		if(op == NULL)
+			return NULL;
+	}
+	op->owner = sock;
+	op->opcode = opcode;
+	op->polling = 0;
+	op->next = NULL;
+	return op;
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void socket_op_release(struct socket *sock, struct async_op *op)
+{
+	op->opcode = OP_NONE;
+	if(op >= sock->ops && op < sock->ops + SOCKET_MAX_OPS){
+		op->next = sock->free_ops;
+		sock->free_ops = op;
+	}
+	else{
+		mmblock_xfree(opblk, op);
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+static void socket_try_release(struct socket *sock)
+{
+	// release the socket only after every submitted operation
+	// has completed; the release is deferred so operations
+	// cancelled before submission are completed first
+	if((sock->flags & SOCKET_CLOSING) != 0 && sock->inflight == 0
+			&& sock->release_op.opcode == OP_NONE){
+		sock->release_op.opcode = OP_RELEASE;
+		sock->release_op.socket = sock;
+		defer_completion(sock->reactor, &sock->release_op);
+	}
+}
+
+// NOTE: must be used INSIDE the socket lock
+static int enqueue_op(struct op_queue *queue, struct async_op *op)
+{
+	// only the queue head is submitted to the ring so
+	// operations on the same socket complete in order
+	queue_push(queue, op);
+	if(queue->head == op && submit_op(op) != 0){
+		queue_pop(queue);
+		return -1;
+	}
+	return 0;
+}
+
+static int reactor_init(struct reactor *r)
+{
+	if(ring_init(&r->ring, RING_ENTRIES) != 0){
+		LOG_ERROR("reactor_init: failed to initialize io_uring");
+		return -1;
+	}
+	mutex_create(&r->sq_lock);
+	r->polling = 0;
+
+	r->deferred = NULL;
+	return 0;
+}
+
+static void reactor_release(struct reactor *r)
+{
+	mutex_destroy(r->sq_lock);
+	ring_release(&r->ring);
+}
+
+int net_init(int count)
+{
+	if(count < 1 || count > NET_MAX_REACTORS){
+		LOG_ERROR("net_init: invalid number of reactors %d (max = %d)", count, NET_MAX_REACTORS);
+		return -1;
+	}
+
+	for(reactor_count = 0; reactor_count < count; reactor_count++){
+		if(reactor_init(&reactors[reactor_count]) != 0){
+			LOG_ERROR("net_init: failed to initialize reactor #%d", reactor_count);
+			net_shutdown();
+			return -1;
+		}
+	}
+	next_reactor = 0;
+
+	// create socket and operation pool memory blocks
+	sockblk = mmblock_create(MAX_SOCKETS, sizeof(struct socket));
+	mmblock_init_lock(sockblk);
+	opblk = mmblock_create(MAX_POOL_OPS, sizeof(struct async_op));
+	mmblock_init_lock(opblk);
+	return 0;
+}
+
+void net_shutdown(void)
+{
+	if(sockblk != NULL){
+		mmblock_release(sockblk);
+		sockblk = NULL;
+	}
+
+	if(opblk != NULL){
+		mmblock_release(opblk);
+		opblk = NULL;
+	}
+
+	while(reactor_count > 0){
+		reactor_count -= 1;
+		reactor_release(&reactors[reactor_count]);
+	}
+}
+
+int net_reactor_count(void)
+{
+	return reactor_count;
+}
+
+struct socket *net_socket(void)
+{
+	int fd;
+	struct socket *sock;
+	struct reactor *r;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP);
+	if(fd == -1){
+		LOG_ERROR("net_socket: failed to create socket (error = %d)", errno);
+		return NULL;
+	}
+
+	if(setoptions(fd) == -1){
+		LOG_ERROR("net_socket: failed to set socket options");
+		close(fd);
+		return NULL;
+	}
+
+	// spread sockets over reactors
+	r = &reactors[(unsigned)atomic_fetch_add(&next_reactor, 1) % reactor_count];
+	sock = socket_handle(fd, r);
+	if(sock == NULL){
+		LOG_ERROR("net_socket: failed to create socket handle");
+		close(fd);
+		return NULL;
+	}
+	return sock;
+}
+
+struct socket *net_server_socket(int port, int reactor)
+{
+	int fd, opt;
+	struct socket *sock;
+	struct sockaddr_in addr;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_server_socket: invalid reactor #%d", reactor);
+		return NULL;
+	}
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_IP);
+	if(fd == -1){
+		LOG_ERROR("net_server_socket: failed to create socket (error = %d)", errno);
+		return NULL;
+	}
+
+	if(setoptions(fd) == -1){
+		LOG_ERROR("net_server_socket: failed to initialize socket");
+		close(fd);
+		return NULL;
+	}
+
+	// allow restarting the server while connections from
+	// the last run are still on TIME_WAIT
+	opt = 1;
+	if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_server_socket: failed to set reuseaddr option (error = %d)", errno);
+		close(fd);
+		return NULL;
+	}
+
+	// the listener is nonblocking so accept batches can drain
+	// the backlog after the ring completes the first accept (the
+	// ring still waits for connections on nonblocking sockets)
+	if(fcntl(fd, F_SETFL, O_NONBLOCK) == -1){
+		LOG_ERROR("net_server_socket: failed to set nonblocking mode (error = %d)", errno);
+		close(fd);
+		return NULL;
+	}
+
+	// with multiple reactors each one has its own listening
+	// socket on the same port and the kernel balances the
+	// incoming connections between them
+	if(reactor_count > 1){
+		opt = 1;
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(int)) == -1){
+			LOG_ERROR("net_server_socket: failed to set reuseport option (error = %d)", errno);
+			close(fd);
+			return NULL;
+		}
+	}
+
+	// bind to port
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = INADDR_ANY;
+	if(bind(fd, (struct sockaddr*)&addr, sizeof(struct sockaddr_in)) == -1){
+		LOG_ERROR("net_server_socket: failed to bind socket to port %d (error = %d)", port, errno);
+		close(fd);
+		return NULL;
+	}
+
+	// listen
+	if(listen(fd, SOMAXCONN) == -1){
+		LOG_ERROR("net_server_socket: failed to listen to port %d (error = %d)", port, errno);
+		close(fd);
+		return NULL;
+	}
+
+	// create socket handle
+	sock = socket_handle(fd, &reactors[reactor]);
+	if(sock == NULL){
+		LOG_ERROR("net_server_socket: failed to create socket handle");
+		close(fd);
+		return NULL;
+	}
+	return sock;
+}
+
+void net_socket_shutdown(struct socket *sock, int how)
+{
+	shutdown(sock->fd, how);
+	mutex_lock(sock->lock);
+	if(how == NET_SHUT_RD || how == NET_SHUT_RDWR)
+		cancel_queue(sock, &sock->rd_queue);
+
+	if(how == NET_SHUT_WR || how == NET_SHUT_RDWR)
+		cancel_queue(sock, &sock->wr_queue);
+	mutex_unlock(sock->lock);
+}
+
+void net_close(struct socket *sock)
+{
+	if(sock == NULL) return;
+
+	// NOTE: after calling net_close, the socket
+	// will be invalid and further calls to async_*
+	// will have undefined behaviour (probably crash)
+
+	mutex_lock(sock->lock);
+	cancel_queue(sock, &sock->rd_queue);
+	cancel_queue(sock, &sock->wr_queue);
+	sock->flags |= SOCKET_CLOSING;
+	socket_try_release(sock);
+	mutex_unlock(sock->lock);
+}
+
+int net_async_accept(struct socket *sock,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_ACCEPT);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_accept: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->rd_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_accept: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_ACCEPT_BATCH);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_accept_batch: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = socks;
+	op->len = max;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->rd_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_accept_batch: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_read(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_READ);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_read: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->rd_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_read: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_read_some(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_READ_SOME);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_read_some: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->rd_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_read_some: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_write(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_WRITE);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_write: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->wr_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_write: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+int net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	if(count < 1 || count > NET_MAX_IOV){
+		LOG_ERROR("net_async_writev: invalid number of buffers %d (max = %d)", count, NET_MAX_IOV);
+		return -1;
+	}
+
+	mutex_lock(sock->lock);
+	op = socket_op(sock, OP_WRITEV);
+	if(op == NULL){
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_writev: operation pool exhausted (max = %d)", MAX_POOL_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->len = 0;
+	for(int i = 0; i < count; i++){
+		op->iov[i].iov_base = bufs[i].buf;
+		op->iov[i].iov_len = bufs[i].len;
+		op->len += bufs[i].len;
+	}
+	op->iovpos = 0;
+	op->iovcnt = count;
+	op->error = 0;
+	op->transfered = 0;
+	op->complete = fp;
+	op->udata = udata;
+	if(enqueue_op(&sock->wr_queue, op) != 0){
+		socket_op_release(sock, op);
+		mutex_unlock(sock->lock);
+		LOG_ERROR("net_async_writev: failed to submit operation");
+		return -1;
+	}
+	mutex_unlock(sock->lock);
+	return 0;
+}
+
+static struct socket *accepted_handle(struct socket *listener, int fd, struct sockaddr *addr)
+{
+	struct socket *sock;
+
+	// accepted sockets stay on the listening socket reactor
+	// (linger is already disabled by default so there's no
+	// need to call setoptions)
+	sock = socket_handle(fd, listener->reactor);
+	if(sock == NULL){
+		LOG_ERROR("accepted_handle: failed to create new socket handle");
+		close(fd);
+		return NULL;
+	}
+	memcpy(&sock->addr, addr, sizeof(struct sockaddr));
+	return sock;
+}
+
+static void complete_accept(struct async_op *op, int res)
+{
+	if(res < 0){
+		op->socket = NULL;
+		op->error = -res;
+		return;
+	}
+
+	op->socket = accepted_handle(op->socket, res, &op->addr);
+	if(op->socket == NULL)
+		op->error = EAGAIN;
+}
+
+// returns 0 if the operation completed or -1 if it
+// was resubmitted
+static int complete_accept_batch(struct async_op *op, int res)
+{
+	struct socket **socks = op->buf;
+	struct socket *sock = op->socket;
+	int fd;
+
+	// the listener became readable so retry the accept
+	if(op->polling != 0){
+		op->polling = 0;
+		if(res >= 0 && (sock->flags & SOCKET_CLOSING) == 0){
+			sock->inflight -= 1;
+			if(submit_op(op) == 0)
+				return -1;
+			res = -EAGAIN;
+		}
+		op->error = (res < 0) ? -res : ECANCELED;
+		return 0;
+	}
+
+	if(res < 0){
+		// older kernels don't wait on nonblocking sockets so
+		// wait for the listener to be readable instead of
+		// spinning on the accept
+		if(res == -EAGAIN && (sock->flags & SOCKET_CLOSING) == 0){
+			sock->inflight -= 1;
+			op->polling = 1;
+			if(submit_op(op) == 0)
+				return -1;
+			op->polling = 0;
+		}
+		op->error = -res;
+		return 0;
+	}
+
+	socks[0] = accepted_handle(sock, res, &op->addr);
+	if(socks[0] == NULL){
+		op->error = EAGAIN;
+		return 0;
+	}
+	op->transfered = 1;
+
+	// drain the backlog until it's empty or the batch is full
+	// (errors will show up on the next accept)
+	while(op->transfered < op->len){
+		op->addrlen = sizeof(struct sockaddr);
+		fd = accept4(sock->fd, &op->addr, &op->addrlen, SOCK_CLOEXEC);
+		if(fd == -1)
+			break;
+
+		socks[op->transfered] = accepted_handle(sock, fd, &op->addr);
+		if(socks[op->transfered] == NULL)
+			break;
+		op->transfered += 1;
+	}
+	return 0;
+}
+
+// skip the first n bytes of a vectored write
+static void consume_iov(struct async_op *op, long n)
+{
+	struct iovec *iov;
+	while(n > 0){
+		iov = &op->iov[op->iovpos];
+		if((size_t)n < iov->iov_len){
+			iov->iov_base = (char*)iov->iov_base + n;
+			iov->iov_len -= n;
+			break;
+		}
+		n -= iov->iov_len;
+		op->iovpos += 1;
+	}
+}
+
+// returns 0 if the operation completed or -1 if it
+// was resubmitted to transfer the remaining data
+static int complete_transfer(struct async_op *op, int res)
+{
+	if(res < 0){
+		op->error = -res;
+		return 0;
+	}
+	else if(res == 0){
+		// connection closed by peer
+		op->transfered = 0;
+		return 0;
+	}
+
+	if(op->opcode == OP_WRITEV)
+		consume_iov(op, res);
+	else
+		op->buf = (char*)op->buf + res;
+	op->len -= res;
+	op->transfered += res;
+	if(op->len > 0 && op->opcode != OP_READ_SOME
+			&& (op->socket->flags & SOCKET_CLOSING) == 0){
+		op->socket->inflight -= 1;
+		if(submit_op(op) == 0)
+			return -1;
+		op->error = EAGAIN;
+	}
+	return 0;
+}
+
+static void process_cqe(struct async_op *op, int res)
+{
+	struct socket *sock = op->owner;
+	struct op_queue *queue;
+	void (*complete)(struct socket*, int, int, void*);
+	struct socket *socket;
+	int error, transfered;
+	void *udata;
+
+	mutex_lock(sock->lock);
+	queue = (op->opcode == OP_WRITE || op->opcode == OP_WRITEV)
+		? &sock->wr_queue : &sock->rd_queue;
+	if(op->opcode == OP_ACCEPT){
+		complete_accept(op, res);
+	}
+	else if(op->opcode == OP_ACCEPT_BATCH){
+		if(complete_accept_batch(op, res) != 0){
+			mutex_unlock(sock->lock);
+			return;
+		}
+	}
+	else if(complete_transfer(op, res) != 0){
+		mutex_unlock(sock->lock);
+		return;
+	}
+
+	// advance queue and submit the next operation
+	sock->inflight -= 1;
+	if(queue->head == op){
+		queue_pop(queue);
+		if(queue->head != NULL && submit_op(queue->head) != 0){
+			queue->head->error = EAGAIN;
+			defer_completion(sock->reactor, queue_pop(queue));
+		}
+	}
+
+	// release op before completing so the slot may be reused
+	// by the completion routine
+	complete = op->complete;
+	socket = op->socket;
+	error = op->error;
+	transfered = op->transfered;
+	udata = op->udata;
+	socket_op_release(sock, op);
+	mutex_unlock(sock->lock);
+
+	complete(socket, error, transfered, udata);
+
+	mutex_lock(sock->lock);
+	socket_try_release(sock);
+	mutex_unlock(sock->lock);
+}
+
+static void complete_deferred(struct async_op *op)
+{
+	struct socket *sock = op->owner;
+	void (*complete)(struct socket*, int, int, void*) = op->complete;
+	struct socket *socket = op->socket;
+	int error = op->error;
+	int transfered = op->transfered;
+	void *udata = op->udata;
+
+	mutex_lock(sock->lock);
+	socket_op_release(sock, op);
+	mutex_unlock(sock->lock);
+	complete(socket, error, transfered, udata);
+}
+
+int net_work(int reactor)
+{
+	static const struct timespec timeout = {
+		.tv_sec		= (NET_WORK_TIMEOUT / 1000),
+		.tv_nsec	= (NET_WORK_TIMEOUT % 1000) * 1000000,
+	};
+
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe *cqe;
+	struct async_op *op, *next;
+	unsigned head, tail, to_submit, wait;
+	int ret, res;
+	struct reactor *r;
+	struct ring *ring;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_work: invalid reactor #%d", reactor);
+		return -1;
+	}
+	r = &reactors[reactor];
+	ring = &r->ring;
+
+	// complete deferred operations
+	while((op = take_deferred(r)) != NULL){
+		while(op != NULL){
+			next = op->next;
+			if(op->opcode == OP_RELEASE)
+				socket_release(op->socket);
+			else
+				complete_deferred(op);
+			op = next;
+		}
+	}
+
+	// submit every SQE queued since the last call and wait
+	// for completions in a single syscall
+	mutex_lock(r->sq_lock);
+	atomic_store(&r->polling, 1);
+	atomic_hwfence();
+	wait = (atomic_load_ptr(&r->deferred) == NULL) ? 1 : 0;
+	to_submit = ring->pending;
+	ring->pending = 0;
+	mutex_unlock(r->sq_lock);
+
+	ts.tv_sec = timeout.tv_sec;
+	ts.tv_nsec = timeout.tv_nsec;
+	memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+	ret = uring_enter(ring->fd, to_submit, wait,
+		IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&arg, sizeof(struct io_uring_getevents_arg));
+	atomic_store(&r->polling, 0);
+	if(ret == -1){
+		if(errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY){
+			LOG_ERROR("net_work: io_uring_enter failed (error = %d)", errno);
+			return -1;
+		}
+		ret = 0;
+	}
+
+	// entries not consumed by the kernel are still on the
+	// ring and will be submitted on the next call
+	if((unsigned)ret < to_submit){
+		mutex_lock(r->sq_lock);
+		ring->pending += to_submit - ret;
+		mutex_unlock(r->sq_lock);
+	}
+
+	// process completions
+	head = *ring->cq_head;
+	while(1){
+		tail = *ring->cq_tail;
+		atomic_lwfence();
+		if(head == tail)
+			break;
+
+		cqe = &ring->cqes[head & *ring->cq_mask];
+		op = (struct async_op*)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+
+		// release the CQE before running the completion
+		// so the kernel can reuse it
+		head += 1;
+		atomic_lwfence();
+		*ring->cq_head = head;
+
+		// cancel requests and wakeups don't have an operation
+		if(op != NULL)
+			process_cqe(op, res);
+	}
+	return 0;
+}
+
+int net_socket_cork(struct socket *sock, int cork)
+{
+	int opt = (cork != 0) ? 1 : 0;
+
+	// clearing the cork pushes any partial segment immediately
+	if(setsockopt(sock->fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(int)) == -1){
+		LOG_ERROR("net_socket_cork: failed to set socket cork option (error = %d)", errno);
+		return -1;
+	}
+	return 0;
+}
+
+int net_socket_zerocopy(struct socket *sock, int threshold)
+{
+	// zero-copy sends are only implemented by the epoll backend
+	return -1;
+}
+
+int net_listen_drops(long *overflows, long *drops)
+{
+	char names[4096], values[4096];
+	char *name, *value, *name_save, *value_save;
+	int found;
+	FILE *fp;
+
+	// TcpExt has a line with the counter names
+	// followed by a line with their values
+	fp = fopen("/proc/net/netstat", "r");
+	if(fp == NULL){
+		LOG_ERROR("net_listen_drops: failed to open /proc/net/netstat (error = %d)", errno);
+		return -1;
+	}
+	found = 0;
+	while(fgets(names, sizeof(names), fp) != NULL){
+		if(strncmp(names, "TcpExt:", 7) == 0
+				&& fgets(values, sizeof(values), fp) != NULL){
+			found = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	if(found == 0)
+		return -1;
+
+	found = 0;
+	name = strtok_r(names, " \n", &name_save);
+	value = strtok_r(values, " \n", &value_save);
+	while(name != NULL && value != NULL){
+		if(strcmp(name, "ListenOverflows") == 0){
+			*overflows = strtol(value, NULL, 10);
+			found |= 1;
+		}
+		else if(strcmp(name, "ListenDrops") == 0){
+			*drops = strtol(value, NULL, 10);
+			found |= 2;
+		}
+		name = strtok_r(NULL, " \n", &name_save);
+		value = strtok_r(NULL, " \n", &value_save);
+	}
+	return (found == 3) ? 0 : -1;
+}
+
+unsigned long net_remote_address(struct socket *sock)
+{
+	if(sock->addr.sa_family != AF_INET) return 0;
+	return ((struct sockaddr_in*)&sock->addr)->sin_addr.s_addr;
+}
@@ -1,23 +1,52 @@
 ﻿#include "cmdline.h"
 #include "work.h"
 #include "scheduler.h"
+#include "timeout.h"
 #include "network.h"
 #include "server.h"
 #include "log.h"
 #include "connection.h"
+#include "message.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <signal.h>
 
 #define OTSERV_NAME "Kaplar"
 #define OTSERV_VERSION "0.0.1"
 
 extern struct protocol protocol_test;
 
+// stop the server on interrupt so connections are
+// drained before everything is released
+static void on_stop_signal(int sig)
+{
+	server_stop();
+}
+
 int main(int argc, char **argv)
 {
+	long reactors;
+	long workers;
+	long background;
+	long zerocopy;
+	long ip_connections;
+	long ip_rate;
+
 	cmdl_init(argc, argv);
 	// parse command line here
+	if(cmdl_get_long("-reactors", &reactors) != 0)
+		reactors = 1;
+	if(cmdl_get_long("-workers", &workers) != 0)
+		workers = 0;
+	if(cmdl_get_long("-background", &background) != 0)
+		background = 50;
+	if(cmdl_get_long("-zerocopy", &zerocopy) != 0)
+		zerocopy = 0;
+	if(cmdl_get_long("-ip_connections", &ip_connections) != 0)
+		ip_connections = 0;
+	if(cmdl_get_long("-ip_rate", &ip_rate) != 0)
+		ip_rate = 0;
 
 	// start logging
 	//log_start();
@@ -25,10 +54,21 @@ int main(int argc, char **argv)
 	LOG(OTSERV_NAME " Version " OTSERV_VERSION);
 	LOG("================================");
 
-	work_init();
+	work_init_threads((int)workers);
+	work_set_background_limit((int)background);
 	scheduler_init();
-	net_init();
+	timeout_init();
+	if(net_init((int)reactors) != 0){
+		LOG_ERROR("failed to initialize network");
+		timeout_shutdown();
+		scheduler_shutdown();
+		work_shutdown();
+		return -1;
+	}
+	message_pool_init();
 	connection_init();
+	connection_set_zerocopy((int)zerocopy);
+	connection_set_admission((int)ip_connections, (int)ip_rate);
 
 	//server_add_protocol(7171, &protocol_login);
 	//server_add_protocol(7171, &protocol_old_login);
@@ -36,14 +76,19 @@ int main(int argc, char **argv)
 	//server_add_protocol(7172, &protocol_game);
 	server_add_protocol(7171, &protocol_test);
 
+	signal(SIGINT, on_stop_signal);
+	signal(SIGTERM, on_stop_signal);
+
 	LOG("server running...");
 	server_run();
 
 	LOG("cleaning up...");
 	connection_shutdown();
 	net_shutdown();
+	timeout_shutdown();
 	scheduler_shutdown();
 	work_shutdown();
+	message_pool_shutdown();
 	//log_stop();
 	return 0;
 }
@@ -1,7 +1,42 @@
 #include "message.h"
+#include "thread.h"
+#include "log.h"
+#include "util.h"
 
+#include <stdlib.h>
 #include <string.h>
 
+// size classes: each class grows in chunks of about CHUNK_LEN
+// bytes as its messages are borrowed, up to class_slots messages,
+// and its chunks are only released with the pool
+#define MESSAGE_CLASSES 4
+#define CHUNK_LEN (256 * 1024)
+static const long class_size[MESSAGE_CLASSES] = {256, 1024, 4096, 16384};
+static const long class_slots[MESSAGE_CLASSES] = {16384, 8192, 8192, 1024};
+
+struct message_chunk{
+	struct message_chunk	*next;
+};
+
+struct message_class{
+	struct mutex		*lock;
+	struct message		*free_list;
+	struct message_chunk	*chunks;
+	long			slots;
+};
+static struct message_class classes[MESSAGE_CLASSES];
+
+// messages of a class are moved between the thread cache and
+// the pool in batches of CACHE_BATCH once the cache is empty or
+// holds more than CACHE_MAX
+#define CACHE_MAX	32
+#define CACHE_BATCH	16
+struct message_cache{
+	struct message	*list[MESSAGE_CLASSES];
+	long		count[MESSAGE_CLASSES];
+};
+static THREAD_LOCAL struct message_cache cache;
+
 #ifdef __BIG_ENDIAN__
 // the compiler should optimize these away
 static inline uint16_t swap_u16(uint16_t u16)
@@ -62,23 +97,75 @@ void message_get_str(struct message *msg, char *buf, uint16_t buflen)
 }
 
 // add data
+// writes len bytes at readpos when they don't fit on the first
+// segment, linking new segments as needed; returns -1 if the
+// message overflowed (the flag is terminal and readpos/length
+// are kept at the end of the last write that fit)
+static int message_write(struct message *msg, const void *data, long len)
+{
+	const uint8_t *src = data;
+	struct message *seg;
+	long pos, n;
+
+	if((msg->flags & MESSAGE_OVERFLOW) != 0)
+		return -1;
+	if(msg->readpos + len > MESSAGE_MAX_LEN){
+		msg->flags |= MESSAGE_OVERFLOW;
+		return -1;
+	}
+
+	seg = msg;
+	pos = msg->readpos;
+	while(len > 0){
+		while(pos >= seg->capacity){
+			pos -= seg->capacity;
+			if(seg->chain == NULL){
+				seg->chain = message_alloc(MESSAGE_SEGMENT_LEN);
+				if(seg->chain == NULL){
+					msg->flags |= MESSAGE_OVERFLOW;
+					return -1;
+				}
+			}
+			seg = seg->chain;
+		}
+
+		n = MIN(len, seg->capacity - pos);
+		memcpy(seg->buffer + pos, src, n);
+		src += n;
+		pos += n;
+		len -= n;
+	}
+	return 0;
+}
+
 void message_add_byte(struct message *msg, uint8_t val)
 {
-	*(msg->buffer + msg->readpos) = val;
+	if(msg->readpos < msg->capacity)
+		*(msg->buffer + msg->readpos) = val;
+	else if(message_write(msg, &val, 1) != 0)
+		return;
 	msg->readpos++;
 	msg->length++;
 }
 
 void message_add_u16(struct message *msg, uint16_t val)
 {
-	*(uint16_t*)(msg->buffer + msg->readpos) = swap_u16(val);
+	val = swap_u16(val);
+	if(msg->readpos + 2 <= msg->capacity)
+		memcpy(msg->buffer + msg->readpos, &val, 2);
+	else if(message_write(msg, &val, 2) != 0)
+		return;
 	msg->readpos += 2;
 	msg->length += 2;
 }
 
 void message_add_u32(struct message *msg, uint32_t val)
 {
-	*(uint32_t*)(msg->buffer + msg->readpos) = swap_u32(val);
+	val = swap_u32(val);
+	if(msg->readpos + 4 <= msg->capacity)
+		memcpy(msg->buffer + msg->readpos, &val, 4);
+	else if(message_write(msg, &val, 4) != 0)
+		return;
 	msg->readpos += 4;
 	msg->length += 4;
 }
@@ -86,7 +173,284 @@ void message_add_u32(struct message *msg, uint32_t val)
 void message_add_str(struct message *msg, const char *buf, uint16_t buflen)
 {
 	message_add_u16(msg, buflen);
-	memcpy((msg->buffer + msg->readpos), buf, buflen);
-	msg->readpos += buflen;
-	msg->length += buflen;
+	message_add_bytes(msg, (const uint8_t*)buf, buflen);
+}
+
+void message_add_bytes(struct message *msg, const uint8_t *buf, long len)
+{
+	if(msg->readpos + len <= msg->capacity)
+		memcpy(msg->buffer + msg->readpos, buf, len);
+	else if(message_write(msg, buf, len) != 0)
+		return;
+	msg->readpos += len;
+	msg->length += len;
+}
+
+uint32_t message_checksum(struct message *msg, long offset, long len)
+{
+	struct message *seg = msg;
+	unsigned long adler = 1;
+	long n;
+
+	while(seg != NULL && offset >= seg->capacity){
+		offset -= seg->capacity;
+		seg = seg->chain;
+	}
+	while(seg != NULL && len > 0){
+		n = MIN(len, seg->capacity - offset);
+		adler = adler32_update(adler, seg->buffer + offset, n);
+		len -= n;
+		offset = 0;
+		seg = seg->chain;
+	}
+	return (uint32_t)adler;
+}
+
+// message cursors
+const uint8_t message_zero[MESSAGE_GROUP_MAX] = {0};
+
+void message_writer_flush(struct message_writer *wr)
+{
+	long len = (long)(wr->pos - wr->start);
+
+	// staged groups are appended through the chain while
+	// groups on the first buffer are already in place
+	if(wr->staged != 0){
+		message_add_bytes(wr->msg, wr->stage, len);
+		wr->pos = wr->stage;
+	}
+	else{
+		wr->msg->readpos += len;
+		wr->msg->length += len;
+	}
+	wr->start = wr->pos;
+	if((wr->msg->flags & MESSAGE_OVERFLOW) != 0)
+		wr->error = 1;
+}
+
+int message_writer_stage(struct message_writer *wr, long len)
+{
+	// once the first buffer is full every group is staged
+	message_writer_flush(wr);
+	wr->staged = 1;
+	wr->start = wr->stage;
+	wr->pos = wr->stage;
+	wr->end = wr->stage + MESSAGE_GROUP_MAX;
+
+	// the message is dropped since the caller
+	// must skip a group that doesn't fit
+	if(len > MESSAGE_GROUP_MAX){
+		LOG_ERROR("message_writer_stage: group is too big to stage (len = %ld, max = %d)",
+			len, MESSAGE_GROUP_MAX);
+		wr->msg->flags |= MESSAGE_OVERFLOW;
+		wr->error = 1;
+	}
+	return (wr->error == 0);
+}
+
+void message_writer_put(struct message_writer *wr, const void *data, long len)
+{
+	message_writer_stage(wr, 0);
+	message_add_bytes(wr->msg, data, len);
+	if((wr->msg->flags & MESSAGE_OVERFLOW) != 0)
+		wr->error = 1;
+}
+
+// message pool
+static void cache_flush(void)
+{
+	struct message_class *mc;
+	struct message *msg;
+
+	for(int i = 0; i < MESSAGE_CLASSES; i++){
+		mc = &classes[i];
+		if(cache.count[i] == 0)
+			continue;
+
+		// the pool may be gone if the thread outlived it
+		if(mc->lock != NULL){
+			mutex_lock(mc->lock);
+			while((msg = cache.list[i]) != NULL){
+				cache.list[i] = msg->next;
+				msg->next = mc->free_list;
+				mc->free_list = msg;
+			}
+			mutex_unlock(mc->lock);
+		}
+		cache.list[i] = NULL;
+		cache.count[i] = 0;
+	}
+}
+
+void message_pool_init(void)
+{
+	for(int i = 0; i < MESSAGE_CLASSES; i++){
+		mutex_create(&classes[i].lock);
+		classes[i].free_list = NULL;
+		classes[i].chunks = NULL;
+		classes[i].slots = 0;
+	}
+	thread_atexit(cache_flush);
+}
+
+void message_pool_shutdown(void)
+{
+	struct message_chunk *chunk;
+	struct mutex *lock;
+
+	// NOTE: threads that use messages must exit before
+	// the pool is released (the caller's cache is dropped)
+	cache_flush();
+	for(int i = 0; i < MESSAGE_CLASSES; i++){
+		lock = classes[i].lock;
+		mutex_lock(lock);
+		classes[i].lock = NULL;
+		while((chunk = classes[i].chunks) != NULL){
+			classes[i].chunks = chunk->next;
+			free(chunk);
+		}
+		classes[i].free_list = NULL;
+		classes[i].slots = 0;
+		mutex_unlock(lock);
+		mutex_destroy(lock);
+	}
+}
+
+// NOTE: must be used INSIDE the class lock
+// adds a chunk of messages to the free list of a class
+static int class_grow(int cls)
+{
+	struct message_class *mc = &classes[cls];
+	struct message_chunk *chunk;
+	struct message *msg;
+	long stride, count;
+	uint8_t *ptr;
+
+	stride = sizeof(struct message) + class_size[cls];
+	count = MIN(MAX(CHUNK_LEN / stride, 1), class_slots[cls] - mc->slots);
+	if(count <= 0)
+		return -1;
+
+	chunk = malloc(sizeof(struct message_chunk) + count * stride);
+	if(chunk == NULL)
+		return -1;
+	chunk->next = mc->chunks;
+	mc->chunks = chunk;
+	mc->slots += count;
+
+	ptr = (uint8_t*)(chunk + 1);
+	for(long i = 0; i < count; i++, ptr += stride){
+		msg = (struct message*)ptr;
+		msg->next = mc->free_list;
+		mc->free_list = msg;
+	}
+	return 0;
+}
+
+static int size_class(long size)
+{
+	for(int i = 0; i < MESSAGE_CLASSES; i++){
+		if(size <= class_size[i])
+			return i;
+	}
+	return -1;
+}
+
+struct message *message_alloc(long size)
+{
+	struct message_class *mc;
+	struct message *msg;
+	int cls;
+
+	cls = size_class(size);
+	if(cls == -1){
+		msg = malloc(sizeof(struct message) + size);
+		if(msg == NULL){
+			LOG_ERROR("message_alloc: out of memory (size = %ld)", size);
+			return NULL;
+		}
+		msg->capacity = size;
+	}
+	else{
+		// refill the thread cache from the pool
+		if(cache.count[cls] == 0){
+			mc = &classes[cls];
+			mutex_lock(mc->lock);
+			while(cache.count[cls] < CACHE_BATCH){
+				if(mc->free_list == NULL && class_grow(cls) != 0)
+					break;
+				msg = mc->free_list;
+				mc->free_list = msg->next;
+				msg->next = cache.list[cls];
+				cache.list[cls] = msg;
+				cache.count[cls] += 1;
+			}
+			mutex_unlock(mc->lock);
+			if(cache.count[cls] == 0){
+				LOG_ERROR("message_alloc: %ld bytes messages exhausted (max = %ld)",
+					class_size[cls], class_slots[cls]);
+				return NULL;
+			}
+		}
+
+		msg = cache.list[cls];
+		cache.list[cls] = msg->next;
+		cache.count[cls] -= 1;
+		msg->capacity = class_size[cls];
+	}
+
+	msg->size_class = cls;
+	msg->buffer = (uint8_t*)(msg + 1);
+	msg->readpos = 0;
+	msg->length = 0;
+	msg->flags = 0;
+	msg->ref_count = 1;
+	msg->chain = NULL;
+	msg->next = NULL;
+	return msg;
+}
+
+void message_retain(struct message *msg)
+{
+	atomic_add(&msg->ref_count, 1);
+}
+
+void message_free(struct message *msg)
+{
+	struct message_class *mc;
+	long cls = msg->size_class;
+
+	// the last reference returns the message (a single
+	// reference can't be raced so it skips the atomic)
+	if(msg->ref_count != 1 && atomic_fetch_add(&msg->ref_count, -1) > 1)
+		return;
+
+	// segments are only referenced by their chain
+	if(msg->chain != NULL)
+		message_free(msg->chain);
+
+	if(cls == -1){
+		free(msg);
+		return;
+	}
+
+	msg->next = cache.list[cls];
+	cache.list[cls] = msg;
+	cache.count[cls] += 1;
+
+	// return a batch to the pool so messages freed on a
+	// thread other than the one that allocated them don't
+	// pile up in its cache
+	if(cache.count[cls] > CACHE_MAX){
+		mc = &classes[cls];
+		mutex_lock(mc->lock);
+		while(cache.count[cls] > CACHE_MAX - CACHE_BATCH){
+			msg = cache.list[cls];
+			cache.list[cls] = msg->next;
+			cache.count[cls] -= 1;
+			msg->next = mc->free_list;
+			mc->free_list = msg;
+		}
+		mutex_unlock(mc->lock);
+	}
 }
@@ -2,21 +2,62 @@
 #define MESSAGE_H_
 
 #include "types.h"
+#include "atomic.h"
+
+#include <string.h>
+#ifdef _MSC_VER
+#include <stdlib.h>
+#endif
 
 #define MESSAGE_BUFFER_LEN 4096
 #define MESSAGE_BODY_OFFSET 16
 
-#define MESSAGE_FREE 0x00
-#define MESSAGE_BUSY 0x01
+// writes past the buffer of a message link more segments of
+// MESSAGE_SEGMENT_LEN bytes on its chain up to MESSAGE_MAX_LEN
+// bytes (the biggest frame a u16 length can describe); if that's
+// not possible the message is flagged with MESSAGE_OVERFLOW and
+// the rest of the writes are dropped
+#define MESSAGE_SEGMENT_LEN 16384
+#define MESSAGE_MAX_LEN (0xFFFF + 2)
+
+#define MESSAGE_OVERFLOW 0x01
 struct message{
-	long state;
 	long readpos;
 	long length;
-	uint8_t buffer[MESSAGE_BUFFER_LEN];
+	long capacity;
+	long size_class;
+	long flags;
+	uint8_t *buffer;
+	atomic_int ref_count;
+
+	// next segment (readpos and length are only kept
+	// on the first one and cover the whole chain)
+	struct message *chain;
 
 	struct message *next;
 };
 
+// message pool
+// ====================
+// messages are borrowed from a global pool split in size classes
+// (256B, 1KB, 4KB and 16KB; bigger ones come from the heap) that grow
+// as they're used and each thread caches a few of every class so most
+// borrows and returns don't touch the pool lock; a message may be
+// returned by any thread and the cache of a thread created with
+// thread_create is returned to the pool when it exits
+void message_pool_init(void);
+void message_pool_shutdown(void);
+
+// returns a message with a buffer of at least size bytes
+// or NULL if its size class is exhausted
+struct message *message_alloc(long size);
+
+// a message starts with one reference and message_free drops
+// one; a message with more than one reference is shared and
+// must not be changed until it's back to a single one
+void message_retain(struct message *msg);
+void message_free(struct message *msg);
+
 // get data
 uint8_t message_get_byte(struct message *msg);
 uint16_t message_get_u16(struct message *msg);
@@ -28,5 +69,194 @@ void message_add_byte(struct message *msg, uint8_t val);
 void message_add_u16(struct message *msg, uint16_t val);
 void message_add_u32(struct message *msg, uint32_t val);
 void message_add_str(struct message *msg, const char *buf, uint16_t buflen);
+void message_add_bytes(struct message *msg, const uint8_t *buf, long len);
+
+// adler32 of len bytes starting at offset (across segments)
+uint32_t message_checksum(struct message *msg, long offset, long len);
+
+// message cursors
+// ====================
+// inline readers and writers that check the remaining length once
+// per group of fields: message_reader_need/message_writer_need are
+// called with the size of the group (at most MESSAGE_GROUP_MAX bytes)
+// and its fields are then read or written without checks. A reader
+// without enough data left sets its sticky error flag and the rest
+// of the reads return zeros; a writer that runs out of the first
+// buffer stages the group and appends it through the chain so its
+// error flag is only set if the message overflows. A bigger group
+// that doesn't fit on the first buffer can't be staged: the writer
+// fails, message_writer_need returns 0 and the group must be skipped
+// (write it with message_write_bytes instead). Strings and raw bytes
+// check their own length.
+
+#define MESSAGE_GROUP_MAX 64
+
+#if defined(__BIG_ENDIAN__)
+#define MESSAGE_SWAP16(x) (x)
+#define MESSAGE_SWAP32(x) (x)
+#elif defined(_MSC_VER)
+#define MESSAGE_SWAP16(x) _byteswap_ushort(x)
+#define MESSAGE_SWAP32(x) _byteswap_ulong(x)
+#else
+#define MESSAGE_SWAP16(x) __builtin_bswap16(x)
+#define MESSAGE_SWAP32(x) __builtin_bswap32(x)
+#endif
+
+struct message_reader{
+	const uint8_t	*pos;
+	const uint8_t	*end;
+	int		error;
+};
+
+struct message_writer{
+	struct message	*msg;
+	uint8_t		*start;
+	uint8_t		*pos;
+	uint8_t		*end;
+	int		error;
+	int		staged;
+	uint8_t		stage[MESSAGE_GROUP_MAX];
+};
+
+// reads of a reader that failed come from here
+extern const uint8_t message_zero[MESSAGE_GROUP_MAX];
+
+// writer slow paths (message.c)
+int message_writer_stage(struct message_writer *wr, long len);
+void message_writer_flush(struct message_writer *wr);
+void message_writer_put(struct message_writer *wr, const void *data, long len);
+
+// reads an input message from readpos to the end of its frame
+static inline void message_reader_init(struct message_reader *rd, struct message *msg)
+{
+	rd->pos = msg->buffer + msg->readpos;
+	rd->end = msg->buffer + 2 + msg->length;
+	rd->error = (rd->pos > rd->end);
+}
+
+static inline int message_reader_need(struct message_reader *rd, long len)
+{
+	if(rd->error == 0 && rd->end - rd->pos >= len)
+		return 1;
+	rd->error = 1;
+	rd->pos = message_zero;
+	rd->end = message_zero;
+	return 0;
+}
+
+static inline uint8_t message_read_u8(struct message_reader *rd)
+{
+	return *rd->pos++;
+}
+
+static inline uint16_t message_read_u16(struct message_reader *rd)
+{
+	uint16_t val;
+	memcpy(&val, rd->pos, 2);
+	rd->pos += 2;
+	return MESSAGE_SWAP16(val);
+}
+
+static inline uint32_t message_read_u32(struct message_reader *rd)
+{
+	uint32_t val;
+	memcpy(&val, rd->pos, 4);
+	rd->pos += 4;
+	return MESSAGE_SWAP32(val);
+}
+
+// reads a u16 length prefixed string truncating it to buflen - 1
+// characters and returns its length (0 and an empty string on error)
+static inline long message_read_str(struct message_reader *rd, char *buf, long buflen)
+{
+	long len, copy;
+
+	// there's no room even for the terminator
+	if(buflen <= 0)
+		return 0;
+
+	buf[0] = 0x00;
+	if(message_reader_need(rd, 2) == 0)
+		return 0;
+	len = message_read_u16(rd);
+	if(message_reader_need(rd, len) == 0)
+		return 0;
+
+	copy = (len < buflen - 1) ? len : buflen - 1;
+	memcpy(buf, rd->pos, copy);
+	buf[copy] = 0x00;
+	rd->pos += len;
+	return copy;
+}
+
+// writes to a message from its readpos (which is advanced along
+// with its length by message_writer_done)
+static inline void message_writer_init(struct message_writer *wr, struct message *msg)
+{
+	wr->msg = msg;
+	wr->error = ((msg->flags & MESSAGE_OVERFLOW) != 0);
+	wr->staged = 0;
+	if(msg->readpos < msg->capacity){
+		wr->start = msg->buffer + msg->readpos;
+		wr->end = msg->buffer + msg->capacity;
+		wr->pos = wr->start;
+	}
+	else{
+		wr->start = wr->stage;
+		wr->end = wr->stage;
+		wr->pos = wr->stage;
+	}
+}
+
+static inline int message_writer_need(struct message_writer *wr, long len)
+{
+	if(wr->end - wr->pos >= len)
+		return 1;
+	return message_writer_stage(wr, len);
+}
+
+static inline void message_write_u8(struct message_writer *wr, uint8_t val)
+{
+	*wr->pos++ = val;
+}
+
+static inline void message_write_u16(struct message_writer *wr, uint16_t val)
+{
+	val = MESSAGE_SWAP16(val);
+	memcpy(wr->pos, &val, 2);
+	wr->pos += 2;
+}
+
+static inline void message_write_u32(struct message_writer *wr, uint32_t val)
+{
+	val = MESSAGE_SWAP32(val);
+	memcpy(wr->pos, &val, 4);
+	wr->pos += 4;
+}
+
+static inline void message_write_bytes(struct message_writer *wr, const void *data, long len)
+{
+	if(wr->end - wr->pos >= len){
+		memcpy(wr->pos, data, len);
+		wr->pos += len;
+	}
+	else{
+		message_writer_put(wr, data, len);
+	}
+}
+
+static inline void message_write_str(struct message_writer *wr, const char *str, uint16_t len)
+{
+	message_writer_need(wr, 2);
+	message_write_u16(wr, len);
+	message_write_bytes(wr, str, len);
+}
+
+// returns -1 if the message overflowed
+static inline int message_writer_done(struct message_writer *wr)
+{
+	message_writer_flush(wr);
+	return (wr->error != 0) ? -1 : 0;
+}
 
 #endif //MESSAGE_H_
@@ -4,6 +4,10 @@
 #include <errno.h>
 
 #define NET_WORK_TIMEOUT 1000 // 1sec
+#define NET_MAX_REACTORS 16
+
+// maximum number of buffers on a single vectored write
+#define NET_MAX_IOV	16
 
 #define NET_SHUT_RD	0x00
 #define NET_SHUT_WR	0x01
@@ -11,24 +15,65 @@
 
 struct socket;
 
-int	net_init(void);
+struct net_buf{
+	char	*buf;
+	int	len;
+};
+
+// each reactor must be driven by its own thread calling
+// net_work(reactor) and sockets stay on the reactor they were
+// created or accepted on
+int	net_init(int reactors);
 void	net_shutdown(void);
+int	net_reactor_count(void);
 
 struct socket	*net_socket(void);
-struct socket	*net_server_socket(int port);
+struct socket	*net_server_socket(int port, int reactor);
 
 void	net_socket_shutdown(struct socket *sock, int how);
 void	net_close(struct socket *sock);
 
 int	net_async_accept(struct socket *sock,
 		void (*fp)(struct socket*, int, int, void*), void *udata);
+// accepts every pending connection (up to max) on each completion
+// storing them in socks with transfered being the number accepted
+int	net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata);
 int	net_async_read(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata);
+// completes as soon as any data is received (transfered
+// may be less than len) while net_async_read fills buf
+int	net_async_read_some(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata);
 int	net_async_write(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata);
 
-int	net_work(void);
+// the buffer array is copied and may be released after the call
+// but the data must stay valid until the completion routine runs
+// (it's called once every buffer has been sent)
+int	net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata);
+
+int	net_work(int reactor);
+
+// corked sockets hold partial segments until they are
+// uncorked so many small writes go out as full segments
+// (sockets are created with nagle disabled); returns -1
+// if it's not supported by the backend
+int	net_socket_cork(struct socket *sock, int cork);
+
+// zero-copy sends: writes with at least threshold bytes are sent
+// without copying the data into the kernel and only complete once
+// the kernel is done with the buffers (0 disables it); returns -1
+// if it's not supported by the backend or the socket
+int	net_socket_zerocopy(struct socket *sock, int threshold);
 
+// connections dropped because a listen queue was full (overflows)
+// and for any reason (drops, including the overflows) since the
+// counters started; the counters are shared by every listener of
+// the system (or network namespace) so their deltas should be
+// reported (returns -1 if they're not available)
+int		net_listen_drops(long *overflows, long *drops);
 unsigned long	net_remote_address(struct socket *sock);
 
 #endif //NETWORK_H_
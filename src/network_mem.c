@@ -0,0 +1,746 @@
+#include "network.h"
+#include "network_mem.h"
+
+#include "mmblock.h"
+#include "thread.h"
+#include "log.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#define OP_NONE		0x00
+#define OP_ACCEPT	0x01
+#define OP_READ		0x02
+#define OP_WRITEV	0x03
+#define OP_READ_SOME	0x04
+#define OP_ACCEPT_BATCH	0x05
+#define OP_RELEASE	0x06
+struct async_op{
+	long		opcode;
+	struct socket	*socket;
+	void		*buf;
+	long		len;
+
+	// vectored write buffers (len has the
+	// total remaining bytes)
+	struct net_buf	iov[NET_MAX_IOV];
+	int		iovpos;
+	int		iovcnt;
+
+	int		error;
+	int		transfered;
+	void		(*complete)(struct socket*, int, int, void*);
+	void		*udata;
+
+	// socket that owns the operation
+	struct socket	*owner;
+	struct async_op	*next;
+};
+
+struct op_queue{
+	struct async_op	*head;
+	struct async_op	*tail;
+};
+
+// data written by the peer waiting to be read
+// (ring buffer with the size of a socket buffer)
+#define PIPE_LEN		(16 * 1024)
+struct pipe{
+	char		data[PIPE_LEN];
+	long		start;
+	long		len;
+};
+
+#define SOCKET_LISTENER		0x01
+#define SOCKET_RD_SHUT		0x02
+#define SOCKET_WR_SHUT		0x04
+
+#define MAX_SOCKETS		4096
+#define MAX_OPS			(MAX_SOCKETS * 4)
+#define LISTEN_BACKLOG		1024
+struct socket{
+	long			flags;
+	long			port;
+	struct reactor		*reactor;
+
+	// connected socket (NULL after it's closed)
+	struct socket		*peer;
+	struct pipe		input;
+
+	struct op_queue		rd_queue;
+	struct op_queue		wr_queue;
+
+	// listener accept backlog
+	struct socket		*backlog_head;
+	struct socket		*backlog_tail;
+	long			backlog_count;
+
+	// backlog or listener list link
+	struct socket		*next;
+	struct async_op		release_op;
+};
+
+// completed operations are queued on the socket reactor
+// and their completion routines run on net_work
+struct reactor{
+	struct op_queue		completed;
+	struct condvar		*cond;
+};
+
+// every socket is guarded by a single lock: there's no kernel
+// work to overlap so there's nothing to gain from finer locks
+static struct mutex	*lock = NULL;
+static struct reactor	reactors[NET_MAX_REACTORS];
+static int		reactor_count = 0;
+static int		next_reactor = 0;
+static struct socket	*listeners = NULL;
+static long		listen_overflows = 0;
+static struct mmblock	*sockblk = NULL;
+static struct mmblock	*opblk = NULL;
+
+// NOTE: must be used INSIDE the network lock
+static void queue_push(struct op_queue *q, struct async_op *op)
+{
+	op->next = NULL;
+	if(q->tail == NULL)
+		q->head = op;
+	else
+		q->tail->next = op;
+	q->tail = op;
+}
+
+// NOTE: must be used INSIDE the network lock
+static struct async_op *queue_pop(struct op_queue *q)
+{
+	struct async_op *op = q->head;
+	if(op != NULL){
+		q->head = op->next;
+		if(q->head == NULL)
+			q->tail = NULL;
+	}
+	return op;
+}
+
+// NOTE: must be used INSIDE the network lock
+static long pipe_write(struct pipe *p, const char *buf, long len)
+{
+	long pos, n, total = 0;
+	while(len > 0 && p->len < PIPE_LEN){
+		pos = (p->start + p->len) % PIPE_LEN;
+		n = MIN(len, MIN(PIPE_LEN - p->len, PIPE_LEN - pos));
+		memcpy(p->data + pos, buf, n);
+		p->len += n;
+		buf += n;
+		len -= n;
+		total += n;
+	}
+	return total;
+}
+
+// NOTE: must be used INSIDE the network lock
+static long pipe_read(struct pipe *p, char *buf, long len)
+{
+	long n, total = 0;
+	while(len > 0 && p->len > 0){
+		n = MIN(len, MIN(p->len, PIPE_LEN - p->start));
+		memcpy(buf, p->data + p->start, n);
+		p->start = (p->start + n) % PIPE_LEN;
+		p->len -= n;
+		buf += n;
+		len -= n;
+		total += n;
+	}
+	if(p->len == 0)
+		p->start = 0;
+	return total;
+}
+
+// NOTE: must be used INSIDE the network lock
+static struct socket *socket_handle(struct reactor *r)
+{
+	struct socket *sock;
+
+	sock = mmblock_alloc(sockblk);
+	if(sock == NULL){
+		LOG_ERROR("net_socket: socket memory block is at maximum capacity (%d)", MAX_SOCKETS);
+		return NULL;
+	}
+
+	sock->flags = 0;
+	sock->port = 0;
+	sock->reactor = r;
+	sock->peer = NULL;
+	sock->input.start = 0;
+	sock->input.len = 0;
+	sock->rd_queue.head = NULL;
+	sock->rd_queue.tail = NULL;
+	sock->wr_queue.head = NULL;
+	sock->wr_queue.tail = NULL;
+	sock->backlog_head = NULL;
+	sock->backlog_tail = NULL;
+	sock->backlog_count = 0;
+	sock->next = NULL;
+	sock->release_op.opcode = OP_NONE;
+	return sock;
+}
+
+// NOTE: must be used INSIDE the network lock
+static struct async_op *socket_op(struct socket *sock, int opcode)
+{
+	struct async_op *op = mmblock_alloc(opblk);
+	if(op != NULL){
+		op->opcode = opcode;
+		op->owner = sock;
+		op->error = 0;
+		op->transfered = 0;
+		op->next = NULL;
+	}
+	return op;
+}
+
+// NOTE: must be used INSIDE the network lock
+static void complete(struct async_op *op, int error)
+{
+	struct reactor *r = op->owner->reactor;
+	op->error = error;
+	queue_push(&r->completed, op);
+	condvar_signal(r->cond);
+}
+
+// NOTE: must be used INSIDE the network lock
+static void cancel_queue(struct op_queue *q)
+{
+	struct async_op *op;
+	while((op = queue_pop(q)) != NULL)
+		complete(op, ECANCELED);
+}
+
+// NOTE: must be used INSIDE the network lock
+// returns the number of bytes and connections transfered
+static long progress_rd(struct socket *sock)
+{
+	struct async_op *op;
+	struct socket **socks;
+	long n, moved = 0;
+
+	while((op = sock->rd_queue.head) != NULL){
+		if(op->opcode == OP_ACCEPT || op->opcode == OP_ACCEPT_BATCH){
+			if(sock->backlog_head == NULL)
+				break;
+
+			if(op->opcode == OP_ACCEPT){
+				op->socket = sock->backlog_head;
+				sock->backlog_head = op->socket->next;
+				sock->backlog_count -= 1;
+				op->socket->next = NULL;
+				moved += 1;
+			}
+			else{
+				socks = op->buf;
+				while(op->transfered < op->len && sock->backlog_head != NULL){
+					socks[op->transfered] = sock->backlog_head;
+					sock->backlog_head = sock->backlog_head->next;
+					sock->backlog_count -= 1;
+					socks[op->transfered]->next = NULL;
+					op->transfered += 1;
+					moved += 1;
+				}
+			}
+			if(sock->backlog_head == NULL)
+				sock->backlog_tail = NULL;
+			complete(queue_pop(&sock->rd_queue), 0);
+			continue;
+		}
+
+		n = pipe_read(&sock->input, op->buf, op->len);
+		op->buf = (char*)op->buf + n;
+		op->len -= n;
+		op->transfered += n;
+		moved += n;
+
+		// the peer won't write anything else so complete
+		// with whatever was read (0 means end of stream)
+		if(op->len == 0 || (op->opcode == OP_READ_SOME && op->transfered > 0)
+				|| sock->peer == NULL || (sock->peer->flags & SOCKET_WR_SHUT) != 0)
+			complete(queue_pop(&sock->rd_queue), 0);
+		else
+			break;
+	}
+	return moved;
+}
+
+// NOTE: must be used INSIDE the network lock
+// returns the number of bytes transfered
+static long progress_wr(struct socket *sock)
+{
+	struct async_op *op;
+	struct net_buf *iov;
+	long n, moved = 0;
+
+	while((op = sock->wr_queue.head) != NULL){
+		if(sock->peer == NULL){
+			complete(queue_pop(&sock->wr_queue), ECONNRESET);
+			continue;
+		}
+
+		// every write is vectored (net_async_write
+		// is a write with a single buffer)
+		while(op->iovpos < op->iovcnt){
+			iov = &op->iov[op->iovpos];
+			n = pipe_write(&sock->peer->input, iov->buf, iov->len);
+			iov->buf += n;
+			iov->len -= n;
+			op->len -= n;
+			op->transfered += n;
+			moved += n;
+			if(iov->len > 0)
+				break;
+			op->iovpos += 1;
+		}
+
+		if(op->len > 0)
+			break;
+		complete(queue_pop(&sock->wr_queue), 0);
+	}
+	return moved;
+}
+
+// NOTE: must be used INSIDE the network lock
+// moves data between the socket and its peer until both
+// sides are blocked on each other
+static void pump(struct socket *sock)
+{
+	long moved;
+	do{
+		moved = progress_wr(sock);
+		if(sock->peer != NULL){
+			moved += progress_rd(sock->peer);
+			moved += progress_wr(sock->peer);
+		}
+		moved += progress_rd(sock);
+	} while(moved > 0);
+}
+
+// NOTE: must be used INSIDE the network lock
+static void socket_close(struct socket *sock)
+{
+	struct socket *peer, *it, **link;
+
+	cancel_queue(&sock->rd_queue);
+	cancel_queue(&sock->wr_queue);
+
+	// unregister listener and drop the connections
+	// that were never accepted
+	if((sock->flags & SOCKET_LISTENER) != 0){
+		for(link = &listeners; *link != NULL; link = &(*link)->next){
+			if(*link == sock){
+				*link = sock->next;
+				break;
+			}
+		}
+
+		while((it = sock->backlog_head) != NULL){
+			sock->backlog_head = it->next;
+			socket_close(it);
+		}
+		sock->backlog_tail = NULL;
+		sock->backlog_count = 0;
+	}
+
+	// the peer will read the end of stream after
+	// draining its input and fail further writes
+	peer = sock->peer;
+	if(peer != NULL){
+		sock->peer = NULL;
+		peer->peer = NULL;
+		pump(peer);
+	}
+
+	// release the socket after every cancelled
+	// operation has completed
+	sock->release_op.opcode = OP_RELEASE;
+	sock->release_op.owner = sock;
+	queue_push(&sock->reactor->completed, &sock->release_op);
+	condvar_signal(sock->reactor->cond);
+}
+
+int net_init(int count)
+{
+	if(count < 1 || count > NET_MAX_REACTORS){
+		LOG_ERROR("net_init: invalid number of reactors %d (max = %d)", count, NET_MAX_REACTORS);
+		return -1;
+	}
+
+	mutex_create(&lock);
+	for(reactor_count = 0; reactor_count < count; reactor_count++){
+		reactors[reactor_count].completed.head = NULL;
+		reactors[reactor_count].completed.tail = NULL;
+		condvar_create(&reactors[reactor_count].cond);
+	}
+	next_reactor = 0;
+	listeners = NULL;
+
+	sockblk = mmblock_create(MAX_SOCKETS, sizeof(struct socket));
+	opblk = mmblock_create(MAX_OPS, sizeof(struct async_op));
+	return 0;
+}
+
+void net_shutdown(void)
+{
+	if(sockblk != NULL){
+		mmblock_release(sockblk);
+		sockblk = NULL;
+	}
+
+	if(opblk != NULL){
+		mmblock_release(opblk);
+		opblk = NULL;
+	}
+
+	while(reactor_count > 0){
+		reactor_count -= 1;
+		condvar_destroy(reactors[reactor_count].cond);
+	}
+
+	if(lock != NULL){
+		mutex_destroy(lock);
+		lock = NULL;
+	}
+}
+
+int net_reactor_count(void)
+{
+	return reactor_count;
+}
+
+struct socket *net_socket(void)
+{
+	struct socket *sock;
+
+	// there is no connect on network.h so this
+	// socket will never be connected
+	mutex_lock(lock);
+	sock = socket_handle(&reactors[next_reactor]);
+	next_reactor = (next_reactor + 1) % reactor_count;
+	mutex_unlock(lock);
+	return sock;
+}
+
+struct socket *net_server_socket(int port, int reactor)
+{
+	struct socket *sock;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_server_socket: invalid reactor #%d", reactor);
+		return NULL;
+	}
+
+	mutex_lock(lock);
+	sock = socket_handle(&reactors[reactor]);
+	if(sock != NULL){
+		sock->flags = SOCKET_LISTENER;
+		sock->port = port;
+		sock->next = listeners;
+		listeners = sock;
+	}
+	mutex_unlock(lock);
+	return sock;
+}
+
+struct socket *net_mem_connect(int port)
+{
+	struct socket *listener, *client, *server, **link;
+
+	mutex_lock(lock);
+	// find listener and move it to the end of the list so
+	// connections are spread over listeners on the same port
+	for(link = &listeners; *link != NULL; link = &(*link)->next){
+		if((*link)->port == port)
+			break;
+	}
+
+	listener = *link;
+	if(listener == NULL || listener->backlog_count >= LISTEN_BACKLOG){
+		if(listener != NULL)
+			listen_overflows += 1;
+		mutex_unlock(lock);
+		return NULL;
+	}
+
+	if(listener->next != NULL){
+		*link = listener->next;
+		while(*link != NULL)
+			link = &(*link)->next;
+		*link = listener;
+		listener->next = NULL;
+	}
+
+	// create connected pair
+	client = socket_handle(listener->reactor);
+	if(client == NULL){
+		mutex_unlock(lock);
+		return NULL;
+	}
+
+	server = socket_handle(listener->reactor);
+	if(server == NULL){
+		mmblock_free(sockblk, client);
+		mutex_unlock(lock);
+		return NULL;
+	}
+	client->peer = server;
+	server->peer = client;
+
+	// queue server side on the backlog
+	if(listener->backlog_tail == NULL)
+		listener->backlog_head = server;
+	else
+		listener->backlog_tail->next = server;
+	listener->backlog_tail = server;
+	listener->backlog_count += 1;
+	progress_rd(listener);
+	mutex_unlock(lock);
+	return client;
+}
+
+void net_socket_shutdown(struct socket *sock, int how)
+{
+	mutex_lock(lock);
+	if(how == NET_SHUT_RD || how == NET_SHUT_RDWR){
+		sock->flags |= SOCKET_RD_SHUT;
+		cancel_queue(&sock->rd_queue);
+	}
+
+	if(how == NET_SHUT_WR || how == NET_SHUT_RDWR){
+		sock->flags |= SOCKET_WR_SHUT;
+		cancel_queue(&sock->wr_queue);
+		if(sock->peer != NULL)
+			pump(sock->peer);
+	}
+	mutex_unlock(lock);
+}
+
+void net_close(struct socket *sock)
+{
+	if(sock == NULL) return;
+
+	// NOTE: after calling net_close, the socket
+	// will be invalid and further calls to async_*
+	// will have undefined behaviour (probably crash)
+	mutex_lock(lock);
+	socket_close(sock);
+	mutex_unlock(lock);
+}
+
+// NOTE: must be used INSIDE the network lock
+// operations that complete right away are still
+// only completed on net_work
+static void enqueue_op(struct socket *sock, struct op_queue *q, struct async_op *op)
+{
+	queue_push(q, op);
+	pump(sock);
+}
+
+int net_async_accept(struct socket *sock,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(lock);
+	op = socket_op(sock, OP_ACCEPT);
+	if(op == NULL){
+		mutex_unlock(lock);
+		LOG_ERROR("net_async_accept: operation memory block is at maximum capacity (%d)", MAX_OPS);
+		return -1;
+	}
+	op->socket = NULL;
+	op->complete = fp;
+	op->udata = udata;
+	enqueue_op(sock, &sock->rd_queue, op);
+	mutex_unlock(lock);
+	return 0;
+}
+
+int net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	if(max < 1){
+		LOG_ERROR("net_async_accept_batch: invalid batch size %d", max);
+		return -1;
+	}
+
+	mutex_lock(lock);
+	op = socket_op(sock, OP_ACCEPT_BATCH);
+	if(op == NULL){
+		mutex_unlock(lock);
+		LOG_ERROR("net_async_accept_batch: operation memory block is at maximum capacity (%d)", MAX_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = socks;
+	op->len = max;
+	op->complete = fp;
+	op->udata = udata;
+	enqueue_op(sock, &sock->rd_queue, op);
+	mutex_unlock(lock);
+	return 0;
+}
+
+static int async_read(struct socket *sock, int opcode, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	mutex_lock(lock);
+	op = socket_op(sock, opcode);
+	if(op == NULL){
+		mutex_unlock(lock);
+		LOG_ERROR("net_async_read: operation memory block is at maximum capacity (%d)", MAX_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->buf = buf;
+	op->len = len;
+	op->complete = fp;
+	op->udata = udata;
+	enqueue_op(sock, &sock->rd_queue, op);
+	mutex_unlock(lock);
+	return 0;
+}
+
+int net_async_read(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	return async_read(sock, OP_READ, buf, len, fp, udata);
+}
+
+int net_async_read_some(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	return async_read(sock, OP_READ_SOME, buf, len, fp, udata);
+}
+
+int net_async_write(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct net_buf b;
+	b.buf = buf;
+	b.len = len;
+	return net_async_writev(sock, &b, 1, fp, udata);
+}
+
+int net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	struct async_op *op;
+
+	if(count < 1 || count > NET_MAX_IOV){
+		LOG_ERROR("net_async_writev: invalid number of buffers %d (max = %d)", count, NET_MAX_IOV);
+		return -1;
+	}
+
+	mutex_lock(lock);
+	op = socket_op(sock, OP_WRITEV);
+	if(op == NULL){
+		mutex_unlock(lock);
+		LOG_ERROR("net_async_writev: operation memory block is at maximum capacity (%d)", MAX_OPS);
+		return -1;
+	}
+	op->socket = sock;
+	op->len = 0;
+	for(int i = 0; i < count; i++){
+		op->iov[i] = bufs[i];
+		op->len += bufs[i].len;
+	}
+	op->iovpos = 0;
+	op->iovcnt = count;
+	op->complete = fp;
+	op->udata = udata;
+	enqueue_op(sock, &sock->wr_queue, op);
+	mutex_unlock(lock);
+	return 0;
+}
+
+int net_work(int reactor)
+{
+	void (*fp)(struct socket*, int, int, void*);
+	struct socket *socket;
+	int error, transfered, count;
+	void *udata;
+	struct async_op *op, *next;
+	struct reactor *r;
+
+	if(reactor < 0 || reactor >= reactor_count){
+		LOG_ERROR("net_work: invalid reactor #%d", reactor);
+		return -1;
+	}
+	r = &reactors[reactor];
+
+	mutex_lock(lock);
+	if(r->completed.head == NULL)
+		condvar_timedwait(r->cond, lock, NET_WORK_TIMEOUT);
+
+	// run every completion queued so far (completions queued
+	// by the routines themselves run on the next call)
+	count = 0;
+	op = r->completed.head;
+	r->completed.head = NULL;
+	r->completed.tail = NULL;
+	while(op != NULL){
+		next = op->next;
+		if(op->opcode == OP_RELEASE){
+			mmblock_free(sockblk, op->owner);
+			op = next;
+			continue;
+		}
+
+		fp = op->complete;
+		socket = op->socket;
+		error = op->error;
+		transfered = op->transfered;
+		udata = op->udata;
+		mmblock_free(opblk, op);
+		op = next;
+		count += 1;
+
+		mutex_unlock(lock);
+		fp(socket, error, transfered, udata);
+		mutex_lock(lock);
+	}
+	mutex_unlock(lock);
+	return count;
+}
+
+int net_socket_cork(struct socket *sock, int cork)
+{
+	// there are no segments to coalesce
+	return 0;
+}
+
+int net_socket_zerocopy(struct socket *sock, int threshold)
+{
+	// there is no kernel copy to avoid
+	return -1;
+}
+
+int net_listen_drops(long *overflows, long *drops)
+{
+	mutex_lock(lock);
+	*overflows = listen_overflows;
+	*drops = listen_overflows;
+	mutex_unlock(lock);
+	return 0;
+}
+
+unsigned long net_remote_address(struct socket *sock)
+{
+	// 127.0.0.1 in network byte order
+#ifdef __BIG_ENDIAN__
+	return 0x7F000001UL;
+#else
+	return 0x0100007FUL;
+#endif
+}
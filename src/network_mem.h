@@ -0,0 +1,17 @@
+#ifndef NETWORK_MEM_H_
+#define NETWORK_MEM_H_
+
+// in-memory network backend (network_mem.c)
+// sockets are connected through in-process pipes so connection and
+// protocol code can be driven without the kernel; it's selected at
+// build time with "configure.py -memnet" and implements network.h
+
+struct socket;
+
+// creates a virtual client connected to the listener on port and
+// queues the server side on its accept backlog (the client socket
+// is on the listener reactor); returns NULL if there is no listener
+// on port or if its backlog is full
+struct socket	*net_mem_connect(int port);
+
+#endif //NETWORK_MEM_H_
@@ -1,6 +1,7 @@
 #include "../thread.h"
 
 #include "../log.h"
+#include "../atomic.h"
 
 #include <stdlib.h>
 #include <pthread.h>
@@ -17,6 +18,41 @@ struct thread{
 	void *arg;
 };
 
+// routines run by every thread before exiting
+#define MAX_EXIT_ROUTINES 8
+static void (*volatile exit_routines[MAX_EXIT_ROUTINES])(void);
+static atomic_int exit_routine_count = 0;
+
+static void run_exit_routines(void)
+{
+	void (*fp)(void);
+	int count = atomic_load(&exit_routine_count);
+	for(int i = 0; i < count && i < MAX_EXIT_ROUTINES; i++){
+		// the slot may be reserved but not yet written
+		fp = exit_routines[i];
+		if(fp != NULL)
+			fp();
+	}
+}
+
+int thread_atexit(void (*fp)(void))
+{
+	int idx;
+	for(int i = 0; i < atomic_load(&exit_routine_count) && i < MAX_EXIT_ROUTINES; i++){
+		if(exit_routines[i] == fp)
+			return 0;
+	}
+
+	idx = atomic_fetch_add(&exit_routine_count, 1);
+	if(idx >= MAX_EXIT_ROUTINES){
+		atomic_add(&exit_routine_count, -1);
+		LOG_ERROR("thread_atexit: too many exit routines (max = %d)", MAX_EXIT_ROUTINES);
+		return -1;
+	}
+	exit_routines[idx] = fp;
+	return 0;
+}
+
 static void *wrapper(void *arg)
 {
 	struct thread *thr = arg;
@@ -24,6 +60,7 @@ static void *wrapper(void *arg)
 		return NULL;
 
 	thr->fp(thr->arg);
+	run_exit_routines();
 	thr->flags |= THREAD_COMPLETED;
 	return thr;
 }
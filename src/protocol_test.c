@@ -79,7 +79,7 @@ static void message_end(void *handle, struct message *msg)
 {
 	// add message header
 	msg->readpos = 2;
-	message_add_u32(msg, (uint32_t)adler32(msg->buffer+6, msg->length));
+	message_add_u32(msg, message_checksum(msg, 6, msg->length));
 	msg->readpos = 0;
 	message_add_u16(msg, (uint16_t)msg->length);
 }
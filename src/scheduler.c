@@ -180,9 +180,10 @@ int scheduler_reschedule(long delay, struct sch_entry *entry)
 	// remove entry from current position
 	*it = (*it)->next;
 
-	// check if we need to restart iteration
+	// check if we need to restart iteration (the entry
+	// may have been the last one)
 	time = sys_get_tick_count() + delay;
-	if((*it)->time > time)
+	if(*it == NULL || (*it)->time > time)
 		it = &head;
 
 	// get new position
@@ -1,11 +1,13 @@
 #include "server.h"
 
+#include "atomic.h"
 #include "network.h"
 #include "message.h"
 #include "thread.h"
 #include "log.h"
 #include "scheduler.h"
 #include "connection.h"
+#include "system.h"
 
 #include <stddef.h>
 
@@ -13,80 +15,218 @@
 #define SERVICE_CLOSED	0x01
 
 #define SERVICE_MAX_REOPENS 16
+
+// connections handed to connection_accept per completion
+// and interval between accept statistics reports
+#define LISTENER_BATCH		64
+#define LISTENER_REPORT_INTERVAL	10000 // 10sec
+
+struct service;
+struct listener{
+	long			reactor;
+	long			reopens;
+	struct service		*service;
+
+	// the listener socket is closed either by server_run
+	// or by the accept handler (whichever takes it first)
+	atomic_ptr		sock;
+
+	// accept batch
+	struct socket		*accepted[LISTENER_BATCH];
+
+	// accept statistics since the last report
+	long			report_time;
+	long			accept_count;
+	long			batch_count;
+};
+
 struct service{
 	long			port;
 	long			flags;
-	long			reopens;
-	struct socket		*sock;
+	struct listener		listeners[NET_MAX_REACTORS];
 	struct protocol		*protocol_list;
 };
 
 #define MAX_SERVICES 4
 static struct service		services[MAX_SERVICES];
 static long			service_count = 0;
-static long			running = 0;
+static volatile long		running = 0;
 
-static void service_reopen(struct service *service);
-static void service_on_accept(struct socket *sock, int error, int bytes_transfered, void *udata)
-{
-	struct service *service = udata;
+// reactor threads (reactor #0 runs on the server_run thread
+// until the server is stopped and then on its own thread so
+// connections can be drained)
+static struct thread		*reactor_threads[NET_MAX_REACTORS];
+static long			reactor_count = 0;
+static volatile long		reactors_running = 0;
+
+// time given to connections to flush their output on shutdown
+#define SERVER_DRAIN_TIMEOUT	5000 // 5sec
+
+// listen queue drop counters at the last report (the
+// counters are system wide so they're reported once
+// for every listener from the server_run thread)
+static int			drops_available = 1;
+static long			drops_report_time = 0;
+static long			last_overflows = -1;
+static long			last_drops = -1;
 
-	// reopen service in case of error
-	if(error != 0){
-		LOG_ERROR("service_on_accept: operation failed (error = %d)", error);
+static void listener_reopen(struct listener *listener);
+static void listener_on_accept(struct socket *sock, int error, int count, void *udata);
+
+static void listener_close(struct listener *listener)
+{
+	struct socket *sock = atomic_exchange_ptr(&listener->sock, NULL);
+	if(sock != NULL)
 		net_close(sock);
-		if((service->flags & SERVICE_CLOSED) == 0){
-			LOG_ERROR("service_on_accept: fatal socket error! re-opening service");
-			service_reopen(service);
-			return;
-		}
+}
+
+static int listener_accept(struct listener *listener)
+{
+	struct socket *sock = atomic_load_ptr(&listener->sock);
+	if(sock == NULL)
+		return -1;
+	return net_async_accept_batch(sock, listener->accepted,
+			LISTENER_BATCH, listener_on_accept, listener);
+}
+
+// opens the listener socket and starts its accept chain
+static int listener_open(struct listener *listener)
+{
+	struct socket *sock;
+
+	sock = net_server_socket(listener->service->port, listener->reactor);
+	if(sock == NULL)
+		return -1;
+	atomic_store_ptr(&listener->sock, sock);
+	if(listener_accept(listener) != 0){
+		listener_close(listener);
+		return -2;
+	}
+	return 0;
+}
+
+static void listener_stats(struct listener *listener, int count)
+{
+	struct service *service = listener->service;
+	long now, elapsed;
+
+	listener->accept_count += count;
+	listener->batch_count += 1;
+
+	now = sys_get_tick_count();
+	elapsed = now - listener->report_time;
+	if(elapsed < LISTENER_REPORT_INTERVAL)
+		return;
+
+	LOG("listener_stats: port %ld reactor #%ld accepted %ld connections in %ld batches (%ld/sec)",
+		service->port, listener->reactor, listener->accept_count,
+		listener->batch_count, (listener->accept_count * 1000) / elapsed);
+
+	listener->report_time = now;
+	listener->accept_count = 0;
+	listener->batch_count = 0;
+}
+
+// reports the connections the system dropped from listen
+// queues since the last report
+static void report_listen_drops(void)
+{
+	long now, overflows, drops;
+
+	if(drops_available == 0)
+		return;
+	now = sys_get_tick_count();
+	if(last_drops >= 0 && now - drops_report_time < LISTENER_REPORT_INTERVAL)
+		return;
+	drops_report_time = now;
+
+	// the counters are not available on every system
+	if(net_listen_drops(&overflows, &drops) != 0){
+		drops_available = 0;
+		return;
+	}
+	if(last_drops >= 0 && (overflows > last_overflows || drops > last_drops))
+		LOG_WARNING("listener_stats: %ld connections dropped from listen queues (%ld overflows)",
+			drops - last_drops, overflows - last_overflows);
+	last_overflows = overflows;
+	last_drops = drops;
+}
+
+static void listener_on_accept(struct socket *sock, int error, int count, void *udata)
+{
+	struct listener *listener = udata;
+	struct service *service = listener->service;
+
+	// reopen listener in case of error
+	// (errors are expected once the service is closed)
+	if(error != 0 && (service->flags & SERVICE_CLOSED) == 0){
+		LOG_ERROR("listener_on_accept: operation failed (error = %d)", error);
+		LOG_ERROR("listener_on_accept: fatal socket error! re-opening listener");
+		listener_reopen(listener);
+		return;
 	}
 
-	// if service is closing, close it's socket and return
-	// interrupting the accept chain
+	// if service is closing, close accepted sockets and
+	// the listener socket interrupting the accept chain
 	if((service->flags & SERVICE_CLOSED) != 0){
-		net_close(service->sock);
-		service->sock = NULL;
+		for(int i = 0; i < count; i++)
+			net_close(listener->accepted[i]);
+		listener_close(listener);
 		return;
 	}
 
-	// create new connection
-	connection_accept(sock, service->protocol_list);
+	// create new connections
+	for(int i = 0; i < count; i++)
+		connection_accept(listener->accepted[i], service->protocol_list);
+	listener_stats(listener, count);
 
 	// chain next accept
-	if(net_async_accept(service->sock, service_on_accept, service) != 0){
-		LOG_ERROR("service_on_accept: failed to chain next accept! trying to re-open service");
-		service_reopen(service);
+	if(listener_accept(listener) != 0){
+		LOG_ERROR("listener_on_accept: failed to chain next accept! trying to re-open listener");
+		listener_reopen(listener);
 	}
 }
 
-static void service_reopen(struct service *service)
+static void listener_reopen(struct listener *listener)
 {
-	if(service->sock != NULL)
-		net_close(service->sock);
+	struct service *service = listener->service;
 
-	if(service->reopens >= SERVICE_MAX_REOPENS){
-		LOG_ERROR("service_reopen: maximum number of reopens reached (%d)", SERVICE_MAX_REOPENS);
-		service->flags |= SERVICE_CLOSED;
+	listener_close(listener);
+	if((service->flags & SERVICE_CLOSED) != 0)
 		return;
-	}
 
-	service->sock = net_server_socket(service->port);
-	if(service->sock == NULL){
-		LOG_ERROR("service_reopen: failed to create service socket on port %d", service->port);
+	if(listener->reopens >= SERVICE_MAX_REOPENS){
+		LOG_ERROR("listener_reopen: maximum number of reopens reached (%d)", SERVICE_MAX_REOPENS);
 		return;
 	}
+	listener->reopens += 1;
 
-	if(net_async_accept(service->sock, service_on_accept, service) != 0){
-		LOG_ERROR("service_reopen: failed to restart accept chain on service port %d", service->port);
-		net_close(service->sock);
-		service->sock = NULL;
+	switch(listener_open(listener)){
+	case -1:
+		LOG_ERROR("listener_reopen: failed to create listener socket on port %d", service->port);
+		break;
+	case -2:
+		LOG_ERROR("listener_reopen: failed to restart accept chain on service port %d", service->port);
+		break;
+	}
+}
+
+static void reactor_thread(void *arg)
+{
+	long reactor = (long)arg;
+	while(reactors_running != 0){
+		if(net_work(reactor) == -1){
+			LOG_ERROR("reactor_thread: reactor #%ld failed", reactor);
+			running = 0;
+			break;
+		}
 	}
 }
 
 void server_run()
 {
 	struct service *service;
+	struct listener *listener;
 	struct protocol *proto;
 
 	// initialize services
@@ -103,40 +243,80 @@ void server_run()
 		for(proto = service->protocol_list; proto != NULL; proto = proto->next)
 			proto->init();
 
-		// create service socket
-		service->sock = net_server_socket(service->port);
-		if(service->sock == NULL){
-			LOG_ERROR("server_run: failed to start service on port %d", service->port);
-			continue;
+		// create one listener per reactor so accepted
+		// sockets are spread over every reactor
+		for(int j = 0; j < net_reactor_count(); j++){
+			listener = &service->listeners[j];
+			listener->reactor = j;
+			listener->reopens = 0;
+			listener->service = service;
+			listener->report_time = sys_get_tick_count();
+			listener->accept_count = 0;
+			listener->batch_count = 0;
+			switch(listener_open(listener)){
+			case -1:
+				LOG_ERROR("server_run: failed to start service on port %d (reactor #%d)", service->port, j);
+				break;
+			case -2:
+				LOG_ERROR("server_run: failed to start accept chain on service port %d", service->port);
+				break;
+			}
 		}
+	}
 
-		// start accept chain
-		if(net_async_accept(service->sock, service_on_accept, service) != 0){
-			LOG_ERROR("server_run: failed to start accept chain on service port %d", service->port);
-			net_close(service->sock);
-			service->sock = NULL;
+	// spawn reactor threads
+	running = 1;
+	reactors_running = 1;
+	reactor_count = 1;
+	while(reactor_count < net_reactor_count()){
+		if(thread_create(&reactor_threads[reactor_count], reactor_thread, (void*)reactor_count) != 0){
+			LOG_ERROR("server_run: failed to spawn reactor thread #%ld", reactor_count);
+			break;
 		}
+		reactor_count += 1;
 	}
 
 	// network loop
-	running = 1;
 	while(running != 0){
-		// net_work returning -1 means the net interface
-		// is no longer usable and needs to be shutdown
-		if(net_work() == -1)
+		if(net_work(0) == -1){
+			LOG_ERROR("server_run: reactor #0 failed");
 			running = 0;
+			reactors_running = 0;
+		}
+		report_listen_drops();
 	}
 
-	// close services
+	// stop accepting connections and drain the live ones
+	// while every reactor is still running
 	for(int i = 0; i < service_count; i++){
 		service = &services[i];
-
-		// close service socket
 		service->flags |= SERVICE_CLOSED;
-		if(service->sock != NULL)
-			net_close(service->sock);
+		for(int j = 0; j < net_reactor_count(); j++)
+			listener_close(&service->listeners[j]);
+	}
+	if(reactors_running != 0){
+		if(thread_create(&reactor_threads[0], reactor_thread, (void*)0) == 0){
+			connection_drain(SERVER_DRAIN_TIMEOUT);
+			reactors_running = 0;
+			thread_join(reactor_threads[0]);
+			thread_release(reactor_threads[0]);
+		}
+		else{
+			LOG_ERROR("server_run: failed to spawn reactor thread #0! connections won't be drained");
+		}
+		reactors_running = 0;
+	}
 
-		// shutdown protocol internals
+	// join reactor threads
+	while(reactor_count > 1){
+		reactor_count -= 1;
+		thread_join(reactor_threads[reactor_count]);
+		thread_release(reactor_threads[reactor_count]);
+	}
+
+	// shutdown protocol internals
+	for(int i = 0; i < service_count; i++){
+		service = &services[i];
 		for(proto = service->protocol_list; proto != NULL; proto = proto->next)
 			proto->shutdown();
 	}
@@ -172,6 +352,7 @@ void server_add_protocol(int port, struct protocol *protocol)
 		}
 		service = &services[service_count];
 		service->port = port;
+		service->flags = SERVICE_OPEN;
 		service->protocol_list = protocol;
 		service_count++;
 	}
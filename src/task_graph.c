@@ -0,0 +1,319 @@
+#include "task_graph.h"
+#include "work.h"
+#include "atomic.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <stddef.h>
+
+#define INITIAL_CAPACITY 8
+
+struct task{
+	struct task_graph	*graph;
+	void			(*fp)(void*);
+	void			*arg;
+	struct task_graph	*child;
+
+	// tasks waiting for this one
+	struct task		**next;
+	int			next_count;
+	int			next_capacity;
+
+	// tasks this one waits for and how
+	// many of them are still running
+	int			prev_count;
+	atomic_int		pending;
+};
+
+struct task_graph{
+	struct task		**tasks;
+	int			task_count;
+	int			task_capacity;
+
+	// tasks without dependencies (updated on dispatch
+	// after the graph was changed)
+	struct task		**roots;
+	int			root_count;
+	int			changed;
+
+	int			priority;
+	atomic_int		running;
+	atomic_int		tasks_left;
+	void			(*complete)(void*);
+	void			*complete_arg;
+};
+
+static void task_execute(struct task *task);
+
+static int grow(void *array, int *capacity, int count, size_t elem)
+{
+	void *ptr;
+	int new_capacity;
+
+	if(count < *capacity)
+		return 0;
+
+	new_capacity = (*capacity > 0) ? *capacity * 2 : INITIAL_CAPACITY;
+	ptr = realloc(*(void**)array, new_capacity * elem);
+	if(ptr == NULL)
+		return -1;
+	*(void**)array = ptr;
+	*capacity = new_capacity;
+	return 0;
+}
+
+struct task_graph *task_graph_create(void)
+{
+	struct task_graph *g = calloc(1, sizeof(struct task_graph));
+	if(g == NULL){
+		LOG_ERROR("task_graph_create: out of memory");
+		return NULL;
+	}
+	g->priority = WORK_NORMAL;
+	return g;
+}
+
+void task_graph_release(struct task_graph *g)
+{
+	if(atomic_load(&g->running) != 0){
+		LOG_ERROR("task_graph_release: graph is still running");
+		return;
+	}
+
+	for(int i = 0; i < g->task_count; i++){
+		free(g->tasks[i]->next);
+		free(g->tasks[i]);
+	}
+	free(g->tasks);
+	free(g->roots);
+	free(g);
+}
+
+void task_graph_set_priority(struct task_graph *g, int priority)
+{
+	g->priority = priority;
+}
+
+static struct task *add_task(struct task_graph *g)
+{
+	struct task *task;
+
+	if(atomic_load(&g->running) != 0){
+		LOG_ERROR("task_graph_add: graph is running");
+		return NULL;
+	}
+
+	if(grow(&g->tasks, &g->task_capacity, g->task_count, sizeof(struct task*)) != 0
+			|| (task = calloc(1, sizeof(struct task))) == NULL){
+		LOG_ERROR("task_graph_add: out of memory");
+		return NULL;
+	}
+	task->graph = g;
+	g->tasks[g->task_count++] = task;
+	g->changed = 1;
+	return task;
+}
+
+struct task *task_graph_add(struct task_graph *g, void (*fp)(void*), void *arg)
+{
+	struct task *task = add_task(g);
+	if(task != NULL){
+		task->fp = fp;
+		task->arg = arg;
+	}
+	return task;
+}
+
+struct task *task_graph_add_graph(struct task_graph *g, struct task_graph *child)
+{
+	struct task *task;
+
+	if(child == g){
+		LOG_ERROR("task_graph_add_graph: a graph can't be a task of itself");
+		return NULL;
+	}
+
+	task = add_task(g);
+	if(task != NULL)
+		task->child = child;
+	return task;
+}
+
+int task_graph_depend(struct task *task, struct task *before)
+{
+	struct task_graph *g = task->graph;
+
+	if(before->graph != g || before == task){
+		LOG_ERROR("task_graph_depend: tasks must be different and on the same graph");
+		return -1;
+	}
+
+	if(atomic_load(&g->running) != 0){
+		LOG_ERROR("task_graph_depend: graph is running");
+		return -1;
+	}
+
+	if(grow(&before->next, &before->next_capacity, before->next_count, sizeof(struct task*)) != 0){
+		LOG_ERROR("task_graph_depend: out of memory");
+		return -1;
+	}
+	before->next[before->next_count++] = task;
+	task->prev_count += 1;
+	g->changed = 1;
+	return 0;
+}
+
+// find the roots again and check that every task can
+// be reached from them (if not there is a cycle)
+// NOTE: must be used only while the graph isn't running
+static int task_graph_prepare(struct task_graph *g)
+{
+	struct task *task;
+	int count, reached;
+
+	if(g->changed == 0)
+		return 0;
+
+	free(g->roots);
+	g->roots = NULL;
+	g->root_count = 0;
+	if(g->task_count == 0){
+		g->changed = 0;
+		return 0;
+	}
+
+	// the roots array has room for every task so it's
+	// also used as the queue of the reachability check
+	g->roots = malloc(g->task_count * sizeof(struct task*));
+	if(g->roots == NULL){
+		LOG_ERROR("task_graph_dispatch: out of memory");
+		return -1;
+	}
+
+	count = 0;
+	for(int i = 0; i < g->task_count; i++){
+		g->tasks[i]->pending = g->tasks[i]->prev_count;
+		if(g->tasks[i]->prev_count == 0)
+			g->roots[count++] = g->tasks[i];
+	}
+	g->root_count = count;
+
+	reached = 0;
+	while(reached < count){
+		task = g->roots[reached++];
+		for(int i = 0; i < task->next_count; i++){
+			task->next[i]->pending -= 1;
+			if(task->next[i]->pending == 0)
+				g->roots[count++] = task->next[i];
+		}
+	}
+
+	if(reached < g->task_count){
+		LOG_ERROR("task_graph_dispatch: the graph has a dependency cycle");
+		return -1;
+	}
+	g->changed = 0;
+	return 0;
+}
+
+// NOTE: must be used only after the graph's last task has finished
+static void task_graph_complete(struct task_graph *g)
+{
+	void (*fp)(void*) = g->complete;
+	void *arg = g->complete_arg;
+
+	// the graph may be dispatched again from the complete routine
+	atomic_store(&g->running, 0);
+	if(fp != NULL)
+		fp(arg);
+}
+
+static void task_run(void *arg)
+{
+	task_execute(arg);
+}
+
+static void task_start(struct task *task)
+{
+	// if the work can't be dispatched run it here
+	// so the graph still completes
+	if(work_dispatch_priority(task->graph->priority, task_run, task) != 0)
+		task_execute(task);
+}
+
+// release the tasks waiting for this one and return one of
+// the ready tasks to run on this thread (the others are
+// dispatched to the worker threads)
+static struct task *task_finish(struct task *task)
+{
+	struct task_graph *g = task->graph;
+	struct task *ready = NULL;
+
+	for(int i = 0; i < task->next_count; i++){
+		if(atomic_fetch_add(&task->next[i]->pending, -1) != 1)
+			continue;
+		if(ready != NULL)
+			task_start(ready);
+		ready = task->next[i];
+	}
+
+	if(atomic_fetch_add(&g->tasks_left, -1) == 1)
+		task_graph_complete(g);
+	return ready;
+}
+
+static void task_child_complete(void *arg)
+{
+	task_execute(task_finish(arg));
+}
+
+static void task_execute(struct task *task)
+{
+	while(task != NULL){
+		if(task->child != NULL){
+			// the task finishes when the child graph completes
+			if(task_graph_dispatch(task->child, task_child_complete, task) == 0)
+				return;
+			LOG_ERROR("task_execute: failed to dispatch child graph");
+		}
+		else{
+			task->fp(task->arg);
+		}
+		task = task_finish(task);
+	}
+}
+
+int task_graph_dispatch(struct task_graph *g, void (*fp)(void*), void *arg)
+{
+	if(atomic_compare_exchange(&g->running, 0, 1) != 0){
+		LOG_ERROR("task_graph_dispatch: graph is already running");
+		return -1;
+	}
+
+	if(task_graph_prepare(g) != 0){
+		atomic_store(&g->running, 0);
+		return -1;
+	}
+
+	g->complete = fp;
+	g->complete_arg = arg;
+	if(g->task_count == 0){
+		task_graph_complete(g);
+		return 0;
+	}
+
+	// everything is reset before the first task starts
+	for(int i = 0; i < g->task_count; i++)
+		g->tasks[i]->pending = g->tasks[i]->prev_count;
+	g->tasks_left = g->task_count;
+	atomic_hwfence();
+
+	for(int i = 0; i < g->root_count; i++)
+		task_start(g->roots[i]);
+	return 0;
+}
+
+int task_graph_running(struct task_graph *g)
+{
+	return atomic_load(&g->running);
+}
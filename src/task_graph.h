@@ -0,0 +1,29 @@
+#ifndef TASK_GRAPH_H_
+#define TASK_GRAPH_H_
+
+// a task graph runs its tasks on the worker threads and each task
+// only starts after every task it depends on has finished (tasks
+// with no dependencies start right away); the complete routine
+// runs after the last task and the graph may be dispatched again
+// from then on (even from the complete routine) so the same graph
+// can be run every tick; memory is only allocated when tasks or
+// dependencies are added
+//
+// a graph can also be added as a task of another graph and it
+// finishes once the whole graph is complete
+//
+// NOTE: a graph can't be changed or released while it's running
+// and it must only be a task of one graph at a time
+struct task;
+struct task_graph;
+
+struct task_graph	*task_graph_create(void);
+void			task_graph_release(struct task_graph *g);
+void			task_graph_set_priority(struct task_graph *g, int priority);
+struct task		*task_graph_add(struct task_graph *g, void (*fp)(void*), void *arg);
+struct task		*task_graph_add_graph(struct task_graph *g, struct task_graph *child);
+int			task_graph_depend(struct task *task, struct task *before);
+int			task_graph_dispatch(struct task_graph *g, void (*fp)(void*), void *arg);
+int			task_graph_running(struct task_graph *g);
+
+#endif //TASK_GRAPH_H_
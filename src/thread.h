@@ -12,6 +12,11 @@ int	thread_create(struct thread **thr, void (*fp)(void *), void *arg);
 int	thread_release(struct thread *thr);
 int	thread_join(struct thread *thr);
 
+// registers a routine that every thread created with thread_create
+// runs right before exiting (used to flush thread local caches);
+// registering the same routine again does nothing
+int	thread_atexit(void (*fp)(void));
+
 // Mutex
 // ====================
 // NOTE: the implementation must support recursive lock/unlock
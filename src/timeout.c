@@ -0,0 +1,177 @@
+#include "timeout.h"
+
+#include "work.h"
+#include "thread.h"
+#include "system.h"
+#include "log.h"
+
+#include <stddef.h>
+
+// each slot has the timeouts due on the ticks that map to it and
+// the wheel thread visits one slot per tick; touched timeouts stay
+// where they are until their slot is visited and then move to the
+// slot of the new deadline (so touching is just a store)
+#define WHEEL_SLOTS	512
+#define WHEEL_MASK	(WHEEL_SLOTS - 1)
+
+static struct timeout	*wheel[WHEEL_SLOTS];
+static long		current_tick;
+static long		pending;
+
+// wheel thread
+static struct thread	*thread;
+static struct mutex	*mtx;
+static struct condvar	*cond;
+static int		running = 0;
+
+// NOTE: must be used INSIDE the wheel lock
+static void wheel_link(struct timeout *t)
+{
+	long tick;
+
+	// round up so the slot is never visited before the deadline
+	tick = (t->deadline + TIMEOUT_TICK - 1) / TIMEOUT_TICK;
+	if(tick < current_tick)
+		tick = current_tick;
+
+	t->slot = tick & WHEEL_MASK;
+	t->prev = NULL;
+	t->next = wheel[t->slot];
+	if(t->next != NULL)
+		t->next->prev = t;
+	wheel[t->slot] = t;
+}
+
+// NOTE: must be used INSIDE the wheel lock
+static void wheel_unlink(struct timeout *t)
+{
+	if(t->prev != NULL)
+		t->prev->next = t->next;
+	else
+		wheel[t->slot] = t->next;
+	if(t->next != NULL)
+		t->next->prev = t->prev;
+	t->slot = -1;
+}
+
+static void wheel_thread(void *unused)
+{
+	struct timeout *t, *next;
+	long now, delta;
+
+	while(running != 0){
+		mutex_lock(mtx);
+		// sleep until there is something on the wheel
+		if(pending == 0){
+			condvar_wait(cond, mtx);
+			mutex_unlock(mtx);
+			continue;
+		}
+
+		now = sys_get_tick_count();
+		delta = current_tick * TIMEOUT_TICK - now;
+		if(delta > 0){
+			condvar_timedwait(cond, mtx, delta);
+			mutex_unlock(mtx);
+			continue;
+		}
+
+		// take the whole slot and put back the
+		// timeouts that were touched since
+		t = wheel[current_tick & WHEEL_MASK];
+		wheel[current_tick & WHEEL_MASK] = NULL;
+		current_tick += 1;
+		while(t != NULL){
+			next = t->next;
+			if(t->deadline > now){
+				wheel_link(t);
+			}
+			else if(work_dispatch_priority(WORK_CRITICAL, t->fp, t->arg) != 0){
+				// try again on the next tick
+				wheel_link(t);
+			}
+			else{
+				t->slot = -1;
+				pending -= 1;
+			}
+			t = next;
+		}
+		mutex_unlock(mtx);
+	}
+}
+
+void timeout_init()
+{
+	for(int i = 0; i < WHEEL_SLOTS; i++)
+		wheel[i] = NULL;
+	current_tick = 0;
+	pending = 0;
+
+	// spawn wheel thread
+	mutex_create(&mtx);
+	condvar_create(&cond);
+	running = 1;
+	if(thread_create(&thread, wheel_thread, NULL) != 0)
+		LOG_ERROR("timeout_init: failed to spawn wheel thread");
+}
+
+void timeout_shutdown()
+{
+	// join wheel thread
+	mutex_lock(mtx);
+	running = 0;
+	condvar_broadcast(cond);
+	mutex_unlock(mtx);
+
+	thread_join(thread);
+	thread_release(thread);
+
+	// release resources
+	condvar_destroy(cond);
+	mutex_destroy(mtx);
+}
+
+int timeout_add(struct timeout *t, long delay, void (*fp)(void*), void *arg)
+{
+	long now;
+
+	if(running == 0){
+		LOG_ERROR("timeout_add: wheel thread not running");
+		return -1;
+	}
+
+	now = sys_get_tick_count();
+	t->deadline = now + delay;
+	t->fp = fp;
+	t->arg = arg;
+
+	mutex_lock(mtx);
+	// the wheel doesn't turn while it's empty
+	// so it starts again from the current time
+	if(pending == 0)
+		current_tick = now / TIMEOUT_TICK;
+	wheel_link(t);
+	pending += 1;
+	if(pending == 1)
+		condvar_signal(cond);
+	mutex_unlock(mtx);
+	return 0;
+}
+
+void timeout_touch(struct timeout *t, long delay)
+{
+	t->deadline = sys_get_tick_count() + delay;
+}
+
+int timeout_remove(struct timeout *t)
+{
+	mutex_lock(mtx);
+	if(t->slot == -1){
+		mutex_unlock(mtx);
+		return -1;
+	}
+	wheel_unlink(t);
+	pending -= 1;
+	mutex_unlock(mtx);
+	return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef TIMEOUT_H_
+#define TIMEOUT_H_
+
+// coarse timeouts on a hashed timing wheel (timeout.c) for things
+// like connection idle timeouts: adding and removing are O(1) and
+// touching doesn't take any lock; they fire up to one tick late and
+// the handlers run on the worker threads
+#define TIMEOUT_TICK 100 // msec
+
+// embedded on the owner so there is nothing to allocate
+struct timeout{
+	volatile long	deadline;
+	long		slot;
+	void		(*fp)(void*);
+	void		*arg;
+	struct timeout	*next;
+	struct timeout	*prev;
+};
+
+void	timeout_init(void);
+void	timeout_shutdown(void);
+
+// NOTE: a timeout may only be added again after it's
+// removed or its handler is dispatched
+int	timeout_add(struct timeout *t, long delay, void (*fp)(void*), void *arg);
+
+// moves the deadline of a pending timeout to delay msec from now
+// (it can only be pushed forward as the wheel checks it lazily)
+void	timeout_touch(struct timeout *t, long delay);
+
+// returns -1 if the timeout is not pending (its
+// handler was already dispatched)
+int	timeout_remove(struct timeout *t);
+
+#endif //TIMEOUT_H_
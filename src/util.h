@@ -4,10 +4,17 @@
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 #ifndef ARRAYSIZE
 #define ARRAYSIZE(a) (sizeof(a)/sizeof((a)[0]))
 #endif
 
 unsigned long adler32(const unsigned char *buf, unsigned long len);
+unsigned long adler32_update(unsigned long adler, const unsigned char *buf, unsigned long len);
 
 #endif //UTIL_H_
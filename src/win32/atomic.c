@@ -33,6 +33,26 @@ int atomic_compare_exchange(atomic_int *x, int cmp, int val)
 	return InterlockedCompareExchange(x, val, cmp);
 }
 
+void *atomic_load_ptr(atomic_ptr *x)
+{
+	return *x;
+}
+
+void atomic_store_ptr(atomic_ptr *x, void *val)
+{
+	*x = val;
+}
+
+void *atomic_exchange_ptr(atomic_ptr *x, void *val)
+{
+	return InterlockedExchangePointer(x, val);
+}
+
+void *atomic_compare_exchange_ptr(atomic_ptr *x, void *cmp, void *val)
+{
+	return InterlockedCompareExchangePointer(x, val, cmp);
+}
+
 // I think the Interlocked* API doesn't need any kind of fence
 void atomic_lwfence()
 {
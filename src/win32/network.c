@@ -14,12 +14,16 @@
 #define OP_ACCEPT	0x01
 #define OP_READ		0x02
 #define OP_WRITE	0x03
+#define OP_ACCEPT_BATCH	0x04
 struct async_op{
 	OVERLAPPED	overlapped;
 	int		opcode;
 	struct socket	*socket;
 	void		(*complete)(struct socket*, int, int, void*);
 	void		*udata;
+
+	// accept batch output
+	struct socket	**socks;
 };
 
 #define MAX_SOCKETS 2048
@@ -115,10 +119,15 @@ static struct async_op *socket_op(struct socket *sock, int opcode)
 	return op;
 }
 
-int net_init()
+int net_init(int reactors)
 {
 	int ret;
 
+	// NOTE: the completion port could be shared by multiple
+	// threads but a single reactor is used for now
+	if(reactors != 1)
+		LOG_WARNING("net_init: multiple reactors not supported on this platform (using 1)");
+
 	// initialize WSA
 	ret = WSAStartup(MAKEWORD(2, 2), &wsa_data);
 	if(ret != 0){
@@ -151,6 +160,11 @@ int net_init()
 	return 0;
 }
 
+int net_reactor_count(void)
+{
+	return 1;
+}
+
 void net_shutdown()
 {
 	// release resources
@@ -202,11 +216,16 @@ struct socket *net_socket()
 	return sock;
 }
 
-struct socket *net_server_socket(int port)
+struct socket *net_server_socket(int port, int reactor)
 {
 	struct sockaddr_in addr;
 	struct socket *sock;
 
+	if(reactor != 0){
+		LOG_ERROR("net_server_socket: invalid reactor #%d", reactor);
+		return NULL;
+	}
+
 	// create socket
 	sock = net_socket();
 	if(sock == NULL){
@@ -289,6 +308,47 @@ int net_async_accept(struct socket *sock,
 	return 0;
 }
 
+// AcceptEx completes a single connection so batches
+// will always have one socket
+int net_async_accept_batch(struct socket *sock, struct socket **socks, int max,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	BOOL ret;
+	DWORD transfered;
+	DWORD error;
+	struct async_op *op;
+
+	if(max < 1){
+		LOG_ERROR("net_async_accept_batch: invalid batch size %d", max);
+		return -1;
+	}
+
+	op = socket_op(sock, OP_ACCEPT_BATCH);
+	if(op == NULL){
+		LOG_ERROR("net_async_accept_batch: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		return -1;
+	}
+	memset(&op->overlapped, 0, sizeof(OVERLAPPED));
+	op->socket = sock;
+	op->socks = socks;
+	op->socks[0] = net_socket();
+	op->complete = fp;
+	op->udata = udata;
+	ret = _AcceptEx(sock->fd, socks[0]->fd, socks[0]->addr_buffer, 0,
+		sizeof(struct sockaddr_in) + 16, sizeof(struct sockaddr_in) + 16,
+		&transfered, (OVERLAPPED*)op);
+	if(ret == FALSE){
+		error = GetLastError();
+		if(error != WSA_IO_PENDING){
+			LOG_ERROR("net_async_accept_batch: AcceptEx failed (error = %d)", error);
+			net_close(socks[0]);
+			op->opcode = OP_NONE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
 int net_async_read(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
@@ -322,6 +382,14 @@ int net_async_read(struct socket *sock, char *buf, int len,
 	return 0;
 }
 
+// WSARecv completes as soon as there is any data so
+// this is the same as net_async_read
+int net_async_read_some(struct socket *sock, char *buf, int len,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	return net_async_read(sock, buf, len, fp, udata);
+}
+
 int net_async_write(struct socket *sock, char *buf, int len,
 		void (*fp)(struct socket*, int, int, void*), void *udata)
 {
@@ -353,7 +421,46 @@ int net_async_write(struct socket *sock, char *buf, int len,
 	return 0;
 }
 
-int net_work()
+int net_async_writev(struct socket *sock, struct net_buf *bufs, int count,
+		void (*fp)(struct socket*, int, int, void*), void *udata)
+{
+	WSABUF data[NET_MAX_IOV];
+	DWORD transfered;
+	DWORD error;
+	struct async_op *op;
+
+	if(count < 1 || count > NET_MAX_IOV){
+		LOG_ERROR("net_async_writev: invalid number of buffers %d (max = %d)", count, NET_MAX_IOV);
+		return -1;
+	}
+
+	// WSASend copies the WSABUF array so it can live on the stack
+	for(int i = 0; i < count; i++){
+		data[i].buf = bufs[i].buf;
+		data[i].len = bufs[i].len;
+	}
+
+	op = socket_op(sock, OP_WRITE);
+	if(op == NULL){
+		LOG_ERROR("net_async_writev: maximum simultaneous operations reached (%d)", SOCKET_MAX_OPS);
+		return -1;
+	}
+	memset(&op->overlapped, 0, sizeof(OVERLAPPED));
+	op->socket = sock;
+	op->complete = fp;
+	op->udata = udata;
+	if(WSASend(sock->fd, data, count, &transfered, 0, (OVERLAPPED*)op, NULL) == SOCKET_ERROR){
+		error = GetLastError();
+		if(error != WSA_IO_PENDING){
+			LOG_ERROR("net_async_writev: WSASend failed (error = %d)", error);
+			op->opcode = OP_NONE;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int net_work(int reactor)
 {
 	DWORD transfered, error;
 	ULONG_PTR completion_key;
@@ -378,6 +485,20 @@ int net_work()
 				(struct sockaddr**)&op->socket->local_addr, &dummy,
 				(struct sockaddr**)&op->socket->remote_addr, &dummy);
 		}
+		else if(op->opcode == OP_ACCEPT_BATCH){
+			if(error == NO_ERROR){
+				_GetAcceptExSockaddrs(op->socks[0]->addr_buffer, 0,
+					sizeof(struct sockaddr_in) + 16, sizeof(struct sockaddr_in) + 16,
+					(struct sockaddr**)&op->socks[0]->local_addr, &dummy,
+					(struct sockaddr**)&op->socks[0]->remote_addr, &dummy);
+				transfered = 1;
+			}
+			else{
+				net_close(op->socks[0]);
+				op->socks[0] = NULL;
+				transfered = 0;
+			}
+		}
 
 		op->complete(op->socket, posix_error(error), transfered, op->udata);
 		op->opcode = OP_NONE;
@@ -387,6 +508,24 @@ int net_work()
 	return 0;
 }
 
+int net_socket_cork(struct socket *sock, int cork)
+{
+	// winsock has no equivalent of TCP_CORK
+	return -1;
+}
+
+int net_socket_zerocopy(struct socket *sock, int threshold)
+{
+	// MSG_ZEROCOPY is linux only
+	return -1;
+}
+
+int net_listen_drops(long *overflows, long *drops)
+{
+	// not available on windows
+	return -1;
+}
+
 unsigned long net_remote_address(struct socket *sock)
 {
 	if(sock->remote_addr == NULL) return 0;
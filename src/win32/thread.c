@@ -1,4 +1,5 @@
 #include "../log.h"
+#include "../atomic.h"
 
 #include <stdlib.h>
 
@@ -14,12 +15,48 @@ struct thread{
 	void *arg;
 };
 
+// routines run by every thread before exiting
+#define MAX_EXIT_ROUTINES 8
+static void (*volatile exit_routines[MAX_EXIT_ROUTINES])(void);
+static atomic_int exit_routine_count = 0;
+
+static void run_exit_routines(void)
+{
+	void (*fp)(void);
+	int count = atomic_load(&exit_routine_count);
+	for(int i = 0; i < count && i < MAX_EXIT_ROUTINES; i++){
+		// the slot may be reserved but not yet written
+		fp = exit_routines[i];
+		if(fp != NULL)
+			fp();
+	}
+}
+
+int thread_atexit(void (*fp)(void))
+{
+	int idx;
+	for(int i = 0; i < atomic_load(&exit_routine_count) && i < MAX_EXIT_ROUTINES; i++){
+		if(exit_routines[i] == fp)
+			return 0;
+	}
+
+	idx = atomic_fetch_add(&exit_routine_count, 1);
+	if(idx >= MAX_EXIT_ROUTINES){
+		atomic_add(&exit_routine_count, -1);
+		LOG_ERROR("thread_atexit: too many exit routines (max = %d)", MAX_EXIT_ROUTINES);
+		return -1;
+	}
+	exit_routines[idx] = fp;
+	return 0;
+}
+
 static unsigned int __stdcall wrapper(void *arg)
 {
 	struct thread *thr = arg;
 	if(thr == NULL)
 		return -1;
 	thr->fp(thr->arg);
+	run_exit_routines();
 	return 0;
 }
 
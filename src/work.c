@@ -2,142 +2,995 @@
 
 #include "thread.h"
 #include "system.h"
+#include "mmblock.h"
 #include "log.h"
 #include "util.h"
+#include "atomic.h"
 
+#include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 
-// work ring buffer
-#define MAX_WORK 4096
-static struct work work_pool[MAX_WORK];
-static int readpos;
-static int writepos;
-static int pending_work;
+// injection queues (one per priority lane): work dispatched from
+// outside the worker threads, critical and background work and
+// work that didn't fit a worker deque; each is a list of segments
+// that grows with the pending work so bursts only add latency and
+// the emptied segments are kept for reuse up to MAX_SPARE_SEGMENTS
+#define SEGMENT_WORK		1024
+#define MAX_SPARE_SEGMENTS	16
+#define SEGMENT_WARNING		16
+struct work_segment{
+	struct work_segment	*next;
+	int			readpos;
+	int			writepos;
+	struct work		work[SEGMENT_WORK];
+};
+
+struct work_queue{
+	struct work_segment	*head;
+	struct work_segment	*tail;
+	atomic_int		pending;
+	long			pending_high;
+	long			injected;
+};
+
+static struct work_queue queues[WORK_PRIORITIES];
+static struct work_segment *spare;
+static int spare_count;
+static long segment_count;
+static long segment_warning;
+
+// per worker deques (Chase-Lev): the owner pushes and pops at
+// the bottom and the other workers steal from the top; the
+// indexes only grow (wrapping around) so they're compared by
+// their difference (only normal work goes to the deques)
+#define DEQUE_SIZE	4096
+#define DEQUE_MASK	(DEQUE_SIZE - 1)
+struct worker{
+	atomic_int	top;
+	char		pad0[60];
+	atomic_int	bottom;
+	char		pad1[60];
+	struct work	deque[DEQUE_SIZE];
+	struct thread	*thread;
+	unsigned	seed;
+	unsigned	ticks;
+	long		stolen;
+};
+
+// the workers look for critical work first and then for normal
+// work (their own deque, the normal injection queue and the other
+// deques) and run background work when there is nothing else; to
+// keep the lower lanes from starving they check the normal lane
+// first once every INJECT_INTERVAL work and the background lane
+// once every BACKGROUND_INTERVAL work; they also move up to
+// INJECT_BATCH normal work to their deque at a time
+#define INJECT_INTERVAL		61
+#define BACKGROUND_INTERVAL	251
+#define INJECT_BATCH		32
 
 // thread pool
 #define MAX_THREADS 64
-static struct thread *thread_pool[MAX_THREADS];
+static struct worker *workers;
 static struct mutex *lock;
 static struct condvar *cond;
+static atomic_int sleeping;
 static int thread_count;
 static int running = 0;
 
+// callers of a parallel job sleep here until the
+// executor that finishes its last chunk wakes them up
+static struct mutex *parallel_lock;
+static struct condvar *parallel_done;
+
+// background work runs on at most background_limit workers
+#define DEFAULT_BACKGROUND_PERCENT 50
+static atomic_int background_running;
+static atomic_int background_limit;
+
+// worker and lane running on the current thread
+static THREAD_LOCAL struct worker *self = NULL;
+static THREAD_LOCAL int current_priority = WORK_NORMAL;
+
+// strands
+#define MAX_STRANDS		4096
+#define MAX_STRAND_WORK		16384
+#define STRAND_BATCH		16
+struct strand_work{
+	void			(*fp)(void*);
+	void			*arg;
+	struct strand_work	*next;
+};
+
+struct strand{
+	struct mutex		*lock;
+	struct strand_work	*head;
+	struct strand_work	*tail;
+	int			priority;
+	int			scheduled;
+	int			destroyed;
+};
+
+static struct mmblock *strandblk;
+static struct mmblock *strand_workblk;
 
-static void worker_thread(void *unused)
+static int index_diff(int a, int b)
 {
-	void (*fp)(void*);
-	void *arg;
-	while(running != 0){
-		// retrieve work
-		mutex_lock(lock);
-		if(pending_work <= 0){
-			condvar_wait(cond, lock);
-			if(pending_work <= 0){
-				mutex_unlock(lock);
-				continue;
-			}
+	return (int)((unsigned)a - (unsigned)b);
+}
+
+static int index_next(int a, int n)
+{
+	return (int)((unsigned)a + (unsigned)n);
+}
+
+// NOTE: must be used only by the deque owner
+static int deque_push(struct worker *w, void (*fp)(void*), void *arg)
+{
+	int b = w->bottom;
+	if(index_diff(b, atomic_load(&w->top)) >= DEQUE_SIZE)
+		return -1;
+	w->deque[b & DEQUE_MASK].fp = fp;
+	w->deque[b & DEQUE_MASK].arg = arg;
+	// the work must be written before it's published
+	atomic_lwfence();
+	atomic_store(&w->bottom, index_next(b, 1));
+	return 0;
+}
+
+// NOTE: must be used only by the deque owner
+static int deque_pop(struct worker *w, struct work *work)
+{
+	int b, t, size;
+
+	b = w->bottom;
+	if(index_diff(b, atomic_load(&w->top)) <= 0)
+		return -1;
+
+	// reserve the bottom work before looking at the top
+	// (the exchange is a full fence) so a thief racing for
+	// the same work is seen here or sees the new bottom
+	b = index_next(b, -1);
+	atomic_exchange(&w->bottom, b);
+	t = atomic_load(&w->top);
+	size = index_diff(b, t);
+	if(size < 0){
+		atomic_store(&w->bottom, t);
+		return -1;
+	}
+
+	*work = w->deque[b & DEQUE_MASK];
+	if(size > 0)
+		return 0;
+
+	// last work: whoever moves the top gets it
+	size = (atomic_compare_exchange(&w->top, t, index_next(t, 1)) == t) ? 0 : -1;
+	atomic_store(&w->bottom, index_next(t, 1));
+	return size;
+}
+
+static int deque_steal(struct worker *w, struct work *work)
+{
+	int t, b;
+
+	t = atomic_load(&w->top);
+	atomic_lwfence();
+	b = atomic_load(&w->bottom);
+	if(index_diff(b, t) <= 0)
+		return -1;
+
+	// the slot can't be reused by the owner until the top
+	// moves past it so the work is valid if the exchange works
+	*work = w->deque[t & DEQUE_MASK];
+	atomic_lwfence();
+	if(atomic_compare_exchange(&w->top, t, index_next(t, 1)) != t)
+		return -1;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the pool lock
+static struct work_segment *segment_alloc(void)
+{
+	struct work_segment *seg;
+
+	if(spare != NULL){
+		seg = spare;
+		spare = seg->next;
+		spare_count--;
+	}
+	else{
+		seg = malloc(sizeof(struct work_segment));
+		if(seg == NULL)
+			return NULL;
+		segment_count++;
+
+		// the queues are only this long when the
+		// workers can't keep up so make it visible
+		if(segment_count >= segment_warning){
+			LOG_WARNING("work: injection queues grew to %ld segments", segment_count);
+			segment_warning *= 2;
+		}
+	}
+	seg->next = NULL;
+	seg->readpos = 0;
+	seg->writepos = 0;
+	return seg;
+}
+
+// NOTE: must be used INSIDE the pool lock
+static void segment_free(struct work_segment *seg)
+{
+	if(spare_count >= MAX_SPARE_SEGMENTS){
+		free(seg);
+		segment_count--;
+		return;
+	}
+	seg->next = spare;
+	spare = seg;
+	spare_count++;
+}
+
+// NOTE: must be used INSIDE the pool lock
+static int inject_push(struct work_queue *q, void (*fp)(void*), void *arg)
+{
+	struct work_segment *seg;
+
+	if(q->tail->writepos >= SEGMENT_WORK){
+		seg = segment_alloc();
+		if(seg == NULL)
+			return -1;
+		q->tail->next = seg;
+		q->tail = seg;
+	}
+	q->tail->work[q->tail->writepos].fp = fp;
+	q->tail->work[q->tail->writepos].arg = arg;
+	q->tail->writepos++;
+	atomic_add(&q->pending, 1);
+
+	q->injected++;
+	if(q->pending > q->pending_high)
+		q->pending_high = q->pending;
+	return 0;
+}
+
+// NOTE: must be used INSIDE the pool lock
+static void inject_pop(struct work_queue *q, struct work *work)
+{
+	struct work_segment *seg = q->head;
+
+	*work = seg->work[seg->readpos];
+	seg->readpos++;
+	atomic_add(&q->pending, -1);
+
+	// the last segment is rewound instead of released
+	if(seg->readpos >= seg->writepos){
+		if(seg == q->tail){
+			seg->readpos = 0;
+			seg->writepos = 0;
 		}
-		fp = work_pool[readpos].fp;
-		arg = work_pool[readpos].arg;
-		++readpos;
-		if(readpos >= MAX_WORK)
-			readpos = 0;
-		--pending_work;
+		else if(seg->readpos >= SEGMENT_WORK){
+			q->head = seg->next;
+			segment_free(seg);
+		}
+	}
+}
+
+static void wake_workers(int count)
+{
+	atomic_hwfence();
+	if(atomic_load(&sleeping) <= 0)
+		return;
+
+	mutex_lock(lock);
+	if(count > 1)
+		condvar_broadcast(cond);
+	else
+		condvar_signal(cond);
+	mutex_unlock(lock);
+}
+
+// take work from the normal injection queue and move a share of
+// what's left to the worker deque (the moved work is pushed in
+// reverse so the worker still runs it in dispatch order)
+static int inject_take(struct worker *w, struct work *work)
+{
+	struct work_queue *q = &queues[WORK_NORMAL];
+	struct work batch[INJECT_BATCH];
+	int count;
+
+	if(atomic_load(&q->pending) <= 0)
+		return -1;
+
+	mutex_lock(lock);
+	if(q->pending <= 0){
+		mutex_unlock(lock);
+		return -1;
+	}
+	inject_pop(q, work);
+	count = MIN(INJECT_BATCH, q->pending / thread_count);
+	count = MIN(count, DEQUE_SIZE - index_diff(w->bottom, w->top));
+	for(int i = 0; i < count; i++)
+		inject_pop(q, &batch[i]);
+	mutex_unlock(lock);
+
+	// only the owner pushes so there is room for the batch
+	for(int i = count - 1; i >= 0; i--)
+		deque_push(w, batch[i].fp, batch[i].arg);
+	if(count > 0)
+		wake_workers(1);
+	return 0;
+}
+
+static int critical_take(struct work *work)
+{
+	struct work_queue *q = &queues[WORK_CRITICAL];
+
+	if(atomic_load(&q->pending) <= 0)
+		return -1;
+
+	mutex_lock(lock);
+	if(q->pending <= 0){
+		mutex_unlock(lock);
+		return -1;
+	}
+	inject_pop(q, work);
+	mutex_unlock(lock);
+	return 0;
+}
+
+// the worker keeps its background slot until the work returns
+static int background_take(struct work *work)
+{
+	struct work_queue *q = &queues[WORK_BACKGROUND];
+
+	if(atomic_load(&q->pending) <= 0
+			|| atomic_load(&background_running) >= background_limit)
+		return -1;
+
+	if(atomic_fetch_add(&background_running, 1) >= background_limit){
+		atomic_add(&background_running, -1);
+		return -1;
+	}
+
+	mutex_lock(lock);
+	if(q->pending <= 0){
 		mutex_unlock(lock);
+		atomic_add(&background_running, -1);
+		return -1;
+	}
+	inject_pop(q, work);
+	mutex_unlock(lock);
+	return 0;
+}
+
+static int steal(struct worker *w, struct work *work)
+{
+	int victim;
+
+	// start from a random victim so thieves spread out
+	w->seed ^= w->seed << 13;
+	w->seed ^= w->seed >> 17;
+	w->seed ^= w->seed << 5;
+	victim = (int)(w->seed % (unsigned)thread_count);
+	for(int i = 0; i < thread_count; i++){
+		if(&workers[victim] != w && deque_steal(&workers[victim], work) == 0){
+			w->stolen++;
+			return 0;
+		}
+		if(++victim >= thread_count)
+			victim = 0;
+	}
+	return -1;
+}
+
+static int get_work(struct worker *w, struct work *work, int *priority)
+{
+	w->ticks++;
+	if((w->ticks % BACKGROUND_INTERVAL) == 0 && background_take(work) == 0){
+		*priority = WORK_BACKGROUND;
+		return 0;
+	}
+
+	*priority = WORK_NORMAL;
+	if((w->ticks % INJECT_INTERVAL) == 0
+			&& (inject_take(w, work) == 0 || deque_pop(w, work) == 0))
+		return 0;
+
+	*priority = WORK_CRITICAL;
+	if(critical_take(work) == 0)
+		return 0;
+
+	*priority = WORK_NORMAL;
+	if(deque_pop(w, work) == 0 || inject_take(w, work) == 0
+			|| steal(w, work) == 0)
+		return 0;
+
+	*priority = WORK_BACKGROUND;
+	return background_take(work);
+}
+
+// NOTE: must be used INSIDE the pool lock
+static int has_work(void)
+{
+	if(queues[WORK_CRITICAL].pending > 0 || queues[WORK_NORMAL].pending > 0)
+		return 1;
+	if(queues[WORK_BACKGROUND].pending > 0 && background_running < background_limit)
+		return 1;
+	for(int i = 0; i < thread_count; i++){
+		if(index_diff(workers[i].bottom, workers[i].top) > 0)
+			return 1;
+	}
+	return 0;
+}
+
+// the sleeping count is raised before looking for work
+// and the dispatchers publish the work before looking at
+// the count so either the worker sees the work or it's
+// woken up (a worker leaving its background slot goes
+// back to look for work itself)
+static void worker_sleep(void)
+{
+	mutex_lock(lock);
+	atomic_add(&sleeping, 1);
+	if(running != 0 && has_work() == 0)
+		condvar_wait(cond, lock);
+	atomic_add(&sleeping, -1);
+	mutex_unlock(lock);
+}
 
-		// execute work
-		fp(arg);
+static void worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct work work;
+	int priority;
+
+	self = w;
+	while(running != 0){
+		if(get_work(w, &work, &priority) == 0){
+			current_priority = priority;
+			work.fp(work.arg);
+			current_priority = WORK_NORMAL;
+			if(priority == WORK_BACKGROUND)
+				atomic_add(&background_running, -1);
+		}
+		else{
+			worker_sleep();
+		}
 	}
 }
 
 void work_init()
 {
-	readpos = 0;
-	writepos = 0;
-	pending_work = 0;
+	work_init_threads(0);
+}
+
+void work_init_threads(int threads)
+{
+	strandblk = mmblock_create(MAX_STRANDS, sizeof(struct strand));
+	mmblock_init_lock(strandblk);
+	strand_workblk = mmblock_create(MAX_STRAND_WORK, sizeof(struct strand_work));
+	mmblock_init_lock(strand_workblk);
+
+	spare = NULL;
+	spare_count = 0;
+	segment_count = 0;
+	segment_warning = SEGMENT_WARNING;
+	for(int i = 0; i < WORK_PRIORITIES; i++){
+		queues[i].head = queues[i].tail = segment_alloc();
+		queues[i].pending = 0;
+		queues[i].pending_high = 0;
+		queues[i].injected = 0;
+	}
+	sleeping = 0;
+	background_running = 0;
 
 	// spawn working threads
 	mutex_create(&lock);
 	condvar_create(&cond);
+	mutex_create(&parallel_lock);
+	condvar_create(&parallel_done);
 	running = 1;
-	thread_count = MAX(1, MIN(MAX_THREADS, sys_get_cpu_count() - 1));
-	for(long i = 0; i < thread_count; i++){
-		if(thread_create(&thread_pool[i], worker_thread, NULL))
+	if(threads <= 0)
+		threads = (int)sys_get_cpu_count() - 1;
+	thread_count = MAX(1, MIN(MAX_THREADS, threads));
+	work_set_background_limit(DEFAULT_BACKGROUND_PERCENT);
+	workers = calloc(thread_count, sizeof(struct worker));
+	for(int i = 0; i < thread_count; i++){
+		workers[i].seed = 2463534242u + (unsigned)i * 2654435761u;
+		if(thread_create(&workers[i].thread, worker_thread, &workers[i]))
 			LOG_ERROR("work_init: failed to spawn worker thread #%d", i);
 	}
 }
 
 void work_shutdown()
 {
+	struct work_segment *seg;
+
 	// join threads
 	mutex_lock(lock);
 	running = 0;
 	condvar_broadcast(cond);
 	mutex_unlock(lock);
 
-	for(long i = 0; i < thread_count; i++){
-		thread_join(thread_pool[i]);
-		thread_release(thread_pool[i]);
+	for(int i = 0; i < thread_count; i++){
+		thread_join(workers[i].thread);
+		thread_release(workers[i].thread);
 	}
+	free(workers);
+	workers = NULL;
 
+	// work still queued is dropped
+	for(int i = 0; i < WORK_PRIORITIES; i++){
+		while(queues[i].head != NULL){
+			seg = queues[i].head;
+			queues[i].head = seg->next;
+			free(seg);
+		}
+		queues[i].tail = NULL;
+	}
+	while(spare != NULL){
+		seg = spare;
+		spare = seg->next;
+		free(seg);
+	}
+
+	condvar_destroy(parallel_done);
+	mutex_destroy(parallel_lock);
 	condvar_destroy(cond);
 	mutex_destroy(lock);
+
+	mmblock_release(strand_workblk);
+	mmblock_release(strandblk);
+}
+
+int work_thread_count(void)
+{
+	return thread_count;
+}
+
+void work_set_background_limit(int percent)
+{
+	percent = MAX(0, MIN(100, percent));
+	atomic_store(&background_limit, MAX(1, thread_count * percent / 100));
+}
+
+int work_should_yield(void)
+{
+	return current_priority == WORK_BACKGROUND
+		&& atomic_load(&queues[WORK_CRITICAL].pending) > 0;
+}
+
+void work_get_stats(struct work_stats *stats)
+{
+	mutex_lock(lock);
+	for(int i = 0; i < WORK_PRIORITIES; i++){
+		stats->pending[i] = queues[i].pending;
+		stats->pending_high[i] = queues[i].pending_high;
+		stats->injected[i] = queues[i].injected;
+	}
+	stats->segments = segment_count;
+	stats->background_running = background_running;
+	stats->queued = 0;
+	stats->stolen = 0;
+	for(int i = 0; i < thread_count; i++){
+		stats->queued += MAX(0, index_diff(workers[i].bottom, workers[i].top));
+		stats->stolen += workers[i].stolen;
+	}
+	mutex_unlock(lock);
 }
 
-void work_dispatch(void (*fp)(void*), void *arg)
+int work_dispatch(void (*fp)(void*), void *arg)
+{
+	return work_dispatch_priority(WORK_NORMAL, fp, arg);
+}
+
+int work_dispatch_priority(int priority, void (*fp)(void*), void *arg)
 {
 	if(running == 0){
 		LOG_ERROR("work_dispatch: worker threads not running");
-		return;
+		return -1;
+	}
+
+	if(priority < 0 || priority >= WORK_PRIORITIES){
+		LOG_ERROR("work_dispatch: invalid priority (%d)", priority);
+		return -1;
+	}
+
+	// worker threads keep the normal work they dispatch on
+	// their own deque (the other workers may still steal it)
+	if(priority == WORK_NORMAL && self != NULL
+			&& deque_push(self, fp, arg) == 0){
+		wake_workers(1);
+		return 0;
 	}
 
 	mutex_lock(lock);
-	if(pending_work >= MAX_WORK){
-		LOG_ERROR("work_dispatch: work ring buffer is at maximum capacity (%d)", MAX_WORK);
+	if(inject_push(&queues[priority], fp, arg) != 0){
+		LOG_ERROR("work_dispatch: failed to grow the injection queue (%d pending work)",
+			queues[priority].pending);
 		mutex_unlock(lock);
-		return;
+		return -1;
 	}
-
-	++pending_work;
-	work_pool[writepos].fp = fp;
-	work_pool[writepos].arg = arg;
-	++writepos;
-	if(writepos >= MAX_WORK)
-		writepos = 0;
-	condvar_signal(cond);
+	if(sleeping > 0)
+		condvar_signal(cond);
 	mutex_unlock(lock);
+	return 0;
 }
 
 
-void work_dispatch_array(int count, int single, struct work *work)
+int work_dispatch_array(int count, int single, struct work *work)
 {
+	int pushed, ret;
+
 	if(running == 0){
 		LOG_ERROR("work_dispatch_array: worker threads not running");
-		return;
+		return -1;
 	}
 
-	mutex_lock(lock);
-	if(pending_work + count >= MAX_WORK){
-		LOG_ERROR("work_dispatch_array: requested amount of work would case the ring buffer to overflow");
-		mutex_unlock(lock);
-		return;
+	// if there is a single work in the array keep
+	// adding it, else advance to the next element
+	pushed = 0;
+	if(self != NULL){
+		while(pushed < count && deque_push(self, work->fp, work->arg) == 0){
+			if(single == 0)
+				work++;
+			pushed++;
+		}
+		if(pushed > 0)
+			wake_workers(pushed);
+		if(pushed >= count)
+			return 0;
+		count -= pushed;
 	}
 
-	pending_work += count;
+	ret = 0;
+	mutex_lock(lock);
 	for(int i = 0; i < count; i++){
-		work_pool[writepos].fp = work->fp;
-		work_pool[writepos].arg = work->arg;
-		// if there is a single work in the array
-		// keep adding it to the work pool, else
-		// advance to the next element
+		if(inject_push(&queues[WORK_NORMAL], work->fp, work->arg) != 0){
+			LOG_ERROR("work_dispatch_array: failed to grow the injection queue (%d work left out)", count - i);
+			ret = -1;
+			break;
+		}
 		if(single == 0)
 			work++;
+	}
+	if(sleeping > 0)
+		condvar_broadcast(cond);
+	mutex_unlock(lock);
+	return ret;
+}
+
+// parallel for: the range is split in chunks that the calling
+// thread and up to one helper per worker take from a shared
+// cursor; each chunk is a share of what's left (and at least
+// grain long) so the chunks start big and get smaller near the
+// end which keeps the executors busy until the range is done;
+// the job is only released by the last one to drop it so helpers
+// that start after the range is done don't touch the caller
+#define PARALLEL_MAX_RANGE	0x3FFFFFFF
+struct parallel_job{
+	atomic_int	refs;
+	atomic_int	executors;
+	atomic_int	next;
+	atomic_int	remaining;
+	int		count;
+	int		slots;
+	long		begin;
+	long		grain;
+	long		size;
+	long		stride;
+	void		(*fn)(long, long, void*);
+	void		(*reduce_fn)(long, long, void*, void*);
+	void		*ctx;
+	// slots partials of size bytes (one per executor), the
+	// value they start from and which of them were used
+	uint8_t		*partials;
+	uint8_t		*identity;
+	int		*used;
+};
+
+static void parallel_release(struct parallel_job *job)
+{
+	if(atomic_fetch_add(&job->refs, -1) == 1)
+		free(job);
+}
+
+static void parallel_execute(struct parallel_job *job)
+{
+	int slot, n, left, chunk, processed;
+	uint8_t *partial;
+
+	slot = atomic_fetch_add(&job->executors, 1);
+	if(slot >= job->slots)
+		return;
+
+	// the partial is only touched once there is a chunk for
+	// it (the caller may be reading the others by then)
+	partial = job->partials + slot * job->stride;
+	processed = 0;
+	while((n = atomic_load(&job->next)) < job->count){
+		left = job->count - n;
+		chunk = MIN(left, MAX((int)job->grain, left / (2 * job->slots)));
+		if(atomic_compare_exchange(&job->next, n, n + chunk) != n)
+			continue;
+
+		if(processed == 0 && job->size > 0){
+			memcpy(partial, job->identity, job->size);
+			job->used[slot] = 1;
+		}
 
-		writepos++;
-		if(writepos >= MAX_WORK)
-			writepos = 0;
+		if(job->reduce_fn != NULL)
+			job->reduce_fn(job->begin + n, job->begin + n + chunk, partial, job->ctx);
+		else
+			job->fn(job->begin + n, job->begin + n + chunk, job->ctx);
+		processed += chunk;
 	}
-	condvar_broadcast(cond);
+
+	// the partial is complete once the caller sees this
+	// executor's chunks done and the one that finishes
+	// the last chunk wakes it up
+	if(processed > 0 && atomic_fetch_add(&job->remaining, -processed) == processed){
+		mutex_lock(parallel_lock);
+		condvar_broadcast(parallel_done);
+		mutex_unlock(parallel_lock);
+	}
+}
+
+static void parallel_helper(void *arg)
+{
+	struct parallel_job *job = arg;
+	parallel_execute(job);
+	parallel_release(job);
+}
+
+static void parallel_run(long begin, long end, long grain,
+		void (*fn)(long, long, void*),
+		void (*reduce_fn)(long, long, void*, void*),
+		void (*join)(void*, const void*, void*),
+		void *result, long size, void *ctx)
+{
+	struct parallel_job *job;
+	int count, helpers;
+	long stride, used;
+
+	count = (int)(end - begin);
+	grain = MAX(1, grain);
+
+	// the helpers run on the lane of the caller (workers
+	// already running something don't count as helpers; the
+	// chunk count is rounded up without overflowing on a
+	// huge grain)
+	helpers = MIN(thread_count - (self != NULL ? 1 : 0),
+			(int)(count / grain + (count % grain != 0)) - 1);
+	if(running == 0 || helpers <= 0){
+		if(reduce_fn != NULL)
+			reduce_fn(begin, end, result, ctx);
+		else
+			fn(begin, end, ctx);
+		return;
+	}
+
+	// keep the partials aligned
+	stride = (size + 15) & ~15L;
+	used = ((helpers + 1) * sizeof(int) + 15) & ~15L;
+	job = malloc(sizeof(struct parallel_job) + used + (helpers + 2) * stride);
+	if(job == NULL){
+		LOG_ERROR("work_parallel_for: failed to allocate job");
+		return;
+	}
+	job->refs = 1;
+	job->executors = 0;
+	job->next = 0;
+	job->remaining = count;
+	job->count = count;
+	job->slots = helpers + 1;
+	job->begin = begin;
+	job->grain = grain;
+	job->size = size;
+	job->stride = stride;
+	job->fn = fn;
+	job->reduce_fn = reduce_fn;
+	job->ctx = ctx;
+	job->used = (int*)(job + 1);
+	job->partials = (uint8_t*)(job + 1) + used;
+	job->identity = job->partials + job->slots * stride;
+	memset(job->used, 0, job->slots * sizeof(int));
+	if(size > 0)
+		memcpy(job->identity, result, size);
+
+	for(int i = 0; i < helpers; i++){
+		atomic_add(&job->refs, 1);
+		if(work_dispatch_priority(current_priority, parallel_helper, job) != 0){
+			atomic_add(&job->refs, -1);
+			break;
+		}
+	}
+
+	// run chunks here too and sleep until the ones
+	// the helpers are still running are done
+	parallel_execute(job);
+	if(atomic_load(&job->remaining) > 0){
+		mutex_lock(parallel_lock);
+		while(atomic_load(&job->remaining) > 0)
+			condvar_wait(parallel_done, parallel_lock);
+		mutex_unlock(parallel_lock);
+	}
+
+	for(int i = 0; join != NULL && i < job->slots; i++){
+		if(job->used[i] != 0)
+			join(result, job->partials + i * stride, ctx);
+	}
+	parallel_release(job);
+}
+
+void work_parallel_for(long begin, long end, long grain,
+		void (*fn)(long begin, long end, void *ctx), void *ctx)
+{
+	long next;
+
+	// the job cursor is an int so huge ranges run in pieces
+	while(begin < end){
+		next = begin + MIN(end - begin, PARALLEL_MAX_RANGE);
+		parallel_run(begin, next, grain, fn, NULL, NULL, NULL, 0, ctx);
+		begin = next;
+	}
+}
+
+void work_parallel_reduce(long begin, long end, long grain,
+		void (*fn)(long begin, long end, void *partial, void *ctx),
+		void (*join)(void *result, const void *partial, void *ctx),
+		void *result, long size, void *ctx)
+{
+	long next;
+
+	while(begin < end){
+		next = begin + MIN(end - begin, PARALLEL_MAX_RANGE);
+		parallel_run(begin, next, grain, NULL, fn, join, result, size, ctx);
+		begin = next;
+	}
+}
+
+// dispatch through the injection queue so work that reschedules
+// itself from a worker doesn't run ahead of the worker deque
+static int work_requeue(int priority, void (*fp)(void*), void *arg)
+{
+	mutex_lock(lock);
+	if(inject_push(&queues[priority], fp, arg) != 0){
+		mutex_unlock(lock);
+		return -1;
+	}
+	if(sleeping > 0)
+		condvar_signal(cond);
 	mutex_unlock(lock);
+	return 0;
+}
+
+static void strand_release(struct strand *s)
+{
+	mutex_destroy(s->lock);
+	mmblock_xfree(strandblk, s);
+}
+
+static void strand_run(void *arg)
+{
+	struct strand *s = arg;
+	struct strand_work *w;
+	void (*fp)(void*);
+	void *fparg;
+
+	while(1){
+		// run a batch of work and then give the worker
+		// thread back so busy strands don't starve the others
+		for(int i = 0; i < STRAND_BATCH; i++){
+			mutex_lock(s->lock);
+			if((w = s->head) == NULL){
+				// the strand was destroyed while it had work
+				// so it's released by the last one
+				s->scheduled = 0;
+				if(s->destroyed != 0){
+					mutex_unlock(s->lock);
+					strand_release(s);
+				}
+				else{
+					mutex_unlock(s->lock);
+				}
+				return;
+			}
+			s->head = w->next;
+			if(s->head == NULL)
+				s->tail = NULL;
+			mutex_unlock(s->lock);
+
+			fp = w->fp;
+			fparg = w->arg;
+			mmblock_xfree(strand_workblk, w);
+			fp(fparg);
+		}
+
+		// requeue the strand behind the work already queued
+		// (if the injection queue can't grow keep running
+		// the strand on this thread)
+		if(work_requeue(s->priority, strand_run, s) == 0)
+			return;
+	}
+}
+
+int strand_create(struct strand **s)
+{
+	return strand_create_priority(s, WORK_NORMAL);
+}
+
+int strand_create_priority(struct strand **s, int priority)
+{
+	struct strand *strand;
+
+	if(priority < 0 || priority >= WORK_PRIORITIES){
+		LOG_ERROR("strand_create_priority: invalid priority (%d)", priority);
+		return -1;
+	}
+
+	strand = mmblock_xalloc(strandblk);
+	if(strand == NULL){
+		LOG_ERROR("strand_create: strand memory block is at maximum capacity (%d)", MAX_STRANDS);
+		return -1;
+	}
+
+	mutex_create(&strand->lock);
+	strand->head = NULL;
+	strand->tail = NULL;
+	strand->priority = priority;
+	strand->scheduled = 0;
+	strand->destroyed = 0;
+	*s = strand;
+	return 0;
+}
+
+void strand_destroy(struct strand *s)
+{
+	mutex_lock(s->lock);
+	if(s->scheduled != 0){
+		s->destroyed = 1;
+		mutex_unlock(s->lock);
+		return;
+	}
+	mutex_unlock(s->lock);
+	strand_release(s);
 }
 
+int strand_dispatch(struct strand *s, void (*fp)(void*), void *arg)
+{
+	struct strand_work *w;
+
+	w = mmblock_xalloc(strand_workblk);
+	if(w == NULL){
+		LOG_ERROR("strand_dispatch: strand work memory block is at maximum capacity (%d)", MAX_STRAND_WORK);
+		return -1;
+	}
+	w->fp = fp;
+	w->arg = arg;
+	w->next = NULL;
+
+	mutex_lock(s->lock);
+	if(s->tail != NULL)
+		s->tail->next = w;
+	else
+		s->head = w;
+	s->tail = w;
+
+	// only one worker runs the strand at a time
+	if(s->scheduled == 0){
+		if(work_dispatch_priority(s->priority, strand_run, s) != 0){
+			// take the work back (the queue was
+			// empty as the strand wasn't scheduled)
+			s->head = NULL;
+			s->tail = NULL;
+			mutex_unlock(s->lock);
+			mmblock_xfree(strand_workblk, w);
+			return -1;
+		}
+		s->scheduled = 1;
+	}
+	mutex_unlock(s->lock);
+	return 0;
+}
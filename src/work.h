@@ -6,9 +6,78 @@ struct work{
 	void *arg;
 };
 
+// the worker threads have a deque each: normal work dispatched
+// from a worker thread goes to its own deque and runs there first
+// (last in, first out) unless another worker steals it, and work
+// from other threads goes through a shared injection queue in
+// order; the injection queues grow with the pending work so
+// dispatching only fails if they can't be allocated; work_init
+// spawns a worker per cpu minus one
+//
+// priority lanes: workers take critical work first, then normal
+// work and then background work (each lane still gets a turn now
+// and then so none of them starves); background work only runs on
+// a share of the workers (work_set_background_limit, in percent of
+// the workers and at least one) and long background work should
+// check work_should_yield between steps and dispatch the rest of
+// itself again when it returns 1; work_dispatch and
+// work_dispatch_array dispatch normal work
+//
+// the dispatch functions return -1 if the work couldn't be queued
+// (work_dispatch_array may have queued the work before the failure)
+#define WORK_CRITICAL		0
+#define WORK_NORMAL		1
+#define WORK_BACKGROUND		2
+#define WORK_PRIORITIES		3
+
+struct work_stats{
+	long	pending[WORK_PRIORITIES];	// work in each injection queue
+	long	pending_high[WORK_PRIORITIES];	// most work each injection queue held
+	long	injected[WORK_PRIORITIES];	// work dispatched through each injection queue
+	long	queued;				// work in the worker deques
+	long	stolen;				// work taken from another worker deque
+	long	segments;			// injection queue segments allocated
+	long	background_running;		// workers running background work
+};
+
 void work_init(void);
+void work_init_threads(int threads);
 void work_shutdown(void);
-void work_dispatch(void (*fp)(void*), void *arg);
-void work_dispatch_array(int count, int single, struct work *work);
+int work_thread_count(void);
+void work_set_background_limit(int percent);
+int work_should_yield(void);
+void work_get_stats(struct work_stats *stats);
+int work_dispatch(void (*fp)(void*), void *arg);
+int work_dispatch_priority(int priority, void (*fp)(void*), void *arg);
+int work_dispatch_array(int count, int single, struct work *work);
+
+// parallel for: fn runs over consecutive chunks of [begin, end)
+// on the calling thread and on the worker threads (in the lane of
+// the caller) and it returns once the whole range is done; the
+// chunks shrink as the range runs out but are never smaller than
+// grain (unless it's the last one) so grain should be about the
+// amount of items worth a dispatch
+//
+// parallel reduce: the same but each executor has a partial of
+// size bytes that starts as a copy of result (so result must hold
+// the identity value) and fn accumulates the chunk into it; the
+// partials are joined into result on the calling thread
+void work_parallel_for(long begin, long end, long grain,
+		void (*fn)(long begin, long end, void *ctx), void *ctx);
+void work_parallel_reduce(long begin, long end, long grain,
+		void (*fn)(long begin, long end, void *partial, void *ctx),
+		void (*join)(void *result, const void *partial, void *ctx),
+		void *result, long size, void *ctx);
+
+// strands run their work on the worker threads one at a time and
+// in dispatch order (work from different strands still runs in
+// parallel); a strand may be destroyed while it has work running
+// or queued and it's only released after the last one; a strand
+// runs in the lane it was created with (normal by default)
+struct strand;
+int strand_create(struct strand **s);
+int strand_create_priority(struct strand **s, int priority);
+void strand_destroy(struct strand *s);
+int strand_dispatch(struct strand *s, void (*fp)(void*), void *arg);
 
 #endif //WORK_H_
@@ -1,11 +1,17 @@
 #ifndef WORK_GROUP_H_
 #define WORK_GROUP_H_
 
+// the work of a group runs in parallel and the complete routine
+// runs after all of it; a group can only be dispatched again once
+// it completes and the dispatch functions return -1 while it's
+// still running (work_group_dispatch_array too, it has no complete
+// routine but it's tracked like the others) or if the work couldn't
+// be dispatched (see task_graph.h for work with dependencies)
 struct work_group;
 struct work_group *work_group_create();
 void work_group_release(struct work_group *grp);
 void work_group_add(struct work_group *grp, void (*fp)(void*), void *arg);
-void work_group_dispatch(struct work_group *grp, void (*fp)(void*), void *arg);
-void work_group_dispatch_array(struct work_group *grp);
+int work_group_dispatch(struct work_group *grp, void (*fp)(void*), void *arg);
+int work_group_dispatch_array(struct work_group *grp);
 
 #endif //WORK_GROUP_H_
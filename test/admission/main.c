@@ -0,0 +1,176 @@
+#include "../../src/log.h"
+#include "../../src/admission.h"
+#include "../../src/thread.h"
+#include "../../src/system.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// checks the per address limits and then hammers the table
+// from a few threads with many addresses
+
+#define MAX_CONNECTIONS		4
+#define MAX_RATE		8
+#define THREADS			4
+#define ADDRESSES		20000
+#define ROUNDS			20
+
+// addresses with the same probe sequence as the contended one
+// so its slot keeps being taken over while it's being admitted
+#define COLLIDING		32
+#define CONTENDED		0x0400000A
+#define CONTENDED_ROUNDS	200000
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void stress(void *arg)
+{
+	unsigned long base = (unsigned long)arg;
+	unsigned long addr;
+
+	// each thread has its own range of addresses and
+	// releases every connection it was admitted
+	for(int r = 0; r < ROUNDS; r++){
+		for(unsigned long i = 0; i < ADDRESSES; i++){
+			addr = base + i;
+			if(admission_acquire(addr) == 0)
+				admission_release(addr);
+		}
+	}
+}
+
+// same hash as the admission table
+static unsigned slot_of(int addr)
+{
+	return ((unsigned)addr * 2654435761U) >> 19;
+}
+
+static int colliding[COLLIDING];
+
+static void admit_contended(void *arg)
+{
+	for(int r = 0; r < CONTENDED_ROUNDS; r++){
+		if(admission_acquire(CONTENDED) == 0)
+			admission_release(CONTENDED);
+	}
+}
+
+static void admit_colliding(void *arg)
+{
+	unsigned long addr;
+	for(int r = 0; r < CONTENDED_ROUNDS; r++){
+		addr = (unsigned)colliding[r % COLLIDING];
+		if(admission_acquire(addr) == 0)
+			admission_release(addr);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct admission_stats stats;
+	struct thread *thr[THREADS];
+	int accepted, ret, tracked, errors;
+	long start, elapsed, second;
+
+	// concurrent limit: only MAX_CONNECTIONS are admitted
+	// until one of them is released
+	errors = 0;
+	admission_init(MAX_CONNECTIONS, 0);
+	accepted = 0;
+	for(int i = 0; i < MAX_CONNECTIONS * 2; i++){
+		if(admission_acquire(0x0100000A) != -1)
+			accepted++;
+	}
+	admission_release(0x0100000A);
+	ret = admission_acquire(0x0100000A);
+	admission_get_stats(&stats);
+	LOG("concurrent limit: admitted %d of %d (expected %d), after release = %d (expected 0), rejected = %ld",
+		accepted, MAX_CONNECTIONS * 2, MAX_CONNECTIONS, ret, stats.rejected_connections);
+	if(accepted != MAX_CONNECTIONS || ret != 0){
+		LOG_ERROR("concurrent limit is wrong");
+		errors++;
+	}
+
+	// rate limit: only MAX_RATE are admitted on the same second
+	// (this is only checked if the second didn't change)
+	admission_init(0, MAX_RATE);
+	second = sys_get_tick_count() / 1000;
+	accepted = 0;
+	for(int i = 0; i < MAX_RATE * 2; i++){
+		if(admission_acquire(0x0200000A) != -1){
+			admission_release(0x0200000A);
+			accepted++;
+		}
+	}
+	admission_get_stats(&stats);
+	LOG("rate limit: admitted %d of %d (expected %d), rejected = %ld",
+		accepted, MAX_RATE * 2, MAX_RATE, stats.rejected_rate);
+	if(accepted != MAX_RATE && second == sys_get_tick_count() / 1000){
+		LOG_ERROR("rate limit is wrong");
+		errors++;
+	}
+
+	// stress: every address is released so nothing should be
+	// rejected and crowded slots are taken over when stale
+	admission_init(MAX_CONNECTIONS, 0);
+	start = get_nsec();
+	for(long i = 0; i < THREADS; i++)
+		thread_create(&thr[i], stress, (void*)((i + 1) * 0x01000000L));
+	for(long i = 0; i < THREADS; i++){
+		thread_join(thr[i]);
+		thread_release(thr[i]);
+	}
+	elapsed = get_nsec() - start;
+	admission_get_stats(&stats);
+	LOG("stress: %ld admitted (%ld untracked), %ld rejected in %ld msec (%ld nsec per connection)",
+		stats.admitted, stats.untracked, stats.rejected_connections + stats.rejected_rate,
+		elapsed / 1000000, elapsed / (THREADS * ADDRESSES * ROUNDS));
+	if(stats.rejected_connections + stats.rejected_rate != 0){
+		LOG_ERROR("connections were rejected during the stress");
+		errors++;
+	}
+
+	// every slot should be back to zero connections
+	tracked = 0;
+	for(unsigned long i = 0; i < 16; i++){
+		if(admission_acquire(0x0300000A) == 0)
+			tracked++;
+	}
+	LOG("after stress: %d of 16 connections tracked (expected %d)", tracked, MAX_CONNECTIONS);
+	if(tracked != MAX_CONNECTIONS){
+		LOG_ERROR("connections leaked during the stress");
+		errors++;
+	}
+
+	// contended takeover: half the threads admit the same address
+	// while the other half cycle through addresses that crowd its
+	// probe sequence; a connection counted on a slot that was just
+	// taken over would be released from the wrong slot (or from none)
+	tracked = 0;
+	for(int addr = 1; tracked < COLLIDING; addr++){
+		if(addr != CONTENDED && slot_of(addr) == slot_of(CONTENDED))
+			colliding[tracked++] = addr;
+	}
+	admission_init(MAX_CONNECTIONS, 0);
+	for(long i = 0; i < THREADS; i++)
+		thread_create(&thr[i], (i & 1) ? admit_colliding : admit_contended, NULL);
+	for(long i = 0; i < THREADS; i++){
+		thread_join(thr[i]);
+		thread_release(thr[i]);
+	}
+	admission_get_stats(&stats);
+	LOG("contended: %ld admitted (%ld untracked), %ld rejected, %ld unknown releases",
+		stats.admitted, stats.untracked, stats.rejected_connections + stats.rejected_rate,
+		stats.unknown_releases);
+	if(stats.rejected_connections + stats.rejected_rate != 0 || stats.unknown_releases != 0){
+		LOG_ERROR("connections were miscounted during the contended takeover");
+		errors++;
+	}
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,2 @@
+#!/bin/bash
+python ../../configure.py -linux -memnet -test -srcdir ../../src/ -o test $@
@@ -0,0 +1,227 @@
+#include "../../src/log.h"
+#include "../../src/cmdline.h"
+#include "../../src/work.h"
+#include "../../src/timeout.h"
+#include "../../src/network.h"
+#include "../../src/network_mem.h"
+#include "../../src/connection.h"
+#include "../../src/server.h"
+#include "../../src/message.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// sends the same message to every virtual client over the in-memory
+// network backend, first with a copy per recipient and then with a
+// single shared message, and compares the time per recipient; the
+// messages start at the default size so bigger ones are chained
+// (the whole run happens on this thread's net_work loop)
+
+#define TEST_PORT	7171
+#define CLIENT_RDBUF	16384
+#define LISTENER_BATCH	64
+
+#define DEFAULT_CLIENTS	200
+#define DEFAULT_ROUNDS	2000
+#define DEFAULT_SIZE	512
+
+struct client{
+	struct socket	*sock;
+	uint8_t		rdbuf[CLIENT_RDBUF];
+	long		received;
+};
+
+static struct client		*clients;
+static long			client_count;
+static long			error_count = 0;
+static struct socket		*listener;
+static struct socket		*accepted[LISTENER_BATCH];
+static struct connection	**conns;
+static long			conn_count = 0;
+static uint8_t			payload[MESSAGE_MAX_LEN];
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// the server side never receives anything
+static void proto_init(void){}
+static void proto_shutdown(void){}
+static void *handle_create(struct connection *conn){ return conn; }
+static void handle_release(void *handle){}
+static void message_begin(void *handle, struct message *msg){}
+static void message_end(void *handle, struct message *msg){}
+static void on_connect(void *handle){}
+static void on_recv_message(void *handle, struct message *msg){}
+
+static struct protocol protocol_sink = {
+	.name			= "sink",
+	.identifier		= 0x01,
+	.flags			= 0,
+
+	.init			= proto_init,
+	.shutdown		= proto_shutdown,
+
+	.handle_create		= handle_create,
+	.handle_release		= handle_release,
+
+	.message_begin		= message_begin,
+	.message_end		= message_end,
+
+	.on_connect		= on_connect,
+	.on_recv_message	= on_recv_message,
+	.on_recv_first_message	= on_recv_message,
+
+	.next			= NULL,
+};
+
+static void on_accept(struct socket *sock, int error, int count, void *udata)
+{
+	if(error != 0)
+		return;
+
+	for(int i = 0; i < count; i++)
+		connection_accept(accepted[i], &protocol_sink);
+	net_async_accept_batch(listener, accepted, LISTENER_BATCH, on_accept, NULL);
+}
+
+static void on_client_read(struct socket *sock, int error, int transfered, void *udata)
+{
+	struct client *c = udata;
+
+	if(error != 0 || transfered == 0){
+		if(c->sock != NULL)
+			error_count += 1;
+		return;
+	}
+	c->received += transfered;
+	net_async_read_some(c->sock, (char*)c->rdbuf, CLIENT_RDBUF, on_client_read, c);
+}
+
+static void collect(struct connection *conn, void *arg)
+{
+	conns[conn_count++] = conn;
+}
+
+// pumps the network until every client got expected bytes
+static void wait_received(long expected)
+{
+	int done = 0;
+	while(done == 0 && error_count == 0){
+		net_work(0);
+		done = 1;
+		for(long i = 0; i < client_count; i++){
+			if(clients[i].received < expected){
+				done = 0;
+				break;
+			}
+		}
+	}
+}
+
+static long run(long rounds, long size, int shared, long *expected)
+{
+	struct message *msg;
+	long start;
+
+	start = get_nsec();
+	for(long r = 0; r < rounds; r++){
+		if(shared != 0){
+			msg = message_alloc(MESSAGE_BUFFER_LEN);
+			message_add_bytes(msg, payload, size);
+			if(connection_send_shared(conns, (int)conn_count, msg) != conn_count)
+				error_count += 1;
+			message_free(msg);
+		}
+		else{
+			for(long i = 0; i < conn_count; i++){
+				msg = connection_get_output_message(conns[i]);
+				if(msg == NULL){
+					error_count += 1;
+					continue;
+				}
+				message_add_bytes(msg, payload, size);
+				connection_send(conns[i], msg);
+			}
+		}
+
+		*expected += size;
+		wait_received(*expected);
+	}
+	return get_nsec() - start;
+}
+
+int main(int argc, char **argv)
+{
+	long rounds, size, expected, copied, shared;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-clients", &client_count) != 0)
+		client_count = DEFAULT_CLIENTS;
+	if(cmdl_get_long("-rounds", &rounds) != 0)
+		rounds = DEFAULT_ROUNDS;
+	if(cmdl_get_long("-size", &size) != 0)
+		size = DEFAULT_SIZE;
+
+	work_init();
+	timeout_init();
+	net_init(1);
+	message_pool_init();
+	connection_init();
+
+	listener = net_server_socket(TEST_PORT, 0);
+	net_async_accept_batch(listener, accepted, LISTENER_BATCH, on_accept, NULL);
+
+	// connect every client and wait for the server side
+	clients = calloc(client_count, sizeof(struct client));
+	conns = calloc(client_count, sizeof(struct connection*));
+	for(long i = 0; i < client_count; i++){
+		clients[i].sock = net_mem_connect(TEST_PORT);
+		if(clients[i].sock == NULL){
+			LOG_ERROR("failed to connect virtual client #%ld", i);
+			return -1;
+		}
+		net_async_read_some(clients[i].sock, (char*)clients[i].rdbuf,
+				CLIENT_RDBUF, on_client_read, &clients[i]);
+	}
+	while(connection_count() < client_count)
+		net_work(0);
+	connection_foreach(collect, NULL);
+
+	expected = 0;
+	copied = run(rounds, size, 0, &expected);
+	shared = run(rounds, size, 1, &expected);
+	LOG("broadcast: %ld clients, %ld rounds of %ld bytes, errors = %ld",
+		client_count, rounds, size, error_count);
+	LOG("broadcast: copies = %ld msec (%ld nsec per recipient), shared = %ld msec (%ld nsec per recipient)",
+		copied / 1000000, copied / (rounds * client_count),
+		shared / 1000000, shared / (rounds * client_count));
+
+	// close the clients and let the server side release
+	for(long i = 0; i < client_count; i++){
+		net_close(clients[i].sock);
+		clients[i].sock = NULL;
+	}
+	while(connection_count() > 0)
+		net_work(0);
+	net_close(listener);
+	net_work(0);
+
+	connection_shutdown();
+	net_shutdown();
+	timeout_shutdown();
+	work_shutdown();
+	message_pool_shutdown();
+	free(conns);
+	free(clients);
+	if(error_count != 0){
+		LOG_ERROR("broadcast test FAILED (errors = %ld)", error_count);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,206 @@
+#include "../../src/log.h"
+#include "../../src/message.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// encodes and decodes a packet shaped like a creature update with
+// the message_add_*/message_get_* functions and with the inline
+// cursors and compares the time per packet (the decoded fields are
+// checked and summed so the compiler can't drop the work)
+
+#define PACKETS		2000000
+#define PER_MESSAGE	40
+
+// packets encoded on the match check (enough to chain segments)
+#define MATCH_PACKETS	1000
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// [u8 opcode][u32 id][u16 x][u16 y][u8 z][u8 direction]
+// [u16 looktype][u32 health][str name]
+static void encode_functions(struct message *msg, uint32_t i)
+{
+	message_add_byte(msg, 0x6D);
+	message_add_u32(msg, i);
+	message_add_u16(msg, (uint16_t)(1000 + i));
+	message_add_u16(msg, (uint16_t)(2000 - i));
+	message_add_byte(msg, 7);
+	message_add_byte(msg, (uint8_t)(i & 3));
+	message_add_u16(msg, 128);
+	message_add_u32(msg, i * 3);
+	message_add_str(msg, "Demon Skeleton", 14);
+}
+
+static void encode_cursor(struct message_writer *wr, uint32_t i)
+{
+	message_writer_need(wr, 18);
+	message_write_u8(wr, 0x6D);
+	message_write_u32(wr, i);
+	message_write_u16(wr, (uint16_t)(1000 + i));
+	message_write_u16(wr, (uint16_t)(2000 - i));
+	message_write_u8(wr, 7);
+	message_write_u8(wr, (uint8_t)(i & 3));
+	message_write_u16(wr, 128);
+	message_write_u32(wr, i * 3);
+	message_write_str(wr, "Demon Skeleton", 14);
+}
+
+static uint32_t decode_functions(struct message *msg)
+{
+	char name[32];
+	uint32_t sum;
+
+	sum = message_get_byte(msg);
+	sum += message_get_u32(msg);
+	sum += message_get_u16(msg);
+	sum += message_get_u16(msg);
+	sum += message_get_byte(msg);
+	sum += message_get_byte(msg);
+	sum += message_get_u16(msg);
+	sum += message_get_u32(msg);
+	message_get_str(msg, name, sizeof(name));
+	return sum + (uint32_t)name[0];
+}
+
+static uint32_t decode_cursor(struct message_reader *rd)
+{
+	char name[32];
+	uint32_t sum;
+
+	message_reader_need(rd, 18);
+	sum = message_read_u8(rd);
+	sum += message_read_u32(rd);
+	sum += message_read_u16(rd);
+	sum += message_read_u16(rd);
+	sum += message_read_u8(rd);
+	sum += message_read_u8(rd);
+	sum += message_read_u16(rd);
+	sum += message_read_u32(rd);
+	message_read_str(rd, name, sizeof(name));
+	return sum + (uint32_t)name[0];
+}
+
+// encoded messages have their length set like an input message
+// (body after a u16 frame length) so both readers can decode them
+static void rewind_input(struct message *msg)
+{
+	msg->length = msg->readpos - 2;
+	msg->readpos = 2;
+}
+
+int main(int argc, char **argv)
+{
+	struct message *a, *b;
+	struct message_writer wr;
+	struct message_reader rd;
+	long start, enc_fn, enc_cur, dec_fn, dec_cur;
+	int ret;
+	uint32_t sum_fn, sum_cur;
+	int errors, failed, match;
+
+	message_pool_init();
+	a = message_alloc(MESSAGE_BUFFER_LEN);
+	b = message_alloc(MESSAGE_BUFFER_LEN);
+
+	// both encoders must produce the same bytes
+	// (including what goes to the chained segments)
+	a->readpos = 2;
+	b->readpos = 2;
+	message_writer_init(&wr, b);
+	for(uint32_t i = 0; i < MATCH_PACKETS; i++){
+		encode_functions(a, i);
+		encode_cursor(&wr, i);
+	}
+	failed = (message_writer_done(&wr) != 0);
+	match = (a->length == b->length && message_checksum(a, 2, a->length)
+			== message_checksum(b, 2, b->length));
+	LOG("codec: encoders %s (%ld and %ld bytes)",
+		match ? "match" : "DIFFER", a->length, b->length);
+	failed += (match == 0);
+
+	// a truncated message fails on the cursor without reading past it
+	rewind_input(b);
+	b->length = 20;
+	message_reader_init(&rd, b);
+	decode_cursor(&rd);
+	decode_cursor(&rd);
+	LOG("codec: truncated read error = %d (expected 1)", rd.error);
+	failed += (rd.error != 1);
+
+	// a group bigger than the stage fails the writer once the
+	// first buffer is full instead of being staged
+	b->readpos = b->capacity;
+	b->length = b->capacity - 2;
+	message_writer_init(&wr, b);
+	ret = message_writer_need(&wr, MESSAGE_GROUP_MAX + 1);
+	LOG("codec: oversize group need = %d (expected 0), done = %d (expected -1)",
+		ret, message_writer_done(&wr));
+	failed += (ret != 0 || message_writer_done(&wr) != -1);
+	b->flags = 0;
+
+	start = get_nsec();
+	for(uint32_t i = 0; i < PACKETS; i += PER_MESSAGE){
+		a->readpos = 2;
+		a->length = 0;
+		for(uint32_t j = 0; j < PER_MESSAGE; j++)
+			encode_functions(a, i + j);
+	}
+	enc_fn = get_nsec() - start;
+
+	start = get_nsec();
+	errors = 0;
+	for(uint32_t i = 0; i < PACKETS; i += PER_MESSAGE){
+		b->readpos = 2;
+		b->length = 0;
+		message_writer_init(&wr, b);
+		for(uint32_t j = 0; j < PER_MESSAGE; j++)
+			encode_cursor(&wr, i + j);
+		errors += (message_writer_done(&wr) != 0);
+	}
+	enc_cur = get_nsec() - start;
+
+	start = get_nsec();
+	sum_fn = 0;
+	for(uint32_t i = 0; i < PACKETS; i += PER_MESSAGE){
+		a->readpos = 2;
+		for(uint32_t j = 0; j < PER_MESSAGE; j++)
+			sum_fn += decode_functions(a);
+	}
+	dec_fn = get_nsec() - start;
+
+	rewind_input(b);
+	start = get_nsec();
+	sum_cur = 0;
+	for(uint32_t i = 0; i < PACKETS; i += PER_MESSAGE){
+		message_reader_init(&rd, b);
+		for(uint32_t j = 0; j < PER_MESSAGE; j++)
+			sum_cur += decode_cursor(&rd);
+		errors += rd.error;
+	}
+	dec_cur = get_nsec() - start;
+
+	LOG("codec: %d packets, sums %s, errors = %d", PACKETS,
+		sum_fn == sum_cur ? "match" : "DIFFER", errors);
+	failed += (sum_fn != sum_cur || errors != 0);
+	LOG("codec: encode functions = %.1f nsec, cursor = %.1f nsec per packet",
+		(double)enc_fn / PACKETS, (double)enc_cur / PACKETS);
+	LOG("codec: decode functions = %.1f nsec, cursor = %.1f nsec per packet",
+		(double)dec_fn / PACKETS, (double)dec_cur / PACKETS);
+
+	message_free(a);
+	message_free(b);
+	message_pool_shutdown();
+	if(failed != 0){
+		LOG_ERROR("codec test FAILED");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,313 @@
+#include "../../src/log.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+#include "../../src/work.h"
+#include "../../src/scheduler.h"
+#include "../../src/timeout.h"
+#include "../../src/network.h"
+#include "../../src/network_mem.h"
+#include "../../src/connection.h"
+#include "../../src/server.h"
+#include "../../src/message.h"
+#include "../../src/util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// drives connection.c with virtual clients over the in-memory
+// network backend: every client sends a request, waits for the
+// echo and sends the next one until it has sent -messages=N
+// (the whole run happens on this thread's net_work loop)
+
+#define TEST_PORT	7171
+#define PROTOCOL_ID	0x01
+#define PAYLOAD		"the quick brown fox jumps over the lazy dog"
+#define CLIENT_RDBUF	1024
+
+#define DEFAULT_CLIENTS		400
+#define DEFAULT_MESSAGES	1000
+#define LISTENER_BATCH		64
+
+struct client{
+	struct socket	*sock;
+	uint8_t		frame[64];
+	int		frame_len;
+	uint8_t		rdbuf[CLIENT_RDBUF];
+	int		rdlen;
+	long		received;
+};
+
+static struct client	*clients;
+static long		client_count;
+static long		message_count;
+static long		done_count = 0;
+static long		error_count = 0;
+static struct socket	*listener;
+static struct socket	*accepted[LISTENER_BATCH];
+
+// count every allocation made by the process
+// (glibc exports the real allocator under these names
+// and the address sanitizer has its own allocator)
+static atomic_int	alloc_count = 0;
+#ifndef __SANITIZE_ADDRESS__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	atomic_add(&alloc_count, 1);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+	atomic_add(&alloc_count, 1);
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	atomic_add(&alloc_count, 1);
+	return __libc_realloc(ptr, size);
+}
+#endif
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// echo protocol
+static void proto_init(void){}
+static void proto_shutdown(void){}
+static void *handle_create(struct connection *conn){ return conn; }
+static void handle_release(void *handle){}
+static void on_connect(void *handle){}
+
+static void message_begin(void *handle, struct message *msg)
+{
+	msg->length = 0;
+	msg->readpos = 6;
+}
+
+static void message_end(void *handle, struct message *msg)
+{
+	msg->readpos = 2;
+	message_add_u32(msg, (uint32_t)adler32(msg->buffer+6, msg->length));
+	msg->readpos = 0;
+	message_add_u16(msg, (uint16_t)msg->length);
+}
+
+static void on_recv_message(void *handle, struct message *msg)
+{
+	char buf[64];
+	struct connection *conn = handle;
+	struct message *out;
+
+	message_get_str(msg, buf, sizeof(buf));
+	out = connection_get_output_message(conn);
+	if(out == NULL){
+		error_count += 1;
+		return;
+	}
+	message_begin(conn, out);
+	message_add_str(out, buf, (uint16_t)strlen(buf));
+	message_end(conn, out);
+	connection_send(conn, out);
+}
+
+static void on_recv_first_message(void *handle, struct message *msg)
+{
+	message_get_byte(msg);
+	on_recv_message(handle, msg);
+}
+
+static struct protocol protocol_echo = {
+	.name			= "echo",
+	.identifier		= PROTOCOL_ID,
+	.flags			= 0,
+
+	.init			= proto_init,
+	.shutdown		= proto_shutdown,
+
+	.handle_create		= handle_create,
+	.handle_release		= handle_release,
+
+	.message_begin		= message_begin,
+	.message_end		= message_end,
+
+	.on_connect		= on_connect,
+	.on_recv_message	= on_recv_message,
+	.on_recv_first_message	= on_recv_first_message,
+
+	.next			= NULL,
+};
+
+// server side
+static void on_accept(struct socket *sock, int error, int count, void *udata)
+{
+	if(error != 0)
+		return;
+
+	for(int i = 0; i < count; i++)
+		connection_accept(accepted[i], &protocol_echo);
+	net_async_accept_batch(listener, accepted, LISTENER_BATCH, on_accept, NULL);
+}
+
+// client side
+static void put_u16(uint8_t *p, uint16_t val)
+{
+	p[0] = (uint8_t)(val >> 8);
+	p[1] = (uint8_t)val;
+}
+
+static void put_u32(uint8_t *p, uint32_t val)
+{
+	p[0] = (uint8_t)(val >> 24);
+	p[1] = (uint8_t)(val >> 16);
+	p[2] = (uint8_t)(val >> 8);
+	p[3] = (uint8_t)val;
+}
+
+// [u16 length][u32 adler32][protocol id (first only)][u16 + payload]
+static void build_frame(struct client *c, int first)
+{
+	uint8_t *body = c->frame + 6;
+	int len = 0;
+
+	if(first != 0)
+		body[len++] = PROTOCOL_ID;
+	put_u16(body + len, sizeof(PAYLOAD) - 1);
+	memcpy(body + len + 2, PAYLOAD, sizeof(PAYLOAD) - 1);
+	len += 2 + sizeof(PAYLOAD) - 1;
+
+	put_u16(c->frame, (uint16_t)(len + 4));
+	put_u32(c->frame + 2, (uint32_t)adler32(body, len));
+	c->frame_len = len + 6;
+}
+
+static void on_client_write(struct socket *sock, int error, int transfered, void *udata)
+{
+	if(error != 0)
+		error_count += 1;
+}
+
+static void on_client_read(struct socket *sock, int error, int transfered, void *udata)
+{
+	struct client *c = udata;
+	int pos, len;
+
+	if(error != 0 || transfered == 0){
+		error_count += 1;
+		done_count += 1;
+		return;
+	}
+
+	// consume every complete echo frame
+	c->rdlen += transfered;
+	pos = 0;
+	while(c->rdlen - pos >= 2){
+		len = ((int)c->rdbuf[pos] << 8 | c->rdbuf[pos+1]) + 2;
+		if(c->rdlen - pos < len)
+			break;
+		pos += len;
+		c->received += 1;
+	}
+	memmove(c->rdbuf, c->rdbuf + pos, c->rdlen - pos);
+	c->rdlen -= pos;
+
+	if(c->received >= message_count){
+		done_count += 1;
+		net_close(c->sock);
+		c->sock = NULL;
+		return;
+	}
+
+	// one request in flight per client
+	if(pos > 0){
+		build_frame(c, 0);
+		net_async_write(c->sock, (char*)c->frame, c->frame_len, on_client_write, c);
+	}
+	net_async_read_some(c->sock, (char*)c->rdbuf + c->rdlen,
+			CLIENT_RDBUF - c->rdlen, on_client_read, c);
+}
+
+int main(int argc, char **argv)
+{
+	long start, elapsed, allocs, total;
+	struct client *c;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-clients", &client_count) != 0)
+		client_count = DEFAULT_CLIENTS;
+	if(cmdl_get_long("-messages", &message_count) != 0)
+		message_count = DEFAULT_MESSAGES;
+
+	work_init();
+	scheduler_init();
+	timeout_init();
+	net_init(1);
+	message_pool_init();
+	connection_init();
+
+	listener = net_server_socket(TEST_PORT, 0);
+	net_async_accept_batch(listener, accepted, LISTENER_BATCH, on_accept, NULL);
+
+	clients = calloc(client_count, sizeof(struct client));
+	allocs = alloc_count;
+	start = get_nsec();
+
+	// connect every client and send the first request
+	for(long i = 0; i < client_count; i++){
+		c = &clients[i];
+		c->sock = net_mem_connect(TEST_PORT);
+		if(c->sock == NULL){
+			LOG_ERROR("failed to connect virtual client #%ld", i);
+			return -1;
+		}
+		build_frame(c, 1);
+		net_async_write(c->sock, (char*)c->frame, c->frame_len, on_client_write, c);
+		net_async_read_some(c->sock, (char*)c->rdbuf, CLIENT_RDBUF, on_client_read, c);
+	}
+
+	while(done_count < client_count)
+		net_work(0);
+	elapsed = get_nsec() - start;
+	allocs = alloc_count - allocs;
+
+	total = 0;
+	for(long i = 0; i < client_count; i++)
+		total += clients[i].received;
+
+	LOG("memnet: %ld clients, %ld messages echoed in %ld msec (%ld msg/sec), errors = %ld",
+		client_count, total, elapsed / 1000000,
+		(long)(total * 1000000000.0 / elapsed), error_count);
+	LOG("memnet: %ld allocations (%.3f per message, %.3f per connection)",
+		allocs, (double)allocs / total, (double)allocs / client_count);
+
+	// let the server side see the end of stream
+	// and release every connection
+	for(int i = 0; i < 4; i++)
+		net_work(0);
+	net_close(listener);
+	net_work(0);
+
+	connection_shutdown();
+	net_shutdown();
+	timeout_shutdown();
+	scheduler_shutdown();
+	work_shutdown();
+	message_pool_shutdown();
+	free(clients);
+	if(error_count != 0 || total < client_count * message_count){
+		LOG_ERROR("memnet: %ld of %ld messages echoed, errors = %ld",
+			total, client_count * message_count, error_count);
+		return -1;
+	}
+	return 0;
+}
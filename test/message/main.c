@@ -0,0 +1,243 @@
+#include "../../src/log.h"
+#include "../../src/message.h"
+#include "../../src/thread.h"
+#include "../../src/util.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// checks the message pool size classes, exhaustion and chained
+// messages and then compares borrowing from it on a few threads
+// against malloc (half of the messages are freed by another thread)
+
+#define THREADS			4
+#define BATCH			64
+#define ROUNDS			20000
+#define EXHAUST_SIZE		16384
+#define EXHAUST_MAX		4096
+
+static const long sizes[] = {64, 256, 900, 4096, 12000, 300};
+#define SIZES (long)(sizeof(sizes) / sizeof(sizes[0]))
+
+// messages handed from each thread to the next one
+static struct message	*handoff[THREADS][BATCH];
+static struct mutex	*handoff_lock[THREADS];
+
+// writes a u16, a u32 and a string until the message has about
+// len bytes and checks the chain holds the same bytes as a flat copy
+// (an overflowed message keeps what was written before it overflowed)
+// returns the number of errors
+static int check_chain(long len, int overflow)
+{
+	static uint8_t flat[MESSAGE_MAX_LEN + 64];
+	struct message *msg, *seg;
+	long pos, n, segments, mismatch;
+	int checksum_ok, errors;
+	uint32_t val;
+	char str[32];
+
+	msg = message_alloc(MESSAGE_BUFFER_LEN);
+	pos = 0;
+	for(val = 0; pos + 32 < len; val++){
+		message_add_u16(msg, (uint16_t)val);
+		flat[pos] = (uint8_t)(val >> 8);
+		flat[pos+1] = (uint8_t)val;
+		message_add_u32(msg, val);
+		flat[pos+2] = (uint8_t)(val >> 24);
+		flat[pos+3] = (uint8_t)(val >> 16);
+		flat[pos+4] = (uint8_t)(val >> 8);
+		flat[pos+5] = (uint8_t)val;
+		n = sprintf(str, "string %u", val);
+		message_add_str(msg, str, (uint16_t)n);
+		flat[pos+6] = (uint8_t)(n >> 8);
+		flat[pos+7] = (uint8_t)n;
+		memcpy(flat + pos + 8, str, n);
+		pos += 8 + n;
+	}
+
+	segments = 0;
+	mismatch = 0;
+	n = 0;
+	for(seg = msg; seg != NULL; seg = seg->chain){
+		for(long i = 0; i < seg->capacity && n < msg->length; i++, n++){
+			if(seg->buffer[i] != flat[n])
+				mismatch++;
+		}
+		segments++;
+	}
+	checksum_ok = (message_checksum(msg, 0, msg->length) == (uint32_t)adler32(flat, msg->length));
+	LOG("chain: %ld of %ld bytes in %ld segments, mismatches = %ld, checksum %s, overflow = %ld",
+		msg->length, pos, segments, mismatch, checksum_ok ? "ok" : "WRONG",
+		msg->flags & MESSAGE_OVERFLOW);
+	errors = 0;
+	if(mismatch != 0 || checksum_ok == 0 || msg->readpos != msg->length){
+		LOG_ERROR("check_chain: message doesn't match what was written");
+		errors++;
+	}
+	if(((msg->flags & MESSAGE_OVERFLOW) != 0) != overflow
+			|| (overflow == 0 && msg->length != pos)
+			|| msg->length > MESSAGE_MAX_LEN){
+		LOG_ERROR("check_chain: wrong length or overflow flag");
+		errors++;
+	}
+	message_free(msg);
+	return errors;
+}
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void pool_stress(void *arg)
+{
+	long id = (long)arg;
+	long next = (id + 1) % THREADS;
+	struct message *batch[BATCH];
+
+	for(int r = 0; r < ROUNDS; r++){
+		for(int i = 0; i < BATCH; i++){
+			batch[i] = message_alloc(sizes[(r + i) % SIZES]);
+			if(batch[i] == NULL){
+				LOG_ERROR("pool_stress: allocation failed");
+				return;
+			}
+			batch[i]->buffer[0] = (uint8_t)i;
+		}
+
+		// free the first half here and swap the second half
+		// with whatever the previous thread left for this one
+		for(int i = 0; i < BATCH / 2; i++)
+			message_free(batch[i]);
+		mutex_lock(handoff_lock[next]);
+		for(int i = BATCH / 2; i < BATCH; i++){
+			if(handoff[next][i] != NULL)
+				message_free(handoff[next][i]);
+			handoff[next][i] = batch[i];
+		}
+		mutex_unlock(handoff_lock[next]);
+	}
+}
+
+static void malloc_stress(void *arg)
+{
+	long id = (long)arg;
+	long next = (id + 1) % THREADS;
+	void *batch[BATCH];
+
+	for(int r = 0; r < ROUNDS; r++){
+		for(int i = 0; i < BATCH; i++){
+			batch[i] = malloc(sizes[(r + i) % SIZES]);
+			((uint8_t*)batch[i])[0] = (uint8_t)i;
+		}
+
+		for(int i = 0; i < BATCH / 2; i++)
+			free(batch[i]);
+		mutex_lock(handoff_lock[next]);
+		for(int i = BATCH / 2; i < BATCH; i++){
+			free(handoff[next][i]);
+			handoff[next][i] = batch[i];
+		}
+		mutex_unlock(handoff_lock[next]);
+	}
+}
+
+static long run(void (*fp)(void*), void (*release)(void*))
+{
+	struct thread *thr[THREADS];
+	long start;
+
+	start = get_nsec();
+	for(long i = 0; i < THREADS; i++)
+		thread_create(&thr[i], fp, (void*)i);
+	for(long i = 0; i < THREADS; i++){
+		thread_join(thr[i]);
+		thread_release(thr[i]);
+	}
+	for(int i = 0; i < THREADS; i++){
+		for(int j = 0; j < BATCH; j++){
+			if(handoff[i][j] != NULL)
+				release(handoff[i][j]);
+			handoff[i][j] = NULL;
+		}
+	}
+	return get_nsec() - start;
+}
+
+static void release_message(void *ptr)
+{
+	message_free(ptr);
+}
+
+int main(int argc, char **argv)
+{
+	static struct message *exhaust[EXHAUST_MAX];
+	struct message *msg;
+	long count, again, pool, heap;
+	int errors;
+
+	message_pool_init();
+	for(int i = 0; i < THREADS; i++)
+		mutex_create(&handoff_lock[i]);
+
+	// every size is rounded up to its class and
+	// anything over the biggest one is on the heap
+	errors = 0;
+	for(long size = 1; size <= 20000; size *= 3){
+		msg = message_alloc(size);
+		LOG("size %5ld: capacity = %5ld, class = %ld", size, msg->capacity, msg->size_class);
+		if(msg->capacity < size || (msg->size_class == -1) != (size > 16384)){
+			LOG_ERROR("wrong size class for %ld bytes", size);
+			errors++;
+		}
+		message_free(msg);
+	}
+
+	// messages grow past their buffer and stop at MESSAGE_MAX_LEN
+	// (the last one overflows and keeps only what fit)
+	errors += check_chain(1000, 0);
+	errors += check_chain(60000, 0);
+	errors += check_chain(MESSAGE_MAX_LEN + 32, 1);
+
+	// a class runs out after its slots are borrowed and
+	// it's usable again once they're returned
+	count = 0;
+	while(count < EXHAUST_MAX){
+		exhaust[count] = message_alloc(EXHAUST_SIZE);
+		if(exhaust[count] == NULL)
+			break;
+		count++;
+	}
+	for(long i = 0; i < count; i++)
+		message_free(exhaust[i]);
+	again = 0;
+	while(again < count){
+		exhaust[again] = message_alloc(EXHAUST_SIZE);
+		if(exhaust[again] == NULL)
+			break;
+		again++;
+	}
+	for(long i = 0; i < again; i++)
+		message_free(exhaust[i]);
+	LOG("exhaustion: %ld messages of %d bytes before failing, %ld after returning them",
+		count, EXHAUST_SIZE, again);
+	if(count == 0 || count == EXHAUST_MAX || again != count){
+		LOG_ERROR("exhaustion is wrong");
+		errors++;
+	}
+
+	pool = run(pool_stress, release_message);
+	heap = run(malloc_stress, free);
+	LOG("stress: pool = %ld msec (%ld nsec per message), malloc = %ld msec (%ld nsec per message)",
+		pool / 1000000, pool / (THREADS * ROUNDS * BATCH),
+		heap / 1000000, heap / (THREADS * ROUNDS * BATCH));
+
+	for(int i = 0; i < THREADS; i++)
+		mutex_destroy(handoff_lock[i]);
+	message_pool_shutdown();
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,192 @@
+#include "../../src/log.h"
+#include "../../src/thread.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+// compares the mutex protected deferred list the network
+// backends used to have with the lock-free stack that is
+// taken whole by the consumer with a single exchange
+
+#define PRODUCERS	4
+#define ITEMS		200000
+
+struct node{
+	int		producer;
+	int		seq;
+	struct node	*next;
+};
+
+struct producer{
+	int		id;
+	struct node	*nodes;
+};
+
+static struct node	nodes[PRODUCERS][ITEMS];
+static struct producer	producers[PRODUCERS];
+static int		last_seq[PRODUCERS];
+static int		consumed;
+static int		out_of_order;
+
+// mutex queue
+static struct mutex	*lock;
+static struct node	*head;
+static struct node	*tail;
+
+// lock-free queue
+static atomic_ptr	stack;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void consume(struct node *n)
+{
+	if(n->seq != last_seq[n->producer] + 1)
+		out_of_order++;
+	last_seq[n->producer] = n->seq;
+	consumed++;
+}
+
+static void mutex_producer(void *arg)
+{
+	struct producer *p = arg;
+	struct node *n;
+	int i;
+
+	for(i = 0; i < ITEMS; i++){
+		n = &p->nodes[i];
+		mutex_lock(lock);
+		n->next = NULL;
+		if(tail == NULL){
+			head = n;
+			tail = n;
+		}
+		else{
+			tail->next = n;
+			tail = n;
+		}
+		mutex_unlock(lock);
+	}
+}
+
+static void mutex_consumer(void *unused)
+{
+	struct node *n;
+
+	(void)unused;
+	while(consumed < PRODUCERS * ITEMS){
+		mutex_lock(lock);
+		if((n = head) != NULL){
+			head = n->next;
+			if(head == NULL)
+				tail = NULL;
+		}
+		mutex_unlock(lock);
+		if(n != NULL)
+			consume(n);
+	}
+}
+
+static void lockfree_producer(void *arg)
+{
+	struct producer *p = arg;
+	struct node *n, *top;
+	int i;
+
+	for(i = 0; i < ITEMS; i++){
+		n = &p->nodes[i];
+		do{
+			top = atomic_load_ptr(&stack);
+			n->next = top;
+		} while(atomic_compare_exchange_ptr(&stack, top, n) != top);
+	}
+}
+
+static void lockfree_consumer(void *unused)
+{
+	struct node *n, *next, *list;
+
+	(void)unused;
+	while(consumed < PRODUCERS * ITEMS){
+		if(atomic_load_ptr(&stack) == NULL)
+			continue;
+
+		// take everything and reverse into FIFO order
+		n = atomic_exchange_ptr(&stack, NULL);
+		list = NULL;
+		while(n != NULL){
+			next = n->next;
+			n->next = list;
+			list = n;
+			n = next;
+		}
+
+		while(list != NULL){
+			next = list->next;
+			consume(list);
+			list = next;
+		}
+	}
+}
+
+static int run(const char *name, void (*producer)(void*), void (*consumer)(void*))
+{
+	struct thread *thr[PRODUCERS + 1];
+	long start, elapsed;
+	int i, j;
+
+	for(i = 0; i < PRODUCERS; i++){
+		producers[i].id = i;
+		producers[i].nodes = nodes[i];
+		last_seq[i] = -1;
+		for(j = 0; j < ITEMS; j++){
+			nodes[i][j].producer = i;
+			nodes[i][j].seq = j;
+		}
+	}
+	consumed = 0;
+	out_of_order = 0;
+
+	start = get_nsec();
+	thread_create(&thr[PRODUCERS], consumer, NULL);
+	for(i = 0; i < PRODUCERS; i++)
+		thread_create(&thr[i], producer, &producers[i]);
+	for(i = 0; i <= PRODUCERS; i++){
+		thread_join(thr[i]);
+		thread_release(thr[i]);
+	}
+	elapsed = get_nsec() - start;
+
+	LOG("%s: %d items in %ld usec (%ld nsec/item), out of order = %d",
+		name, consumed, elapsed / 1000,
+		elapsed / consumed, out_of_order);
+	if(consumed != PRODUCERS * ITEMS || out_of_order != 0){
+		LOG_ERROR("%s: consumed %d of %d items, %d out of order",
+			name, consumed, PRODUCERS * ITEMS, out_of_order);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int errors = 0;
+
+	mutex_create(&lock);
+	head = NULL;
+	tail = NULL;
+	if(run("mutex", mutex_producer, mutex_consumer) != 0)
+		errors++;
+	mutex_destroy(lock);
+
+	stack = NULL;
+	if(run("lock-free", lockfree_producer, lockfree_consumer) != 0)
+		errors++;
+	return (errors == 0) ? 0 : 1;
+}
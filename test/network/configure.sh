@@ -0,0 +1,2 @@
+#!/bin/bash
+python ../../configure.py -linux -test -srcdir ../../src/ -o test $@
@@ -0,0 +1,237 @@
+#include "../../src/log.h"
+#include "../../src/network.h"
+#include "../../src/thread.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define TEST_PORT	7199
+#define ROUNDS		10000
+#define IDLE_MSEC	2000
+#define IOV_COUNT	4
+#define IOV_LEN		(256 * 1024)
+#define DEEP_WRITES	64
+#define DEEP_LEN	(16 * 1024)
+#define CORK_WRITES	8
+#define CORK_WAIT_MSEC	50
+
+static volatile int	running = 1;
+static volatile int	completed = 0;
+static volatile int	iov_transfered = 0;
+static volatile int	deep_completed = 0;
+static volatile int	deep_unordered = 0;
+static struct socket	*server = NULL;
+static struct socket	*peer = NULL;
+static char		buffer[64];
+static char		iov_data[IOV_COUNT][IOV_LEN];
+static char		iov_recv[IOV_COUNT * IOV_LEN];
+static char		deep_data[DEEP_WRITES][DEEP_LEN];
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long get_cpu_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void net_thread(void *unused)
+{
+	(void)unused;
+	while(running != 0)
+		net_work(0);
+}
+
+static void on_accept(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)transfered;
+	(void)udata;
+	if(error == 0)
+		peer = sock;
+}
+
+static void on_write(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)sock;
+	(void)error;
+	(void)transfered;
+	(void)udata;
+	completed = 1;
+}
+
+static void on_writev(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)sock;
+	(void)udata;
+	iov_transfered = (error == 0) ? transfered : -1;
+	completed = 1;
+}
+
+static void on_deep_write(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)sock;
+	(void)transfered;
+	if(error != 0 || (long)udata != deep_completed)
+		deep_unordered++;
+	deep_completed++;
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *thr;
+	struct timespec idle;
+	struct sockaddr_in addr;
+	struct net_buf bufs[IOV_COUNT];
+	long start, cpu, elapsed, total, worst;
+	int fd, i, j, ret, mismatch, failed, held, errors;
+
+	errors = 0;
+	net_init(1);
+	server = net_server_socket(TEST_PORT, 0);
+	net_async_accept(server, on_accept, NULL);
+	thread_create(&thr, net_thread, NULL);
+
+	// connect client with a plain blocking socket
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1){
+		LOG_ERROR("failed to connect test client");
+		return -1;
+	}
+	while(peer == NULL);
+
+	// idle test: the network thread has nothing to do
+	// so it should be blocked on epoll_wait
+	idle.tv_sec = IDLE_MSEC / 1000;
+	idle.tv_nsec = (IDLE_MSEC % 1000) * 1000000;
+	cpu = get_cpu_usec();
+	nanosleep(&idle, NULL);
+	cpu = get_cpu_usec() - cpu;
+	LOG("idle: %ld usec of cpu time in %d msec (%.2f%%)",
+		cpu, IDLE_MSEC, (cpu / 10.0) / IDLE_MSEC);
+
+	// latency test: writes issued from this thread complete
+	// synchronously and are deferred to the network thread
+	total = 0;
+	worst = 0;
+	for(i = 0; i < ROUNDS; i++){
+		completed = 0;
+		start = get_nsec();
+		net_async_write(peer, buffer, sizeof(buffer), on_write, NULL);
+		while(completed == 0);
+		elapsed = get_nsec() - start;
+		total += elapsed;
+		if(elapsed > worst)
+			worst = elapsed;
+
+		// drain client side
+		recv(fd, buffer, sizeof(buffer), MSG_WAITALL);
+	}
+	LOG("deferred completion: avg = %ld nsec, worst = %ld nsec (%d rounds)",
+		total / ROUNDS, worst, ROUNDS);
+
+	// vectored write test: the buffers are bigger than the socket
+	// send buffer so the write must resume across buffer boundaries
+	for(i = 0; i < IOV_COUNT; i++){
+		for(j = 0; j < IOV_LEN; j++)
+			iov_data[i][j] = (char)(i * 31 + j);
+		bufs[i].buf = iov_data[i];
+		bufs[i].len = IOV_LEN;
+	}
+	completed = 0;
+	net_async_writev(peer, bufs, IOV_COUNT, on_writev, NULL);
+	total = 0;
+	while(total < IOV_COUNT * IOV_LEN){
+		ret = recv(fd, iov_recv + total, IOV_COUNT * IOV_LEN - total, 0);
+		if(ret <= 0)
+			break;
+		total += ret;
+	}
+	while(completed == 0);
+	mismatch = 0;
+	for(i = 0; i < IOV_COUNT; i++){
+		if(memcmp(iov_recv + i * IOV_LEN, iov_data[i], IOV_LEN) != 0)
+			mismatch++;
+	}
+	LOG("vectored write: transfered = %d, received = %ld (expected %d), mismatched buffers = %d",
+		iov_transfered, total, IOV_COUNT * IOV_LEN, mismatch);
+	if(iov_transfered != IOV_COUNT * IOV_LEN || total != IOV_COUNT * IOV_LEN || mismatch != 0){
+		LOG_ERROR("vectored write is wrong");
+		errors++;
+	}
+
+	// deep write queue test: queue more writes than the socket
+	// has inline operation slots before the client reads anything
+	failed = 0;
+	for(i = 0; i < DEEP_WRITES; i++){
+		memset(deep_data[i], i, DEEP_LEN);
+		if(net_async_write(peer, deep_data[i], DEEP_LEN, on_deep_write, (void*)(long)i) != 0)
+			failed++;
+	}
+	total = 0;
+	mismatch = 0;
+	while(total < DEEP_WRITES * DEEP_LEN){
+		ret = recv(fd, iov_recv, DEEP_LEN, MSG_WAITALL);
+		if(ret <= 0)
+			break;
+		if(memcmp(iov_recv, deep_data[total / DEEP_LEN], ret) != 0)
+			mismatch++;
+		total += ret;
+	}
+	while(deep_completed < DEEP_WRITES - failed);
+	LOG("deep write queue: queued = %d, failed = %d, completed out of order = %d, received = %ld (expected %d), mismatched writes = %d",
+		DEEP_WRITES, failed, deep_unordered, total, DEEP_WRITES * DEEP_LEN, mismatch);
+	if(failed != 0 || deep_unordered != 0 || total != DEEP_WRITES * DEEP_LEN || mismatch != 0){
+		LOG_ERROR("deep write queue is wrong");
+		errors++;
+	}
+
+	// cork test: small writes on a corked socket are held by the
+	// kernel until it's uncorked and then arrive all at once (the
+	// kernel sends them anyway after 200ms so the wait is shorter)
+	net_socket_cork(peer, 1);
+	for(i = 0; i < CORK_WRITES; i++){
+		completed = 0;
+		net_async_write(peer, buffer, sizeof(buffer), on_write, NULL);
+		while(completed == 0);
+	}
+	idle.tv_sec = 0;
+	idle.tv_nsec = CORK_WAIT_MSEC * 1000000;
+	nanosleep(&idle, NULL);
+	held = (recv(fd, iov_recv, sizeof(iov_recv), MSG_DONTWAIT | MSG_PEEK) == -1);
+	start = get_nsec();
+	net_socket_cork(peer, 0);
+	total = recv(fd, iov_recv, CORK_WRITES * sizeof(buffer), MSG_WAITALL);
+	elapsed = get_nsec() - start;
+	LOG("cork: held while corked = %d, received = %ld (expected %d) %ld nsec after flush",
+		held, total, CORK_WRITES * (int)sizeof(buffer), elapsed);
+	if(total != CORK_WRITES * (int)sizeof(buffer)){
+		LOG_ERROR("corked writes were lost");
+		errors++;
+	}
+
+	// cleanup
+	running = 0;
+	close(fd);
+	thread_join(thr);
+	thread_release(thr);
+	net_close(peer);
+	net_close(server);
+	net_work(0);
+	net_shutdown();
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,174 @@
+#include "../../src/log.h"
+#include "../../src/work.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// updates an array of creatures ROUNDS times serially, with a
+// dispatch per creature (work_dispatch_array) and with
+// work_parallel_for, sums their health with work_parallel_reduce
+// and runs the parallel for from a worker thread too; every
+// update is counted so a creature visited twice (or never) shows
+
+#define CREATURES	100000
+#define ROUNDS		20
+#define GRAIN		256
+#define SPIN		20
+
+struct creature{
+	long		x;
+	long		y;
+	long		health;
+	atomic_int	visits;
+};
+
+static struct creature	creatures[CREATURES];
+static struct work	per_item[CREATURES];
+static atomic_int	items_done = 0;
+static atomic_int	nested_done = 0;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void update(struct creature *c)
+{
+	long x = c->x;
+	for(int i = 0; i < SPIN; i++)
+		x = (x * 31 + c->y) & 0xFFFF;
+	c->x = x;
+	c->health = (c->health + x) & 0xFF;
+	atomic_add(&c->visits, 1);
+}
+
+static void update_item(void *arg)
+{
+	update(arg);
+	atomic_add(&items_done, 1);
+}
+
+static void update_range(long begin, long end, void *ctx)
+{
+	for(long i = begin; i < end; i++)
+		update(&creatures[i]);
+}
+
+static void sum_range(long begin, long end, void *partial, void *ctx)
+{
+	long *sum = partial;
+	for(long i = begin; i < end; i++)
+		*sum += creatures[i].health;
+}
+
+static void sum_join(void *result, const void *partial, void *ctx)
+{
+	*(long*)result += *(const long*)partial;
+}
+
+static void nested(void *arg)
+{
+	work_parallel_for(0, CREATURES, GRAIN, update_range, NULL);
+	atomic_add(&nested_done, 1);
+}
+
+// returns how many creatures weren't visited expected times
+static long check_visits(int expected)
+{
+	long wrong = 0;
+	for(long i = 0; i < CREATURES; i++){
+		if(creatures[i].visits != expected)
+			wrong++;
+		creatures[i].visits = 0;
+	}
+	return wrong;
+}
+
+int main(int argc, char **argv)
+{
+	struct work_stats stats;
+	long threads, start, serial, dispatch, parallel, wrong, sum, expected;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-threads", &threads) != 0)
+		threads = 0;
+
+	work_init_threads((int)threads);
+	for(long i = 0; i < CREATURES; i++){
+		creatures[i].x = i;
+		creatures[i].y = i * 7;
+		creatures[i].health = 100;
+		creatures[i].visits = 0;
+		per_item[i].fp = update_item;
+		per_item[i].arg = &creatures[i];
+	}
+
+	start = get_nsec();
+	for(int r = 0; r < ROUNDS; r++)
+		update_range(0, CREATURES, NULL);
+	serial = get_nsec() - start;
+	wrong = check_visits(ROUNDS);
+
+	start = get_nsec();
+	for(int r = 0; r < ROUNDS; r++){
+		items_done = 0;
+		if(work_dispatch_array(CREATURES, 0, per_item) != 0){
+			LOG_ERROR("parallel_for: failed to dispatch the creatures");
+			work_shutdown();
+			return 1;
+		}
+		while(atomic_load(&items_done) < CREATURES)
+			sched_yield();
+	}
+	dispatch = get_nsec() - start;
+	wrong += check_visits(ROUNDS);
+
+	start = get_nsec();
+	for(int r = 0; r < ROUNDS; r++)
+		work_parallel_for(0, CREATURES, GRAIN, update_range, NULL);
+	parallel = get_nsec() - start;
+	wrong += check_visits(ROUNDS);
+
+	// from a worker thread the caller is one of the executors
+	work_dispatch(nested, NULL);
+	while(atomic_load(&nested_done) < 1)
+		sched_yield();
+	wrong += check_visits(1);
+
+	// a grain bigger than any range runs it in one piece
+	work_parallel_for(0, CREATURES, LONG_MAX, update_range, NULL);
+	wrong += check_visits(1);
+
+	expected = 0;
+	sum_range(0, CREATURES, &expected, NULL);
+	sum = 0;
+	work_parallel_reduce(0, CREATURES, GRAIN, sum_range, sum_join, &sum, sizeof(sum), NULL);
+
+	LOG("parallel_for: %d creatures x %d rounds on %d workers, wrong visits = %ld, reduce %s (%ld)",
+		CREATURES, ROUNDS, work_thread_count(), wrong, sum == expected ? "ok" : "WRONG", sum);
+	LOG("parallel_for: serial = %ld msec, dispatch per item = %ld msec (%ld nsec per item),"
+		" parallel for = %ld msec (%ld nsec per item)",
+		serial / 1000000, dispatch / 1000000, dispatch / (ROUNDS * CREATURES),
+		parallel / 1000000, parallel / (ROUNDS * CREATURES));
+
+	// helpers that start after their range is done only drop
+	// the job so let them run before the queued work is dropped
+	do{
+		sched_yield();
+		work_get_stats(&stats);
+	}while(stats.pending[WORK_NORMAL] + stats.queued > 0);
+	work_shutdown();
+
+	if(wrong != 0 || sum != expected){
+		LOG_ERROR("parallel_for test FAILED");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,109 @@
+#include "../../src/log.h"
+#include "../../src/work.h"
+#include "../../src/thread.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// dispatches JOBS work items on each of STRANDS strands from two
+// threads (each strand has a single producer) and checks that the
+// work of a strand runs in dispatch order and never concurrently;
+// the strands are destroyed right after their last dispatch
+
+#define STRANDS		64
+#define JOBS		2000
+#define MAX_PENDING	8192
+
+struct job{
+	long	strand;
+	long	seq;
+};
+
+static struct strand	*strands[STRANDS];
+static atomic_int	busy[STRANDS];
+static long		next_seq[STRANDS];
+static struct job	jobs[STRANDS][JOBS];
+static atomic_int	dispatched = 0;
+static atomic_int	done = 0;
+static atomic_int	overlapped = 0;
+static atomic_int	unordered = 0;
+static atomic_int	retries = 0;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void job_handler(void *arg)
+{
+	struct job *job = arg;
+
+	if(atomic_exchange(&busy[job->strand], 1) != 0)
+		atomic_add(&overlapped, 1);
+	if(next_seq[job->strand] != job->seq)
+		atomic_add(&unordered, 1);
+	next_seq[job->strand] = job->seq + 1;
+	atomic_store(&busy[job->strand], 0);
+	atomic_add(&done, 1);
+}
+
+static void producer(void *arg)
+{
+	long first = (long)arg;
+	for(long j = 0; j < JOBS; j++){
+		for(long i = first; i < STRANDS; i += 2){
+			// keep the pending work below the strand work pool
+			// capacity (it may still be exhausted for a moment)
+			while(atomic_load(&dispatched) - atomic_load(&done) >= MAX_PENDING)
+				sched_yield();
+			atomic_add(&dispatched, 1);
+			while(strand_dispatch(strands[i], job_handler, &jobs[i][j]) != 0){
+				atomic_add(&retries, 1);
+				sched_yield();
+			}
+		}
+	}
+	for(long i = first; i < STRANDS; i += 2)
+		strand_destroy(strands[i]);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *thr;
+	long start, elapsed;
+
+	work_init();
+	for(long i = 0; i < STRANDS; i++){
+		strand_create(&strands[i]);
+		busy[i] = 0;
+		next_seq[i] = 0;
+		for(long j = 0; j < JOBS; j++){
+			jobs[i][j].strand = i;
+			jobs[i][j].seq = j;
+		}
+	}
+
+	start = get_nsec();
+	thread_create(&thr, producer, (void*)1);
+	producer((void*)0);
+	thread_join(thr);
+	thread_release(thr);
+	while(atomic_load(&done) < STRANDS * JOBS)
+		sched_yield();
+	elapsed = get_nsec() - start;
+
+	LOG("strand: %d jobs on %d strands in %ld msec, out of order = %d, overlapped = %d, dispatch retries = %d",
+		STRANDS * JOBS, STRANDS, elapsed / 1000000, unordered, overlapped, retries);
+
+	work_shutdown();
+	if(unordered != 0 || overlapped != 0){
+		LOG_ERROR("strand test FAILED");
+		return -1;
+	}
+	return 0;
+}
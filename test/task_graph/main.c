@@ -0,0 +1,230 @@
+#include "../../src/log.h"
+#include "../../src/work.h"
+#include "../../src/task_graph.h"
+#include "../../src/work_group.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// runs a game tick shaped graph TICKS times: every sector goes
+// through input -> ai -> movement -> visibility -> encode, the
+// visibility of a sector also waits for the movement of its
+// neighbours and a single flush waits for every encode (so a
+// sector may be encoding while another is still in ai); each
+// stage checks the stages it depends on already ran this tick
+//
+// the tick graph also has a nested graph with FANOUT tasks that
+// a fan-in task waits for, a graph with a cycle is refused and a
+// work group can't be dispatched again while it's running
+
+#define SECTORS		64
+#define STAGES		5
+#define TICKS		2000
+#define FANOUT		1000
+#define SPIN		2000
+
+struct stage{
+	int	sector;
+	int	stage;
+};
+
+static struct stage	stages[SECTORS][STAGES];
+static atomic_int	stamp[SECTORS][STAGES];
+static atomic_int	fanout_done;
+static atomic_int	errors = 0;
+static atomic_int	ticks_done = 0;
+static atomic_int	overlapped = 0;
+static atomic_int	gate = 0;
+static atomic_int	group_done = 0;
+static int		tick;
+static volatile long	sink;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int done_this_tick(int sector, int stage)
+{
+	return atomic_load(&stamp[sector][stage]) == tick;
+}
+
+static void run_stage(void *arg)
+{
+	struct stage *s = arg;
+	long x = s->sector;
+
+	if(s->stage > 0 && !done_this_tick(s->sector, s->stage - 1))
+		atomic_add(&errors, 1);
+	if(s->stage == 3){
+		if((s->sector > 0 && !done_this_tick(s->sector - 1, 2))
+				|| (s->sector < SECTORS - 1 && !done_this_tick(s->sector + 1, 2)))
+			atomic_add(&errors, 1);
+	}
+
+	// some sector is still in an earlier stage
+	if(s->stage == 4){
+		for(int i = 0; i < SECTORS; i++){
+			if(!done_this_tick(i, 0)){
+				atomic_add(&overlapped, 1);
+				break;
+			}
+		}
+	}
+
+	for(int i = 0; i < SPIN; i++)
+		x = x * 31 + i;
+	sink = x;
+	atomic_store(&stamp[s->sector][s->stage], tick);
+}
+
+static void fanout_task(void *arg)
+{
+	atomic_add(&fanout_done, 1);
+}
+
+static void fanin_task(void *arg)
+{
+	if(atomic_load(&fanout_done) != FANOUT)
+		atomic_add(&errors, 1);
+}
+
+static void flush(void *arg)
+{
+	for(int i = 0; i < SECTORS; i++){
+		if(!done_this_tick(i, STAGES - 1))
+			atomic_add(&errors, 1);
+	}
+}
+
+static void tick_complete(void *arg)
+{
+	atomic_add(&ticks_done, 1);
+}
+
+static void nop(void *arg){}
+
+static void gate_task(void *arg)
+{
+	while(atomic_load(&gate) == 0)
+		sched_yield();
+}
+
+static void group_complete(void *arg)
+{
+	atomic_store(&group_done, 1);
+}
+
+// returns 0 if the second dispatch of a running group fails
+// and the group can be dispatched again once it completes
+static int check_group(void)
+{
+	struct work_group *grp;
+	int first, second, again;
+
+	grp = work_group_create();
+	work_group_add(grp, gate_task, NULL);
+	work_group_add(grp, nop, NULL);
+	gate = 0;
+	group_done = 0;
+	first = work_group_dispatch(grp, group_complete, NULL);
+	second = work_group_dispatch_array(grp);
+	atomic_store(&gate, 1);
+	while(first == 0 && atomic_load(&group_done) == 0)
+		sched_yield();
+
+	// the group is done before its complete routine runs
+	group_done = 0;
+	again = work_group_dispatch(grp, group_complete, NULL);
+	while(again == 0 && atomic_load(&group_done) == 0)
+		sched_yield();
+	work_group_release(grp);
+
+	LOG("task_graph: work group dispatch = %d, while running = %d (expected -1), after = %d",
+		first, second, again);
+	return (first == 0 && second == -1 && again == 0) ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct task_graph *g, *child, *cycle;
+	struct task *tasks[SECTORS][STAGES], *flush_task, *fanin, *a, *b;
+	long threads, start, elapsed;
+	int refused, group;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-threads", &threads) != 0)
+		threads = 0;
+	work_init_threads((int)threads);
+
+	g = task_graph_create();
+	flush_task = task_graph_add(g, flush, NULL);
+	for(int i = 0; i < SECTORS; i++){
+		for(int j = 0; j < STAGES; j++){
+			stages[i][j].sector = i;
+			stages[i][j].stage = j;
+			stamp[i][j] = -1;
+			tasks[i][j] = task_graph_add(g, run_stage, &stages[i][j]);
+			if(j > 0)
+				task_graph_depend(tasks[i][j], tasks[i][j - 1]);
+		}
+		task_graph_depend(flush_task, tasks[i][STAGES - 1]);
+	}
+	for(int i = 0; i < SECTORS; i++){
+		if(i > 0)
+			task_graph_depend(tasks[i][3], tasks[i - 1][2]);
+		if(i < SECTORS - 1)
+			task_graph_depend(tasks[i][3], tasks[i + 1][2]);
+	}
+
+	child = task_graph_create();
+	for(int i = 0; i < FANOUT; i++)
+		task_graph_add(child, fanout_task, NULL);
+	fanin = task_graph_add(g, fanin_task, NULL);
+	task_graph_depend(fanin, task_graph_add_graph(g, child));
+	task_graph_depend(flush_task, fanin);
+
+	// the same graph every tick
+	start = get_nsec();
+	for(tick = 0; tick < TICKS; tick++){
+		fanout_done = 0;
+		if(task_graph_dispatch(g, tick_complete, NULL) != 0){
+			atomic_add(&errors, 1);
+			break;
+		}
+		while(atomic_load(&ticks_done) <= tick)
+			sched_yield();
+	}
+	elapsed = get_nsec() - start;
+
+	cycle = task_graph_create();
+	a = task_graph_add(cycle, nop, NULL);
+	b = task_graph_add(cycle, nop, NULL);
+	task_graph_depend(a, b);
+	task_graph_depend(b, a);
+
+	LOG("task_graph: %d ticks of %d tasks on %d workers in %ld msec (%ld usec per tick)",
+		TICKS, SECTORS * STAGES + FANOUT + 3, work_thread_count(),
+		elapsed / 1000000, elapsed / TICKS / 1000);
+	refused = (task_graph_dispatch(cycle, NULL, NULL) != 0);
+	LOG("task_graph: errors = %d, encodes that ran before every input = %d, cycle refused = %s",
+		errors, overlapped, refused ? "yes" : "NO");
+	group = check_group();
+
+	task_graph_release(cycle);
+	task_graph_release(g);
+	task_graph_release(child);
+	work_shutdown();
+
+	if(errors != 0 || refused == 0 || group != 0){
+		LOG_ERROR("task_graph test FAILED");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include "../../src/log.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+#include "../../src/work.h"
+#include "../../src/scheduler.h"
+#include "../../src/timeout.h"
+#include "../../src/system.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// checks how late timeouts fire and measures the cost of keeping
+// -connections=N simulated connection timeouts up to date (touch on
+// every message and remove/add on every write chain) on the wheel
+// and on the scheduler list (the scheduler only holds 1024 entries)
+
+#define DEFAULT_CONNECTIONS	10000
+#define IDLE_TIMEOUT		30000
+#define FIRE_COUNT		64
+#define FIRE_STEP		25
+#define TOUCHES			50
+#define CHAINS			10
+#define SCHEDULER_MAX		1000
+#define LATE_MARGIN		50
+
+static struct timeout	fire_timeouts[FIRE_COUNT];
+static long		fire_expected[FIRE_COUNT];
+static atomic_int	fired = 0;
+static atomic_int	early = 0;
+static atomic_int	worst_late = 0;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void on_fire(void *arg)
+{
+	long i = (long)arg;
+	int late = (int)(sys_get_tick_count() - fire_expected[i]);
+	int worst;
+
+	if(late < 0)
+		atomic_add(&early, 1);
+	do{
+		worst = atomic_load(&worst_late);
+	}while(late > worst && atomic_compare_exchange(&worst_late, worst, late) != worst);
+	atomic_add(&fired, 1);
+}
+
+static void on_idle(void *arg)
+{
+	(void)arg;
+	LOG_ERROR("idle timeout fired during the benchmark");
+}
+
+static void bench_wheel(long count)
+{
+	struct timeout *timeouts;
+	long start, touch, chain;
+
+	timeouts = calloc(count, sizeof(struct timeout));
+	for(long i = 0; i < count; i++)
+		timeout_add(&timeouts[i], IDLE_TIMEOUT, on_idle, NULL);
+
+	start = get_nsec();
+	for(long i = 0; i < count * TOUCHES; i++)
+		timeout_touch(&timeouts[rand() % count], IDLE_TIMEOUT);
+	touch = (get_nsec() - start) / (count * TOUCHES);
+
+	start = get_nsec();
+	for(long i = 0; i < count * CHAINS; i++){
+		struct timeout *t = &timeouts[rand() % count];
+		timeout_remove(t);
+		timeout_add(t, IDLE_TIMEOUT, on_idle, NULL);
+	}
+	chain = (get_nsec() - start) / (count * CHAINS);
+
+	for(long i = 0; i < count; i++)
+		timeout_remove(&timeouts[i]);
+	free(timeouts);
+	LOG("wheel: %ld connections, touch = %ld nsec, remove + add = %ld nsec",
+		count, touch, chain);
+}
+
+static void bench_scheduler(long count)
+{
+	struct sch_entry **entries;
+	long start, touch, chain, i;
+
+	entries = calloc(count, sizeof(struct sch_entry*));
+	for(i = 0; i < count; i++){
+		entries[i] = scheduler_add(IDLE_TIMEOUT, on_idle, NULL);
+		if(entries[i] == NULL)
+			break;
+	}
+	count = i;
+
+	start = get_nsec();
+	for(i = 0; i < count * TOUCHES; i++)
+		scheduler_reschedule(IDLE_TIMEOUT, entries[rand() % count]);
+	touch = (get_nsec() - start) / (count * TOUCHES);
+
+	start = get_nsec();
+	for(i = 0; i < count * CHAINS; i++){
+		long j = rand() % count;
+		scheduler_remove(entries[j]);
+		entries[j] = scheduler_add(IDLE_TIMEOUT, on_idle, NULL);
+	}
+	chain = (get_nsec() - start) / (count * CHAINS);
+
+	for(i = 0; i < count; i++)
+		scheduler_remove(entries[i]);
+	free(entries);
+	LOG("scheduler: %ld connections, reschedule = %ld nsec, remove + add = %ld nsec",
+		count, touch, chain);
+}
+
+int main(int argc, char **argv)
+{
+	long connections, now;
+	int errors;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-connections", &connections) != 0)
+		connections = DEFAULT_CONNECTIONS;
+
+	errors = 0;
+	work_init();
+	scheduler_init();
+	timeout_init();
+
+	// timeouts fire after their delay and at most
+	// about one tick later
+	now = sys_get_tick_count();
+	for(long i = 0; i < FIRE_COUNT; i++){
+		fire_expected[i] = now + (i + 1) * FIRE_STEP;
+		timeout_add(&fire_timeouts[i], (i + 1) * FIRE_STEP, on_fire, (void*)i);
+	}
+	while(atomic_load(&fired) < FIRE_COUNT)
+		sched_yield();
+	LOG("fire: %d timeouts, fired early = %d, worst lateness = %d msec (tick = %d msec)",
+		FIRE_COUNT, early, worst_late, TIMEOUT_TICK);
+	if(early != 0 || worst_late > TIMEOUT_TICK + LATE_MARGIN){
+		LOG_ERROR("timeouts fired early or later than %d msec", TIMEOUT_TICK + LATE_MARGIN);
+		errors++;
+	}
+
+	// maintenance cost should stay flat on the wheel
+	for(long count = connections / 100; count <= connections; count *= 10){
+		if(count > 0)
+			bench_wheel(count);
+	}
+	for(long count = SCHEDULER_MAX / 100; count <= SCHEDULER_MAX; count *= 10)
+		bench_scheduler(count);
+
+	timeout_shutdown();
+	scheduler_shutdown();
+	work_shutdown();
+	return (errors == 0) ? 0 : 1;
+}
@@ -0,0 +1,188 @@
+#include "../../src/log.h"
+#include "../../src/work.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// dispatches a tick every TICK_MSEC from this thread and measures
+// how long it waits for a worker: first on an idle pool, then
+// while a world save runs as background work (yielding between
+// steps) and then with the same save and ticks as normal work
+// (all in one lane, like before the lanes existed); it also checks
+// a strand created on the critical lane runs ahead of normal work
+// that was queued before it
+
+#define TICKS		200
+#define TICK_MSEC	5
+#define SAVE_JOBS	1000
+#define SAVE_STEPS	10
+#define STEP_SPIN	20000
+#define QUEUED_JOBS	100
+
+struct save_job{
+	int	priority;
+	int	steps_left;
+};
+
+static struct save_job	save_jobs[SAVE_JOBS];
+static atomic_int	saves_left = 0;
+static atomic_int	ticks_done = 0;
+static long		tick_start;
+static long		tick_wait[TICKS];
+static volatile long	sink;
+static atomic_int	gate = 0;
+static atomic_int	order = 0;
+static volatile int	strand_position;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void save_step(void *arg)
+{
+	struct save_job *job = arg;
+	long x;
+
+	while(job->steps_left > 0){
+		x = job->steps_left;
+		for(int i = 0; i < STEP_SPIN; i++)
+			x = x * 31 + i;
+		sink = x;
+		job->steps_left -= 1;
+
+		// let the critical work through
+		if(job->steps_left > 0 && work_should_yield() != 0){
+			work_dispatch_priority(job->priority, save_step, job);
+			return;
+		}
+	}
+	atomic_add(&saves_left, -1);
+}
+
+static void tick(void *arg)
+{
+	long i = (long)arg;
+	tick_wait[i] = get_nsec() - tick_start;
+	atomic_add(&ticks_done, 1);
+}
+
+static void gate_job(void *arg)
+{
+	(void)arg;
+	while(atomic_load(&gate) == 0)
+		sched_yield();
+}
+
+static void queued_job(void *arg)
+{
+	(void)arg;
+	atomic_add(&order, 1);
+}
+
+static void strand_job(void *arg)
+{
+	(void)arg;
+	strand_position = atomic_fetch_add(&order, 1);
+}
+
+// a single worker is held by gate_job while normal work and then
+// the strand work are queued and returns where the strand ran
+static int strand_order(int priority)
+{
+	struct strand *s;
+
+	gate = 0;
+	order = 0;
+	strand_position = -1;
+	work_init_threads(1);
+	work_dispatch(gate_job, NULL);
+	for(int i = 0; i < QUEUED_JOBS; i++)
+		work_dispatch(queued_job, NULL);
+	if(strand_create_priority(&s, priority) != 0
+			|| strand_dispatch(s, strand_job, NULL) != 0){
+		atomic_store(&gate, 1);
+		work_shutdown();
+		return -1;
+	}
+	atomic_store(&gate, 1);
+	while(atomic_load(&order) < QUEUED_JOBS + 1)
+		sched_yield();
+	strand_destroy(s);
+	work_shutdown();
+	return strand_position;
+}
+
+static void run(const char *name, int save_priority, int tick_priority)
+{
+	struct timespec delay = {0, TICK_MSEC * 1000000L};
+	long start, total, worst, save_time;
+
+	if(save_priority >= 0){
+		saves_left = SAVE_JOBS;
+		for(long i = 0; i < SAVE_JOBS; i++){
+			save_jobs[i].priority = save_priority;
+			save_jobs[i].steps_left = SAVE_STEPS;
+			work_dispatch_priority(save_priority, save_step, &save_jobs[i]);
+		}
+	}
+
+	start = get_nsec();
+	ticks_done = 0;
+	for(long i = 0; i < TICKS; i++){
+		// wait for the previous tick before the next one
+		while(atomic_load(&ticks_done) < i)
+			sched_yield();
+		tick_start = get_nsec();
+		work_dispatch_priority(tick_priority, tick, (void*)i);
+		nanosleep(&delay, NULL);
+	}
+	while(atomic_load(&ticks_done) < TICKS)
+		sched_yield();
+	while(atomic_load(&saves_left) > 0)
+		sched_yield();
+	save_time = get_nsec() - start;
+
+	total = 0;
+	worst = 0;
+	for(long i = 0; i < TICKS; i++){
+		total += tick_wait[i];
+		if(tick_wait[i] > worst)
+			worst = tick_wait[i];
+	}
+	LOG("work_priority: %s: tick wait avg = %ld usec, max = %ld usec (done in %ld msec)",
+		name, total / TICKS / 1000, worst / 1000, save_time / 1000000);
+}
+
+int main(int argc, char **argv)
+{
+	long threads;
+	int critical, normal;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-threads", &threads) != 0)
+		threads = 0;
+
+	critical = strand_order(WORK_CRITICAL);
+	normal = strand_order(WORK_NORMAL);
+	LOG("work_priority: strand ran after %d (critical) and %d (normal) of %d queued jobs",
+		critical, normal, QUEUED_JOBS);
+
+	work_init_threads((int)threads);
+	run("idle", -1, WORK_CRITICAL);
+	run("background save", WORK_BACKGROUND, WORK_CRITICAL);
+	run("normal save", WORK_NORMAL, WORK_NORMAL);
+	work_shutdown();
+
+	if(critical < 0 || critical > QUEUED_JOBS / 2 || normal != QUEUED_JOBS){
+		LOG_ERROR("work_priority: critical strand didn't run ahead of the normal work");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+#include "../../src/log.h"
+#include "../../src/work.h"
+#include "../../src/system.h"
+#include "../../src/cmdline.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <sched.h>
+
+// runs the same amount of small jobs on 1 to N worker threads,
+// first dispatched from this thread (through the injection queue)
+// and then fanned out from the workers (through their deques and
+// stealing), and checks that every job ran exactly once; all the
+// jobs are dispatched at once so the injection queue has to grow
+
+#define ROOTS		2000
+#define FANOUT		256
+#define JOBS		(ROOTS * FANOUT)
+#define SPIN		50
+
+static atomic_int	ran[JOBS];
+static atomic_int	done = 0;
+static atomic_int	retries = 0;
+static volatile long	sink;
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void job(void *arg)
+{
+	long id = (long)arg;
+	long x = id;
+	for(int i = 0; i < SPIN; i++)
+		x = x * 31 + i;
+	sink = x;
+	atomic_add(&ran[id], 1);
+	atomic_add(&done, 1);
+}
+
+static void root(void *arg)
+{
+	long first = (long)arg * FANOUT;
+	for(long i = 0; i < FANOUT; i++){
+		while(work_dispatch(job, (void*)(first + i)) != 0){
+			atomic_add(&retries, 1);
+			sched_yield();
+		}
+	}
+}
+
+static void dispatch(void (*fp)(void*), long arg)
+{
+	while(work_dispatch(fp, (void*)arg) != 0){
+		atomic_add(&retries, 1);
+		sched_yield();
+	}
+}
+
+// waits for every job and returns how many didn't run exactly once
+static long finish(void)
+{
+	long wrong = 0;
+	while(atomic_load(&done) < JOBS)
+		sched_yield();
+	for(long i = 0; i < JOBS; i++){
+		if(ran[i] != 1)
+			wrong++;
+		ran[i] = 0;
+	}
+	done = 0;
+	return wrong;
+}
+
+int main(int argc, char **argv)
+{
+	struct work_stats stats;
+	long threads, start, external, fanout, wrong, failed;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-threads", &threads) != 0)
+		threads = sys_get_cpu_count();
+
+	failed = 0;
+	for(long n = 1; n <= threads; n++){
+		work_init_threads((int)n);
+
+		start = get_nsec();
+		for(long i = 0; i < JOBS; i++)
+			dispatch(job, i);
+		wrong = finish();
+		external = get_nsec() - start;
+
+		start = get_nsec();
+		for(long i = 0; i < ROOTS; i++)
+			dispatch(root, i);
+		wrong += finish();
+		fanout = get_nsec() - start;
+
+		LOG("work_steal: %ld threads, external = %ld msec (%ld nsec per job),"
+			" fan-out = %ld msec (%ld nsec per job), wrong = %ld, retries = %d",
+			n, external / 1000000, external / JOBS,
+			fanout / 1000000, fanout / JOBS, wrong, retries);
+		work_get_stats(&stats);
+		LOG("work_steal: injected = %ld, pending high = %ld, segments = %ld, stolen = %ld",
+			stats.injected[WORK_NORMAL], stats.pending_high[WORK_NORMAL],
+			stats.segments, stats.stolen);
+		retries = 0;
+		work_shutdown();
+		failed += wrong;
+	}
+
+	if(failed != 0){
+		LOG_ERROR("work_steal: %ld jobs didn't run exactly once", failed);
+		return 1;
+	}
+	return 0;
+}
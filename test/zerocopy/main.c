@@ -0,0 +1,235 @@
+#include "../../src/log.h"
+#include "../../src/cmdline.h"
+#include "../../src/network.h"
+#include "../../src/thread.h"
+#include "../../src/atomic.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+// sends -megabytes=N over loopback to a receiver process, first
+// with regular sends and then with zero-copy sends, and reports
+// the cpu time this process spent per gigabyte in each mode
+// (the receiver runs on its own process so its copies and
+// wakeups aren't counted); the receiver checks every byte and
+// reports how many it got back through a pipe; the last run turns
+// zero-copy off while its first sends wait for their notifications
+
+#define TEST_PORT		7198
+#define DEFAULT_MEGABYTES	1024
+#define WINDOW			4
+#define CHUNK_BUFS		16
+#define BUF_LEN			(64 * 1024)
+#define CHUNK_LEN		(CHUNK_BUFS * BUF_LEN)
+#define ZC_THRESHOLD		(16 * 1024)
+#define RUN_TIMEOUT		60
+
+static volatile int	running = 1;
+static atomic_int	chunks_issued = 0;
+static atomic_int	chunks_done = 0;
+static volatile int	failed = 0;
+static int		chunk_count;
+static long		bytes_sent = 0;
+static struct socket	*server = NULL;
+static struct socket	*peer = NULL;
+static char		data[WINDOW][CHUNK_LEN];
+static char		buffer[64];
+
+static long get_nsec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static long get_cpu_usec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void receiver(int out)
+{
+	static char buf[CHUNK_LEN];
+	struct sockaddr_in addr;
+	long received, bad;
+	int fd, ret;
+
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(TEST_PORT);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	while(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)
+		usleep(1000);
+	received = 0;
+	bad = 0;
+	while((ret = recv(fd, buf, sizeof(buf), 0)) > 0){
+		for(int i = 0; i < ret; i++)
+			bad += (buf[i] != 0x5A);
+		received += ret;
+	}
+	close(fd);
+	if(bad != 0)
+		received = -1;
+	if(write(out, &received, sizeof(long)) != sizeof(long))
+		exit(1);
+	exit(0);
+}
+
+static void net_thread(void *unused)
+{
+	(void)unused;
+	while(running != 0)
+		net_work(0);
+}
+
+static void on_accept(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)transfered;
+	(void)udata;
+	if(error == 0)
+		peer = sock;
+}
+
+static void send_chunk(long slot);
+static void on_write(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)sock;
+	if(error != 0 || transfered != CHUNK_LEN)
+		failed = 1;
+
+	// a completed write means its buffers may be reused
+	// so the window slot is refilled with the next chunk
+	if(atomic_fetch_add(&chunks_issued, 1) < chunk_count)
+		send_chunk((long)udata);
+	atomic_add(&chunks_done, 1);
+}
+
+static void on_read(struct socket *sock, int error, int transfered, void *udata)
+{
+	(void)sock;
+	(void)error;
+	(void)transfered;
+	(void)udata;
+}
+
+static void send_chunk(long slot)
+{
+	struct net_buf bufs[CHUNK_BUFS];
+	for(int i = 0; i < CHUNK_BUFS; i++){
+		bufs[i].buf = data[slot] + i * BUF_LEN;
+		bufs[i].len = BUF_LEN;
+	}
+	if(net_async_writev(peer, bufs, CHUNK_BUFS, on_write, (void*)slot) != 0)
+		failed = 1;
+}
+
+static void run(const char *mode, int disable)
+{
+	struct timespec wait;
+	long start, cpu, elapsed;
+	double gigabytes;
+
+	chunks_issued = 0;
+	chunks_done = 0;
+	wait.tv_sec = 0;
+	wait.tv_nsec = 10000000;
+
+	start = get_nsec();
+	cpu = get_cpu_usec();
+	for(long i = 0; i < WINDOW && atomic_fetch_add(&chunks_issued, 1) < chunk_count; i++)
+		send_chunk(i);
+	if(disable != 0)
+		net_socket_zerocopy(peer, 0);
+	while(chunks_done < chunk_count && failed == 0){
+		if(get_nsec() - start > RUN_TIMEOUT * 1000000000L){
+			LOG_ERROR("%s: sends didn't complete after %d seconds", mode, RUN_TIMEOUT);
+			failed = 1;
+			break;
+		}
+		nanosleep(&wait, NULL);
+	}
+	bytes_sent += (long)chunks_done * CHUNK_LEN;
+	cpu = get_cpu_usec() - cpu;
+	elapsed = get_nsec() - start;
+
+	gigabytes = (double)chunk_count * CHUNK_LEN / (1024.0 * 1024.0 * 1024.0);
+	LOG("%s: %.2f GB in %ld msec, cpu = %ld msec (%.1f msec per GB), failed = %d",
+		mode, gigabytes, elapsed / 1000000, cpu / 1000,
+		cpu / 1000.0 / gigabytes, failed);
+}
+
+int main(int argc, char **argv)
+{
+	struct thread *thr;
+	long megabytes, received;
+	int fds[2];
+	pid_t pid;
+
+	cmdl_init(argc, argv);
+	if(cmdl_get_long("-megabytes", &megabytes) != 0)
+		megabytes = DEFAULT_MEGABYTES;
+	chunk_count = (int)(megabytes * 1024 * 1024 / CHUNK_LEN);
+	memset(data, 0x5A, sizeof(data));
+
+	if(pipe(fds) == -1){
+		LOG_ERROR("failed to create pipe");
+		return -1;
+	}
+	pid = fork();
+	if(pid == 0)
+		receiver(fds[1]);
+
+	net_init(1);
+	server = net_server_socket(TEST_PORT, 0);
+	net_async_accept(server, on_accept, NULL);
+	thread_create(&thr, net_thread, NULL);
+	while(peer == NULL);
+
+	run("copy", 0);
+	if(net_socket_zerocopy(peer, ZC_THRESHOLD) == 0){
+		run("zerocopy", 0);
+		run("zerocopy off", 1);
+	}else{
+		LOG_ERROR("zero-copy sends are not supported");
+	}
+
+	// sends that never completed would keep the stream open
+	if(failed != 0){
+		LOG_ERROR("zero-copy test FAILED");
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return 1;
+	}
+
+	// cleanup (the receiver closes its side once the stream ends
+	// and the pending read wakes up the network thread)
+	net_socket_shutdown(peer, NET_SHUT_WR);
+	if(read(fds[0], &received, sizeof(long)) != sizeof(long))
+		received = -1;
+	waitpid(pid, NULL, 0);
+	running = 0;
+	net_async_read_some(peer, buffer, sizeof(buffer), on_read, NULL);
+	thread_join(thr);
+	thread_release(thr);
+	net_close(peer);
+	net_close(server);
+	net_work(0);
+	net_shutdown();
+
+	LOG("sent %ld bytes, received %ld bytes", bytes_sent, received);
+	if(failed != 0 || received != bytes_sent){
+		LOG_ERROR("zero-copy test FAILED");
+		return 1;
+	}
+	return 0;
+}